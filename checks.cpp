@@ -0,0 +1,589 @@
+// Benchmarks and checks of ImHTML that run headless, without a window or GL context. See the README for the modes.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <future>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// ImHTML
+#include "imhtml.hpp"
+
+// ImGui
+#include "imgui.h"
+
+// Adds the example fonts to the atlas and registers them as font families, like the example app
+static void SetupFonts(ImFontAtlas *fonts, ImHTML::Config *config) {
+  fonts->AddFontDefault();
+  ImFont *sans_font = fonts->AddFontFromFileTTF("fonts/NotoSans-Regular.ttf", 18.0f);
+  ImFont *mono_font = fonts->AddFontFromFileTTF("fonts/JetBrainsMono-Regular.ttf", 18.0f);
+
+  ImHTML::FontFamily mono = {.Regular = mono_font, .Bold = mono_font, .Italic = mono_font, .BoldItalic = mono_font};
+  config->FontFamilies["monospace"] = mono;
+  ImHTML::FontFamily sans = {.Regular = sans_font, .Bold = sans_font, .Italic = sans_font, .BoldItalic = sans_font};
+  config->FontFamilies["sans-serif"] = sans;
+}
+
+// Creates an ImGui context without a window or GL context
+static void BeginHeadless() {
+  ImGui::CreateContext();
+  ImGuiIO &io = ImGui::GetIO();
+  io.DisplaySize = ImVec2(1280, 800);
+  io.IniFilename = nullptr;
+  io.BackendFlags |= ImGuiBackendFlags_RendererHasTextures;  // lets the font atlas bake glyphs without a renderer
+  SetupFonts(io.Fonts, ImHTML::GetConfig());
+}
+
+static void EndHeadless() {
+  ImHTML::DestroyContext();
+  ImGui::DestroyContext();
+}
+
+// Runs one headless frame, calling draw inside a full-screen window
+static void HeadlessFrame(const std::function<void()> &draw) {
+  ImGui::GetIO().DeltaTime = 1.0f / 60.0f;
+  ImGui::NewFrame();
+  ImGui::SetNextWindowPos(ImVec2(0, 0));
+  ImGui::SetNextWindowSize(ImGui::GetIO().DisplaySize);
+  ImGui::Begin("Headless", nullptr, ImGuiWindowFlags_NoDecoration | ImGuiWindowFlags_NoSavedSettings);
+  draw();
+  ImGui::End();
+  ImGui::Render();
+}
+
+// Emits a display list captured with F12 without a window or GL context, and prints how long that took
+static int ReplayCapture(const char *path, int iterations) {
+  BeginHeadless();
+
+  ImGui::NewFrame();
+  bool replayed = false;
+  {
+    ImDrawList draw_list(ImGui::GetDrawListSharedData());
+    draw_list.Flags = ImDrawListFlags_AntiAliasedLines | ImDrawListFlags_AntiAliasedLinesUseTex |
+                      ImDrawListFlags_AntiAliasedFill | ImDrawListFlags_AllowVtxOffset;
+
+    ImHTML::ReplayStats stats;
+    replayed = ImHTML::ReplayDisplayList(path, &draw_list, iterations, &stats);
+    if (replayed) {
+      printf("%s: %d of %d ops, %d vertices, %d indices\n", path, stats.EmittedOps, stats.Ops, stats.Vertices,
+             stats.Indices);
+      printf("%d iterations: min %.3f ms, mean %.3f ms, max %.3f ms\n", stats.Iterations, stats.MinTime * 1000.0f,
+             stats.MeanTime * 1000.0f, stats.MaxTime * 1000.0f);
+    }
+  }
+  ImGui::EndFrame();
+  EndHeadless();
+
+  return replayed ? 0 : 1;
+}
+
+// A page of styled paragraphs that fills the screen with text
+static std::string TextDensePage(int paragraphs) {
+  static const char *words[] = {"lorem", "ipsum", "dolor", "sit", "amet", "consectetur", "adipiscing", "elit", "sed",
+                                "do", "eiusmod", "tempor", "incididunt", "ut", "labore", "et", "dolore", "magna"};
+  std::string html = "<html><body style=\"font-family: sans-serif; font-size: 14px; margin: 8px\">";
+  for (int p = 0; p < paragraphs; ++p) {
+    html += p % 5 == 0 ? "<p style=\"border: 1px solid #ccc; border-radius: 4px; padding: 4px\">" : "<p>";
+    for (int w = 0; w < 120; ++w) {
+      const char *word = words[(p * 7 + w * 3) % (int)(sizeof(words) / sizeof(words[0]))];
+      if (w % 17 == 0) {
+        html += std::string("<b>") + word + "</b> ";
+      } else if (w % 23 == 0) {
+        html += std::string("<code>") + word + "</code> ";
+      } else {
+        html += std::string(word) + " ";
+      }
+    }
+    html += "</p>";
+  }
+  return html + "</body></html>";
+}
+
+// Draws a full-screen, text-dense page with 1, 2, 4, ... up to one band per hardware thread and prints how long
+// emitting its geometry took for each
+static int BenchBands(int frames) {
+  BeginHeadless();
+  ImHTML::Config *config = ImHTML::GetConfig();
+  const int max_bands = std::max(1, (int)std::thread::hardware_concurrency());
+
+  const std::string html = TextDensePage(300);
+  for (int i = 0; i < 3; ++i) {
+    HeadlessFrame([&] { ImHTML::Canvas("bench", html.c_str()); });
+  }
+
+  std::vector<int> band_counts;
+  for (int bands = 1; bands < max_bands; bands *= 2) {
+    band_counts.push_back(bands);
+  }
+  band_counts.push_back(max_bands);
+
+  ImHTML::CanvasStats stats;
+  for (int bands : band_counts) {
+    config->DrawBands = bands;
+    float min_time = FLT_MAX, total_time = 0.0f;
+    for (int i = 0; i < frames + 2; ++i) {
+      HeadlessFrame([&] { ImHTML::Canvas("bench", html.c_str()); });
+      ImHTML::GetCanvasStats("bench", &stats);
+      if (i >= 2) {  // the first frames warm up the workers and caches
+        min_time = std::min(min_time, stats.EmitTime);
+        total_time += stats.EmitTime;
+      }
+    }
+    printf("%2d bands: min %.3f ms, mean %.3f ms (%d of %d ops, %d vertices)\n", bands, min_time * 1000.0f,
+           total_time / frames * 1000.0f, stats.EmittedOps, stats.DisplayListOps, stats.Vertices);
+  }
+
+  EndHeadless();
+  return 0;
+}
+
+// Times generating circle points per vertex with cosf/sinf, as the container did before its unit circle tables, and
+// by scaling a precomputed table, as it does now, for the point counts it uses: 8 and 12 segment corners (32 and 48
+// per circle), 64 segment ellipses and 128 segment conic wedges
+static int BenchArcs(int iterations) {
+  const int shapes = 1000;
+  std::vector<ImVec2> points;
+  float checksum = 0.0f;  // keeps the compiler from dropping the loops
+
+  for (int segments : {32, 48, 64, 128}) {
+    std::vector<ImVec2> table(segments);
+    for (int i = 0; i < segments; ++i) {
+      const double a = (double)i / (double)segments * 2.0 * 3.14159265358979323846;
+      table[i] = ImVec2((float)cos(a), (float)sin(a));
+    }
+    points.resize(segments);
+
+    auto time = [&](auto &&generate) {
+      const auto start = std::chrono::high_resolution_clock::now();
+      for (int it = 0; it < iterations; ++it) {
+        for (int shape = 0; shape < shapes; ++shape) {
+          const ImVec2 center((float)(shape % 40) * 32.0f, (float)(shape / 40) * 32.0f);
+          generate(center, 4.0f + (float)(shape % 12));
+          checksum += points[shape % segments].x;
+        }
+      }
+      const double seconds = std::chrono::duration<double>(std::chrono::high_resolution_clock::now() - start).count();
+      return seconds * 1e9 / ((double)iterations * shapes * segments);
+    };
+
+    const double trig = time([&](const ImVec2 &center, float radius) {
+      for (int i = 0; i < segments; ++i) {
+        const float a = ((float)i / (float)segments) * IM_PI * 2.0f;
+        points[i] = ImVec2(center.x + cosf(a) * radius, center.y + sinf(a) * radius);
+      }
+    });
+    const double tabled = time([&](const ImVec2 &center, float radius) {
+      for (int i = 0; i < segments; ++i) {
+        points[i] = ImVec2(center.x + table[i].x * radius, center.y + table[i].y * radius);
+      }
+    });
+    printf("%3d points: cosf/sinf %.2f ns/point, table %.2f ns/point (%.1fx)\n", segments, trig, tabled,
+           tabled > 0.0 ? trig / tabled : 0.0);
+  }
+
+  printf("checksum %g\n", checksum);
+  return 0;
+}
+
+// Runs Config::Executor jobs on a fixed number of threads, for timing how work scales with them
+class FixedThreadPool {
+ public:
+  explicit FixedThreadPool(int threads) {
+    for (int i = 0; i < threads; ++i) {
+      workers.emplace_back([this] { Work(); });
+    }
+  }
+
+  ~FixedThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread &worker : workers) {
+      worker.join();
+    }
+  }
+
+  void Run(std::function<void()> job) {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      jobs.push_back(std::move(job));
+    }
+    wake.notify_one();
+  }
+
+ private:
+  void Work() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (true) {
+      wake.wait(lock, [this] { return stopping || !jobs.empty(); });
+      if (jobs.empty()) {
+        return;
+      }
+      std::function<void()> job = std::move(jobs.front());
+      jobs.pop_front();
+      lock.unlock();
+      job();
+      lock.lock();
+    }
+  }
+
+  std::vector<std::thread> workers;
+  std::deque<std::function<void()>> jobs;
+  std::mutex mutex;
+  std::condition_variable wake;
+  bool stopping = false;
+};
+
+// Lays out a set of text-dense canvases with LayoutCanvases on 1, 2, 4, ... up to one thread per hardware thread and
+// prints how long parsing and laying them out, and laying them out again at a new width, took for each
+static int BenchLayout(int canvas_count, int rounds) {
+  BeginHeadless();
+  ImHTML::Config *config = ImHTML::GetConfig();
+  const int max_threads = std::max(1, (int)std::thread::hardware_concurrency());
+  std::vector<int> thread_counts;
+  for (int threads = 1; threads < max_threads; threads *= 2) {
+    thread_counts.push_back(threads);
+  }
+  thread_counts.push_back(max_threads);
+
+  std::vector<std::string> ids, pages;
+  for (int i = 0; i < canvas_count; ++i) {
+    ids.push_back("layout" + std::to_string(i));
+    pages.push_back(TextDensePage(20 + i % 5 * 10));
+  }
+
+  auto layout = [&](float width) {
+    std::vector<ImHTML::CanvasLayout> canvases;
+    for (int i = 0; i < canvas_count; ++i) {
+      canvases.push_back({.Id = ids[i].c_str(), .Html = pages[i].c_str(), .Width = width});
+    }
+    float seconds = 0.0f;
+    HeadlessFrame([&] {
+      const auto start = std::chrono::high_resolution_clock::now();
+      ImHTML::LayoutCanvases(canvases.data(), (int)canvases.size());
+      seconds = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+    });
+    return seconds;
+  };
+
+  for (int threads : thread_counts) {
+    FixedThreadPool pool(threads);
+    config->Executor = [&pool](ImHTML::JobPriority priority, std::function<void()> job) { pool.Run(std::move(job)); };
+
+    float parse_time = 0.0f, relayout_time = 0.0f;
+    for (int round = 0; round < rounds; ++round) {
+      // A changed document is parsed and laid out, a changed width only laid out
+      for (std::string &page : pages) {
+        page += "<!-- " + std::to_string(round) + " -->";
+      }
+      parse_time += layout(800.0f);
+      relayout_time += layout(640.0f);
+    }
+    printf("%2d threads: parse and layout %.2f ms, layout %.2f ms (%d canvases)\n", threads,
+           parse_time / rounds * 1000.0f, relayout_time / rounds * 1000.0f, canvas_count);
+
+    config->Executor = nullptr;
+  }
+
+  EndHeadless();
+  return 0;
+}
+
+// Prints the outcome of a check of the --check-* modes and returns it
+static bool Expect(bool ok, const char *what) {
+  printf("%s: %s\n", ok ? "ok" : "FAILED", what);
+  return ok;
+}
+
+// Number of draw commands in the current window that sample the given texture
+static int CountDrawsWithTexture(ImTextureID texture) {
+  int count = 0;
+  for (const ImDrawCmd &cmd : ImGui::GetWindowDrawList()->CmdBuffer) {
+    if (cmd.ElemCount > 0 && cmd.TexRef._TexData == nullptr && cmd.TexRef._TexID == texture) {
+      count++;
+    }
+  }
+  return count;
+}
+
+// Draws linear gradients through a CreateGradientTexture that keeps the ramp pixels, and checks the ramps and that
+// the canvas drew with them
+static int CheckGradients() {
+  BeginHeadless();
+  std::vector<std::vector<unsigned char>> ramps;
+  ImHTML::GetConfig()->CreateGradientTexture = [&ramps](const unsigned char *rgba, int width) {
+    ramps.emplace_back(rgba, rgba + width * 4);
+    return (ImTextureID)ramps.size();
+  };
+
+  const char *html =
+      "<div style=\"width: 256px; height: 32px; background: linear-gradient(to right, #000000, #ffffff)\"></div>"
+      "<div style=\"width: 256px; height: 32px; background: linear-gradient(to right, #ff0000, #00ff00, #0000ff)\">"
+      "</div>";
+  int draws[2] = {0, 0};
+  for (int frame = 0; frame < 2; ++frame) {
+    HeadlessFrame([&] {
+      ImHTML::Canvas("gradients", html);
+      draws[0] = CountDrawsWithTexture((ImTextureID)1);
+      draws[1] = CountDrawsWithTexture((ImTextureID)2);
+    });
+  }
+
+  // Both gradients have their own ramp, created once and drawn with every frame
+  int failures = 0;
+  failures += !Expect(ramps.size() == 2, "one ramp per gradient, reused in the second frame");
+  failures += !Expect(draws[0] > 0 && draws[1] > 0, "gradients drawn with their ramp textures");
+  if (ramps.size() != 2) {
+    EndHeadless();
+    return 1;
+  }
+
+  auto close_to = [](const unsigned char *px, int r, int g, int b) {
+    return abs(px[0] - r) <= 3 && abs(px[1] - g) <= 3 && abs(px[2] - b) <= 3 && px[3] == 255;
+  };
+
+  const std::vector<unsigned char> &gray = ramps[0];
+  const std::vector<unsigned char> &rgb = ramps[1];
+  const int last = (int)gray.size() / 4 - 1;
+  if (!Expect(last >= 2 && rgb.size() == gray.size(), "ramps have texels")) {
+    EndHeadless();
+    return 1;
+  }
+
+  bool monotonic = true;
+  for (int i = 1; i <= last; ++i) {
+    const unsigned char *px = &gray[i * 4];
+    monotonic &= px[0] >= px[-4] && px[0] == px[1] && px[0] == px[2] && px[3] == 255;
+  }
+  const int mid = last / 2 * 255 / last;
+  failures += !Expect(monotonic, "black to white ramp is gray and increases monotonically");
+  failures +=
+      !Expect(close_to(&gray[0], 0, 0, 0) && close_to(&gray[last * 4], 255, 255, 255), "ramp ends at the stops");
+  failures += !Expect(close_to(&gray[last / 2 * 4], mid, mid, mid), "ramp is linear");
+  failures += !Expect(close_to(&rgb[0], 255, 0, 0) && close_to(&rgb[last * 4], 0, 0, 255) &&
+                          (close_to(&rgb[last / 2 * 4], 0, 255, 0) || close_to(&rgb[(last + 1) / 2 * 4], 0, 255, 0)),
+                      "three stop ramp passes through its middle stop");
+
+  EndHeadless();
+  return failures == 0 ? 0 : 1;
+}
+
+// Rasterizes draw data in submission order with alpha blending into an RGB image. Every texture is sampled as one flat
+// colour derived from its ID and the font atlas as white: coarse, but enough to see which primitive covers which.
+static std::vector<float> RasterizeDrawData(const ImDrawData *data, int width, int height) {
+  std::vector<float> rgb((size_t)width * height * 3, 0.0f);
+  for (const ImDrawList *list : data->CmdLists) {
+    for (const ImDrawCmd &cmd : list->CmdBuffer) {
+      if (cmd.UserCallback) {
+        continue;
+      }
+
+      ImVec4 tint(1.0f, 1.0f, 1.0f, 1.0f);
+      if (!cmd.TexRef._TexData) {
+        const ImU64 id = (ImU64)cmd.TexRef._TexID;
+        tint = ImVec4((float)(id * 37 % 256) / 255.0f, (float)(id * 91 % 256) / 255.0f,
+                      (float)(id * 173 % 256) / 255.0f, 1.0f);
+      }
+
+      for (unsigned int e = 0; e + 2 < cmd.ElemCount; e += 3) {
+        const ImDrawVert *v[3];
+        for (int k = 0; k < 3; ++k) {
+          v[k] = &list->VtxBuffer[cmd.VtxOffset + list->IdxBuffer[cmd.IdxOffset + e + k]];
+        }
+        const float area = (v[1]->pos.x - v[0]->pos.x) * (v[2]->pos.y - v[0]->pos.y) -
+                           (v[1]->pos.y - v[0]->pos.y) * (v[2]->pos.x - v[0]->pos.x);
+        if (area == 0.0f) {
+          continue;
+        }
+
+        const int x0 = std::max({0, (int)cmd.ClipRect.x, (int)std::min({v[0]->pos.x, v[1]->pos.x, v[2]->pos.x})});
+        const int y0 = std::max({0, (int)cmd.ClipRect.y, (int)std::min({v[0]->pos.y, v[1]->pos.y, v[2]->pos.y})});
+        const int x1 = std::min({width, (int)ceilf(cmd.ClipRect.z),
+                                 (int)ceilf(std::max({v[0]->pos.x, v[1]->pos.x, v[2]->pos.x}))});
+        const int y1 = std::min({height, (int)ceilf(cmd.ClipRect.w),
+                                 (int)ceilf(std::max({v[0]->pos.y, v[1]->pos.y, v[2]->pos.y}))});
+        for (int y = y0; y < y1; ++y) {
+          for (int x = x0; x < x1; ++x) {
+            const ImVec2 p((float)x + 0.5f, (float)y + 0.5f);
+            float w[3];
+            for (int k = 0; k < 3; ++k) {
+              const ImVec2 &a = v[(k + 1) % 3]->pos;
+              const ImVec2 &b = v[(k + 2) % 3]->pos;
+              w[k] = ((b.x - a.x) * (p.y - a.y) - (b.y - a.y) * (p.x - a.x)) / area;
+            }
+            if (w[0] < 0.0f || w[1] < 0.0f || w[2] < 0.0f) {
+              continue;
+            }
+
+            ImVec4 col(0, 0, 0, 0);
+            for (int k = 0; k < 3; ++k) {
+              const ImVec4 c = ImGui::ColorConvertU32ToFloat4(v[k]->col);
+              col = ImVec4(col.x + c.x * w[k], col.y + c.y * w[k], col.z + c.z * w[k], col.w + c.w * w[k]);
+            }
+            float *dst = &rgb[((size_t)y * width + x) * 3];
+            const float alpha = col.w * tint.w;
+            dst[0] += (col.x * tint.x - dst[0]) * alpha;
+            dst[1] += (col.y * tint.y - dst[1]) * alpha;
+            dst[2] += (col.z * tint.z - dst[2]) * alpha;
+          }
+        }
+      }
+    }
+  }
+  return rgb;
+}
+
+// Draws a page of icons, text and overlapping boxes with Config::BatchByTexture off and on, and checks that batching
+// needs fewer draw commands while every pixel comes out the same
+static int CheckBatching() {
+  BeginHeadless();
+  ImHTML::Config *config = ImHTML::GetConfig();
+  config->GetImageMeta = [](const char *src, const char *baseurl) { return ImHTML::ImageMeta{24, 24}; };
+  config->GetImageTexture = [](const char *src, const char *baseurl) {
+    return (ImTextureID)(100 + std::hash<std::string>()(src) % 1000);
+  };
+
+  // Rows alternate between three icons and text, which batching groups by texture. The stack at the end draws an icon
+  // over a translucent box over the same icon, so the last icon must not join the first one's batch.
+  std::string html = "<div style=\"font-family: sans-serif\">";
+  for (int row = 0; row < 16; ++row) {
+    html += "<div><img src=\"icon" + std::to_string(row % 3) + ".png\" width=\"24\" height=\"24\"> Row " +
+            std::to_string(row) + " <span style=\"background: #ddd\">label</span></div>";
+  }
+  html += "<div style=\"position: relative; height: 80px\">"
+          "<img src=\"icon0.png\" style=\"position: absolute; left: 0; top: 0; width: 48px; height: 48px\">"
+          "<div style=\"position: absolute; left: 12px; top: 12px; width: 48px; height: 48px; "
+          "background: rgba(255, 0, 0, 0.5)\"></div>"
+          "<img src=\"icon0.png\" style=\"position: absolute; left: 24px; top: 24px; width: 24px; height: 24px\">"
+          "</div></div>";
+
+  const ImVec2 size = ImGui::GetIO().DisplaySize;
+  std::vector<float> pixels[2];
+  ImHTML::CanvasStats stats[2];
+  for (int batched = 0; batched < 2; ++batched) {
+    config->BatchByTexture = batched != 0;
+    for (int frame = 0; frame < 2; ++frame) {
+      HeadlessFrame([&] { ImHTML::Canvas("batching", html.c_str()); });
+    }
+    ImHTML::GetCanvasStats("batching", &stats[batched]);
+    pixels[batched] = RasterizeDrawData(ImGui::GetDrawData(), (int)size.x, (int)size.y);
+  }
+
+  int covered = 0, differing = 0;
+  for (size_t i = 0; i < pixels[0].size(); ++i) {
+    covered += pixels[0][i] > 0.0f;
+    differing += fabsf(pixels[0][i] - pixels[1][i]) > 1e-4f;
+  }
+  printf("draw commands: %d unbatched, %d batched\n", stats[0].DrawCommands, stats[1].DrawCommands);
+
+  int failures = 0;
+  failures += !Expect(covered > 0, "page drawn");
+  failures += !Expect(stats[1].DrawCommands < stats[0].DrawCommands, "batching reduces draw commands");
+  failures += !Expect(differing == 0, "batched output is identical, overlapping primitives keep their order");
+  EndHeadless();
+  return failures == 0 ? 0 : 1;
+}
+
+// Number of vertices in the current window with exactly the given colour
+static int CountVerticesWithColor(ImU32 color) {
+  int count = 0;
+  for (const ImDrawVert &vertex : ImGui::GetWindowDrawList()->VtxBuffer) {
+    count += vertex.col == color;
+  }
+  return count;
+}
+
+// Serves stylesheets through a LoadCSSAsync whose futures are only fulfilled later, and checks that canvases wait for
+// them (or draw unstyled with PaintBeforeStyles) and are parsed again with the styles once they arrive
+static int CheckAsyncCSS() {
+  BeginHeadless();
+  std::map<std::string, std::promise<std::string>> pending;
+  std::map<std::string, int> requests;
+  ImHTML::Config *config = ImHTML::GetConfig();
+  config->LoadCSSAsync = [&](const char *url, const char *baseurl) {
+    requests[url]++;
+    return pending[url].get_future().share();
+  };
+
+  const ImU32 red = IM_COL32(255, 0, 0, 255);
+  int failures = 0;
+  for (int paint_before_styles = 0; paint_before_styles < 2; ++paint_before_styles) {
+    config->PaintBeforeStyles = paint_before_styles != 0;
+    const std::string url = paint_before_styles ? "unstyled.css" : "deferred.css";
+    const std::string html = "<html><head><link rel=\"stylesheet\" href=\"" + url +
+                             "\"></head><body><div class=\"box\">Red once styled</div></body></html>";
+
+    // Counted from the window draw list, a canvas that is not drawn leaves its stats alone
+    int red_vertices = 0, canvas_vertices = 0;
+    for (int frame = 0; frame < 3; ++frame) {
+      HeadlessFrame([&] {
+        const int first_vertex = ImGui::GetWindowDrawList()->VtxBuffer.Size;
+        ImHTML::Canvas(url.c_str(), html.c_str());
+        canvas_vertices = ImGui::GetWindowDrawList()->VtxBuffer.Size - first_vertex;
+        red_vertices = CountVerticesWithColor(red);
+      });
+    }
+    if (paint_before_styles) {
+      failures += !Expect(canvas_vertices > 0 && red_vertices == 0, "drawn unstyled while the stylesheet loads");
+    } else {
+      failures += !Expect(canvas_vertices == 0, "not drawn while the stylesheet loads");
+    }
+
+    pending[url].set_value(".box { background-color: #ff0000; height: 200px; }");
+    HeadlessFrame([&] {
+      ImHTML::Canvas(url.c_str(), html.c_str());
+      red_vertices = CountVerticesWithColor(red);
+    });
+    failures += !Expect(red_vertices > 0, "parsed again with the stylesheet once it arrived");
+    failures += !Expect(requests[url] == 1, "stylesheet requested once");
+  }
+
+  EndHeadless();
+  return failures == 0 ? 0 : 1;
+}
+
+int main(int argc, char **argv) {
+  // imhtml_checks --replay capture.imdl [iterations]
+  if (argc >= 3 && strcmp(argv[1], "--replay") == 0) {
+    return ReplayCapture(argv[2], argc >= 4 ? atoi(argv[3]) : 100);
+  }
+  // imhtml_checks --bench-bands [frames]
+  if (argc >= 2 && strcmp(argv[1], "--bench-bands") == 0) {
+    return BenchBands(argc >= 3 ? std::max(1, atoi(argv[2])) : 100);
+  }
+  // imhtml_checks --bench-arcs [iterations]
+  if (argc >= 2 && strcmp(argv[1], "--bench-arcs") == 0) {
+    return BenchArcs(argc >= 3 ? std::max(1, atoi(argv[2])) : 1000);
+  }
+  // imhtml_checks --bench-layout [canvases] [rounds]
+  if (argc >= 2 && strcmp(argv[1], "--bench-layout") == 0) {
+    return BenchLayout(argc >= 3 ? std::max(1, atoi(argv[2])) : 16, argc >= 4 ? std::max(1, atoi(argv[3])) : 10);
+  }
+  if (argc >= 2 && strcmp(argv[1], "--check-gradients") == 0) {
+    return CheckGradients();
+  }
+  if (argc >= 2 && strcmp(argv[1], "--check-batching") == 0) {
+    return CheckBatching();
+  }
+  if (argc >= 2 && strcmp(argv[1], "--check-async-css") == 0) {
+    return CheckAsyncCSS();
+  }
+
+  fprintf(stderr,
+          "Usage: imhtml_checks --replay capture.imdl [iterations] | --bench-bands [frames] | --bench-arcs "
+          "[iterations] | --bench-layout [canvases] [rounds] | --check-gradients | --check-batching | "
+          "--check-async-css\n");
+  return 1;
+}
@@ -1,8 +1,22 @@
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cerrno>
 #include <chrono>
-#include <fstream>
+#include <climits>
+#include <condition_variable>
+#include <cstring>
+#include <deque>
+#include <future>
 #include <iostream>
+#include <memory>
+#include <mutex>
+#include <set>
 #include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 #define IMGUI_DEFINE_MATH_OPERATORS
 
@@ -13,6 +27,23 @@
 #include "litehtml/render_item.h"
 #include "litehtml/types.h"
 
+#ifdef _WIN32
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#include <windows.h>
+// winuser.h maps LoadImage to LoadImageA/W, which would rename Config::LoadImage
+#undef LoadImage
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace ImHTML {
 
 /**
@@ -49,1087 +80,5355 @@ class CustomElement : public litehtml::html_tag {
                        const std::shared_ptr<litehtml::render_item>& ri) override;
 };
 
-std::string DefaultFileLoader(const char* url, const char* baseurl) {
-  if (url == nullptr || strlen(url) == 0) {
-    return "";
+namespace {
+
+// Identifies a version of a file, a changed stamp means the cached mapping is outdated
+struct FileStamp {
+  long long MTime = 0;
+  long long Size = -1;
+
+  bool operator==(const FileStamp& other) const { return MTime == other.MTime && Size == other.Size; }
+};
+
+static bool statFile(const char* path, FileStamp* stamp) {
+#ifdef _WIN32
+  WIN32_FILE_ATTRIBUTE_DATA attributes;
+  if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attributes) ||
+      (attributes.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)) {
+    return false;
   }
+  stamp->MTime = ((long long)attributes.ftLastWriteTime.dwHighDateTime << 32) | attributes.ftLastWriteTime.dwLowDateTime;
+  stamp->Size = ((long long)attributes.nFileSizeHigh << 32) | attributes.nFileSizeLow;
+#else
+  struct stat info;
+  if (stat(path, &info) != 0 || !S_ISREG(info.st_mode)) {
+    return false;
+  }
+#if defined(__APPLE__)
+  stamp->MTime = (long long)info.st_mtimespec.tv_sec * 1000000000ll + info.st_mtimespec.tv_nsec;
+#elif defined(__linux__)
+  stamp->MTime = (long long)info.st_mtim.tv_sec * 1000000000ll + info.st_mtim.tv_nsec;
+#else
+  stamp->MTime = (long long)info.st_mtime;
+#endif
+  stamp->Size = (long long)info.st_size;
+#endif
+  return true;
+}
 
-  std::ifstream file(url);
-  if (!file.is_open()) {
-    IMHTML_PRINTF("[ImHTML] Failed to open file: %s\n", url);
-    return "";
+/**
+ * Contents of a whole file, read into memory or, from kMapThreshold bytes on, mapped read-only and unmapped on
+ * destruction.
+ *
+ * A mapping reflects later writes to the file. If the file is truncated while mapped, touching the pages past the new
+ * end raises SIGBUS (an access violation on Windows), so only files too large to copy cheaply are mapped, and the size
+ * is taken from the open handle rather than an earlier stat.
+ */
+class MappedFile {
+ private:
+  const char* data = nullptr;
+  size_t size = 0;
+  std::string owned;  // contents of a file that was read instead of mapped
+  bool mapped = false;
+#ifdef _WIN32
+  HANDLE mapping = nullptr;
+#endif
+
+ public:
+  static constexpr size_t kMapThreshold = 1 << 20;
+
+  MappedFile() = default;
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  ~MappedFile() {
+    if (!mapped) {
+      return;
+    }
+#ifdef _WIN32
+    if (data) UnmapViewOfFile(data);
+    if (mapping) CloseHandle(mapping);
+#else
+    if (data) munmap((void*)data, size);
+#endif
   }
 
-  std::string content((std::istreambuf_iterator<char>(file)), (std::istreambuf_iterator<char>()));
-  return content;
-}
+  static std::shared_ptr<MappedFile> open(const char* path) {
+    auto file = std::make_shared<MappedFile>();
 
-namespace {
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE, nullptr,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+    if (handle == INVALID_HANDLE_VALUE) {
+      return nullptr;
+    }
+    LARGE_INTEGER file_size;
+    if (!GetFileSizeEx(handle, &file_size)) {
+      CloseHandle(handle);
+      return nullptr;
+    }
+    const size_t size = (size_t)file_size.QuadPart;
+
+    bool ok = true;
+    if (size > 0 && size < kMapThreshold) {
+      file->owned.resize(size);
+      DWORD read = 0;
+      ok = ReadFile(handle, file->owned.data(), (DWORD)size, &read, nullptr) != 0;
+      file->owned.resize(read);
+    } else if (size > 0) {
+      file->mapping = CreateFileMappingA(handle, nullptr, PAGE_READONLY, 0, 0, nullptr);
+      file->data = file->mapping ? (const char*)MapViewOfFile(file->mapping, FILE_MAP_READ, 0, 0, size) : nullptr;
+      file->mapped = true;
+      file->size = size;
+      ok = file->data != nullptr;
+    }
+    CloseHandle(handle);
+#else
+    int fd = ::open(path, O_RDONLY);
+    if (fd < 0) {
+      return nullptr;
+    }
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+      close(fd);
+      return nullptr;
+    }
+    const size_t size = (size_t)info.st_size;
+
+    bool ok = true;
+    if (size > 0 && size < kMapThreshold) {
+      // Read until EOF, so a file that shrank since fstat just comes out shorter
+      file->owned.resize(size);
+      size_t total = 0;
+      while (total < size) {
+        const ssize_t count = ::read(fd, file->owned.data() + total, size - total);
+        if (count < 0 && errno == EINTR) {
+          continue;
+        }
+        if (count <= 0) {
+          ok = count == 0;
+          break;
+        }
+        total += (size_t)count;
+      }
+      file->owned.resize(total);
+    } else if (size > 0) {
+      void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+      file->data = data == MAP_FAILED ? nullptr : (const char*)data;
+      file->mapped = true;
+      file->size = size;
+      ok = file->data != nullptr;
+    }
+    close(fd);
+#endif
+
+    if (!ok) {
+      return nullptr;
+    }
+    if (!file->mapped) {
+      file->data = file->owned.data();
+      file->size = file->owned.size();
+    }
+    return file;
+  }
 
-Config config = Config{
-    .BaseFontSize = 16,
-    .LoadCSS = DefaultFileLoader,
+  std::string_view view() const { return std::string_view(data ? data : "", size); }
 };
 
-std::vector<Config> configStack;
-std::unordered_map<std::string, CustomElementDrawFunction> customElements;
+struct CachedFile {
+  FileStamp Stamp;
+  std::shared_ptr<MappedFile> File;
+  unsigned long long LastUse = 0;
+};
 
-Config getCurrentConfig() {
-  if (configStack.empty()) {
-    return config;
-  }
-  return configStack.back();
-}
+// Files by path, shared by all loads. Loaders may run on worker threads.
+std::mutex fileCacheMutex;
+std::unordered_map<std::string, CachedFile> fileCache;
+unsigned long long fileCacheUses = 0;
+constexpr size_t kMaxCachedFiles = 64;
 
-static ImFont* getFontFromFamily(const FontFamily& family, FontStyle style) {
-  switch (style) {
-    case FontStyle::Regular:
-      return family.Regular;
-    case FontStyle::Bold:
-      return family.Bold ? family.Bold : family.Regular;
-    case FontStyle::Italic:
-      return family.Italic ? family.Italic : family.Regular;
-    case FontStyle::BoldItalic:
-      if (family.BoldItalic) return family.BoldItalic;
-      if (family.Bold) return family.Bold;
-      if (family.Italic) return family.Italic;
-      return family.Regular;
-    default:
-      return family.Regular;
+/**
+ * Returns the cached contents of a file, reading or mapping it again if it changed since. Beyond kMaxCachedFiles the
+ * least recently used file is dropped, views of it stay valid. The file is read outside the lock, so loads of other
+ * files are not held up by it.
+ */
+static std::shared_ptr<MappedFile> mapCachedFile(const char* path) {
+  FileStamp stamp;
+  if (!statFile(path, &stamp)) {
+    std::lock_guard<std::mutex> lock(fileCacheMutex);
+    fileCache.erase(path);
+    return nullptr;
   }
-}
 
-static ImFont* resolveFont(const Config& cfg, const std::string& family_name, FontStyle style) {
-  if (!family_name.empty()) {
-    auto it = cfg.FontFamilies.find(family_name);
-    if (it != cfg.FontFamilies.end()) {
-      if (ImFont* f = getFontFromFamily(it->second, style)) {
-        return f;
-      }
+  {
+    std::lock_guard<std::mutex> lock(fileCacheMutex);
+    auto it = fileCache.find(path);
+    if (it != fileCache.end() && it->second.File && it->second.Stamp == stamp) {
+      it->second.LastUse = ++fileCacheUses;
+      return it->second.File;
     }
   }
 
-  if (ImFont* f = getFontFromFamily(cfg.DefaultFont, style)) {
-    return f;
+  std::shared_ptr<MappedFile> file = MappedFile::open(path);
+
+  std::lock_guard<std::mutex> lock(fileCacheMutex);
+  if (!file) {
+    fileCache.erase(path);
+    return nullptr;
   }
 
-  return ImGui::GetFont();
+  // Another thread may have read the same version meanwhile, either copy will do
+  CachedFile& cached = fileCache[path];
+  cached.LastUse = ++fileCacheUses;
+  cached.File = file;
+  cached.Stamp = stamp;
+
+  if (fileCache.size() > kMaxCachedFiles) {
+    auto oldest = std::min_element(fileCache.begin(), fileCache.end(), [](const auto& a, const auto& b) {
+      return a.second.LastUse < b.second.LastUse;
+    });
+    fileCache.erase(oldest);
+  }
+  return file;
 }
 
 }  // namespace
 
-void CustomElement::draw_background(litehtml::uint_ptr hdc, litehtml::pixel_t x, litehtml::pixel_t y,
-                                    const litehtml::position* clip, const std::shared_ptr<litehtml::render_item>& ri) {
-  // Let the base class draw background color/image and borders first.
-  litehtml::html_tag::draw_background(hdc, x, y, clip, ri);
-
-  // ri->pos() is the element's own content box relative to its parent.
-  // x/y carry the accumulated offset from all ancestors.
-  // Together they give the absolute document position and correct size.
-  litehtml::position pos = ri->pos();
-  pos.x += x;
-  pos.y += y;
+FileView DefaultFileView(const char* url) {
+  if (url == nullptr || strlen(url) == 0) {
+    return FileView{};
+  }
 
-  if (customElements.find(this->tag) != customElements.end()) {
-    ImVec2 cursor = ImGui::GetCursorScreenPos();
-    customElements[this->tag](
-        ImRect(cursor + ImVec2(pos.x, pos.y), cursor + ImVec2(pos.x + pos.width, pos.y + pos.height)),
-        this->attributes);
-    ImGui::SetCursorScreenPos(cursor);
+  std::shared_ptr<MappedFile> file = mapCachedFile(url);
+  if (!file) {
+    IMHTML_PRINTF("[ImHTML] Failed to open file: %s\n", url);
+    return FileView{};
   }
+
+  return FileView{file->view(), file};
 }
 
-class BrowserContainer : public litehtml::document_container {
- private:
-  ImVec2 bottomRight = ImVec2(0, 0);
-  std::string title = "Browser";
-  std::string loadUrl = "";
-  std::string currentUrl = "";
-  std::vector<std::string> history = {};
-  float width;
-  Config config;
+std::string DefaultFileLoader(const char* url, const char* baseurl) {
+  FileView file = DefaultFileView(url);
+  return std::string(file.Data);
+}
 
- public:
-  BrowserContainer(float width) : width(width) {}
+namespace {
 
-  void reset() { bottomRight = ImVec2(0, 0); }
-  ImVec2 get_bottom_right() { return bottomRight; }
-  void push_bottom_right(ImVec2 point) {
-    bottomRight.x = std::max(bottomRight.x, point.x);
-    bottomRight.y = std::max(bottomRight.y, point.y);
-  }
-  std::string get_title() { return title; }
-  std::string pop_load_url() {
-    if (loadUrl.empty()) {
-      return "";
-    }
+// Context of the calling thread, the default context when not set
+thread_local Context* currentContext = nullptr;
+// Set once the calling thread used the default context, which counts as its context for CreateContext
+thread_local bool usingDefaultContext = false;
 
-    auto url = loadUrl;
-    loadUrl = "";
-    return url;
-  }
-  void go_back() {
-    if (!history.empty()) {
-      loadUrl = history.back();
-      history.pop_back();
+static Context& ctx();
+static std::function<void()> bindContext(std::function<void()> job);
+const Config& getCurrentConfig();
+
+static std::unordered_map<std::string, CustomElementDrawFunction>& customElements();
+
+struct GradientRamp {
+  ImTextureID Texture = 0;
+  int LastUsedFrame = 0;
+};
+
+// Gradient ramp textures created through Config::CreateGradientTexture, keyed by a hash of the colour stops
+static std::unordered_map<ImU64, GradientRamp>& gradientTextures();
+constexpr size_t kMaxGradientRamps = 256;
+
+/**
+ * Destroys the least recently drawn ramp texture. Ramps drawn this or the previous frame are kept, that frame may
+ * still be in flight.
+ */
+static void evictGradientRamp(const Config& cfg) {
+  const int frame = ImGui::GetFrameCount();
+  auto oldest = gradientTextures().end();
+  for (auto it = gradientTextures().begin(); it != gradientTextures().end(); ++it) {
+    if (it->second.LastUsedFrame < frame - 1 &&
+        (oldest == gradientTextures().end() || it->second.LastUsedFrame < oldest->second.LastUsedFrame)) {
+      oldest = it;
     }
   }
-  bool can_go_back() { return !history.empty(); }
-  void set_current_url(std::string url) { currentUrl = url; }
-  std::string get_current_url() { return currentUrl; }
-  void refresh() { loadUrl = currentUrl; }
-  void set_config(Config config) { this->config = config; }
+  if (oldest != gradientTextures().end()) {
+    cfg.DestroyTexture(oldest->second.Texture);
+    gradientTextures().erase(oldest);
+  }
+}
 
-  //
-  // Font functions
-  //
+/**
+ * Key of a tessellated shape. Only plain 4 byte fields, so it can be hashed and compared bytewise.
+ */
+struct ShapeKey {
+  int Kind;
+  float Width, Height;
+  float Radii[4];   // top-left, top-right, bottom-right, bottom-left
+  float Widths[4];  // top, right, bottom, left
+  ImU32 Colors[4];  // top, right, bottom, left
+  ImDrawListFlags Flags;
+  float FringeScale;
+  float CircleSegmentMaxError;
+};
 
-  struct ResolvedFont {
-    ImFont* Font = nullptr;
-    FontStyle Style = FontStyle::Regular;
-    std::string Family;
-    float Size = 16.0f;
-    litehtml::font_metrics Metrics{};
-  };
+/**
+ * A finished fill or border mesh, relative to the top-left corner of its box.
+ */
+struct ShapeMesh {
+  ShapeKey Key;
+  std::vector<ImDrawVert> Vertices;
+  std::vector<ImDrawIdx> Indices;
+};
 
-  std::vector<std::unique_ptr<ResolvedFont>> fonts_;
+struct CachedShape {
+  std::shared_ptr<const ShapeMesh> Mesh;
+  unsigned long long LastUse = 0;
+};
 
-  static ResolvedFont* from_handle(litehtml::uint_ptr hFont) { return reinterpret_cast<ResolvedFont*>(hFont); }
+// Tessellated rounded fills and borders, replayed with a translation instead of re-tessellating every frame. Meshes
+// are shared, so draw bands copy them without holding the cache lock while another band evicts entries.
+static std::unordered_map<ImU64, CachedShape>& shapeCache();
+static unsigned long long& shapeCacheUses();
+constexpr size_t kMaxCachedShapes = 4096;
 
-  virtual litehtml::uint_ptr create_font(const litehtml::font_description& descr, const litehtml::document* doc,
-                                         litehtml::font_metrics* fm) override {
-    bool bold = descr.weight > 400;
-    bool italic = descr.style == litehtml::font_style_italic;
+/**
+ * Drops the least recently used half of the shape cache.
+ */
+static void trimShapeCache() {
+  std::vector<unsigned long long> uses;
+  uses.reserve(shapeCache().size());
+  for (const auto& [hash, shape] : shapeCache()) {
+    uses.push_back(shape.LastUse);
+  }
+  if (uses.empty()) {
+    return;
+  }
 
-    FontStyle font_style = FontStyle::Regular;
-    if (bold && italic) {
-      font_style = FontStyle::BoldItalic;
-    } else if (bold) {
-      font_style = FontStyle::Bold;
-    } else if (italic) {
-      font_style = FontStyle::Italic;
-    }
+  std::nth_element(uses.begin(), uses.begin() + uses.size() / 2, uses.end());
+  const unsigned long long cutoff = uses[uses.size() / 2];
+  for (auto it = shapeCache().begin(); it != shapeCache().end();) {
+    it = it->second.LastUse < cutoff ? shapeCache().erase(it) : std::next(it);
+  }
+}
 
-    ImFont* font = resolveFont(config, descr.family, font_style);
+static ImU64 hashBytes(const void* data, size_t size, ImU64 seed = 14695981039346656037ull) {
+  // FNV-1a
+  const unsigned char* bytes = (const unsigned char*)data;
+  ImU64 hash = seed;
+  for (size_t i = 0; i < size; ++i) {
+    hash ^= bytes[i];
+    hash *= 1099511628211ull;
+  }
+  return hash;
+}
 
-    auto rf = std::make_unique<ResolvedFont>();
-    rf->Font = font;
-    rf->Style = font_style;
-    rf->Family = descr.family;
-    rf->Size = descr.size;
+/**
+ * Default executor: a work-stealing pool with one set of priority queues per worker. Jobs are spread round-robin,
+ * idle workers steal from the back of other workers' queues, and higher priorities always run first.
+ */
+class WorkerPool {
+ private:
+  static constexpr int kPriorities = 3;
 
-    const float base_size = font ? font->GetFontBaked(descr.size)->Size : ImGui::GetFontSize();
-    const float scale = base_size > 0.0f ? (descr.size / base_size) : 1.0f;
+  struct Queue {
+    std::mutex Mutex;
+    std::deque<std::function<void()>> Jobs[kPriorities];
+  };
 
-    rf->Metrics.font_size = (int)descr.size;
-    rf->Metrics.height = (int)(base_size * scale);
-    rf->Metrics.ascent = font ? (int)(font->GetFontBaked(descr.size)->Ascent * scale) : (int)(base_size * 0.8f);
-    rf->Metrics.descent = font ? (int)(-font->GetFontBaked(descr.size)->Descent * scale) : (int)(base_size * 0.2f);
-    rf->Metrics.x_height = rf->Metrics.ascent / 2;
+  std::vector<std::unique_ptr<Queue>> queues;
+  std::vector<std::thread> workers;
+  std::atomic<unsigned int> nextQueue{0};
+  std::mutex sleepMutex;
+  std::condition_variable wake;
+  int pending = 0;  // jobs submitted but not yet taken, guarded by sleepMutex
+  bool stopping = false;
+
+  bool pop(size_t self, std::function<void()>& job) {
+    for (int priority = 0; priority < kPriorities; ++priority) {
+      for (size_t i = 0; i < queues.size(); ++i) {
+        Queue& queue = *queues[(self + i) % queues.size()];
+        std::lock_guard<std::mutex> lock(queue.Mutex);
+        std::deque<std::function<void()>>& jobs = queue.Jobs[priority];
+        if (jobs.empty()) {
+          continue;
+        }
 
-    if (fm) {
-      *fm = rf->Metrics;
+        // Own jobs in submission order, stolen ones from the other end
+        if (i == 0) {
+          job = std::move(jobs.front());
+          jobs.pop_front();
+        } else {
+          job = std::move(jobs.back());
+          jobs.pop_back();
+        }
+        return true;
+      }
     }
-
-    ResolvedFont* raw = rf.get();
-    fonts_.push_back(std::move(rf));
-    return reinterpret_cast<litehtml::uint_ptr>(raw);
+    return false;
   }
 
-  virtual void delete_font(litehtml::uint_ptr hFont) override {
-    // do nothing for now
+  void run(size_t self) {
+    for (;;) {
+      {
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        wake.wait(lock, [this] { return stopping || pending > 0; });
+        if (pending == 0) {
+          return;
+        }
+        pending--;
+      }
+
+      // A job was reserved above, it is in one of the queues or about to be
+      std::function<void()> job;
+      while (!pop(self, job)) {
+        std::this_thread::yield();
+      }
+      job();
+    }
   }
 
-  virtual litehtml::pixel_t text_width(const char* text, litehtml::uint_ptr hFont) override {
-    auto* rf = from_handle(hFont);
-    if (!rf || !rf->Font || !text) {
-      return 0;
+ public:
+  explicit WorkerPool(unsigned int threads) {
+    for (unsigned int i = 0; i < threads; ++i) {
+      queues.push_back(std::make_unique<Queue>());
+    }
+    for (unsigned int i = 0; i < threads; ++i) {
+      workers.emplace_back([this, i] { run(i); });
     }
+  }
 
-    const char* end = text + strlen(text);
-    ImVec2 size = rf->Font->CalcTextSizeA(rf->Size, FLT_MAX, 0.0f, text, end, nullptr);
-    return (litehtml::pixel_t)size.x;
+  ~WorkerPool() {
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      stopping = true;
+    }
+    wake.notify_all();
+    for (std::thread& worker : workers) {
+      worker.join();
+    }
   }
 
-  virtual void draw_text(litehtml::uint_ptr hdc, const char* text, litehtml::uint_ptr hFont, litehtml::web_color color,
-                         const litehtml::position& pos) override {
-    auto* rf = from_handle(hFont);
-    if (!rf || !rf->Font || !text) {
-      return;
+  void submit(JobPriority priority, std::function<void()> job) {
+    Queue& queue = *queues[nextQueue++ % queues.size()];
+    {
+      std::lock_guard<std::mutex> lock(queue.Mutex);
+      queue.Jobs[(int)priority].push_back(std::move(job));
+    }
+    {
+      std::lock_guard<std::mutex> lock(sleepMutex);
+      pending++;
     }
+    wake.notify_one();
+  }
+};
 
-    ImVec2 p = ImGui::GetCursorScreenPos() + ImVec2(pos.x, pos.y);
-    ImU32 col = IM_COL32(color.red, color.green, color.blue, color.alpha);
+static WorkerPool& getWorkerPool() {
+  static WorkerPool pool(std::max(2u, std::thread::hardware_concurrency()) - 1);
+  return pool;
+}
 
-    ImGui::GetWindowDrawList()->AddText(rf->Font, rf->Size, p, col, text);
+/**
+ * Runs a job off the ImGui thread, on Config::Executor when set or the built-in pool otherwise.
+ */
+static void runJob(const Config& cfg, JobPriority priority, std::function<void()> job) {
+  // Jobs run with the context that started them current
+  job = bindContext(std::move(job));
+  if (cfg.Executor) {
+    cfg.Executor(priority, std::move(job));
+  } else {
+    getWorkerPool().submit(priority, std::move(job));
+  }
+}
 
-    const char* end = text + strlen(text);
-    ImVec2 size = rf->Font->CalcTextSizeA(rf->Size, FLT_MAX, 0.0f, text, end, nullptr);
-    push_bottom_right(ImVec2(pos.x + size.x, pos.y + size.y));
+/**
+ * Runs fn(0) .. fn(count - 1) as Visible jobs and waits for all of them. The calling thread runs fn(0) itself instead
+ * of idling.
+ */
+static void runParallel(const Config& cfg, int count, const std::function<void(int)>& fn) {
+  std::vector<std::future<void>> done;
+  for (int i = 1; i < count; ++i) {
+    auto task = std::make_shared<std::packaged_task<void()>>([&fn, i] { fn(i); });
+    done.push_back(task->get_future());
+    runJob(cfg, JobPriority::Visible, [task] { (*task)(); });
   }
 
-  //
-  // Measurement and defaults
-  //
+  if (count > 0) {
+    fn(0);
+  }
+  for (std::future<void>& job_done : done) {
+    job_done.wait();
+  }
+}
 
-  virtual litehtml::pixel_t pt_to_px(float pt) const override { return pt; }
-  virtual litehtml::pixel_t get_default_font_size() const override { return config.BaseFontSize; }
-  virtual const char* get_default_font_name() const override { return "Default"; }
+//
+// Completions
+//
 
-  //
-  // Drawing functions
-  //
+// Work handed back from jobs to the ImGui thread, a lock-free stack reversed when drained
+struct Completion {
+  std::function<void()> Run;
+  Completion* Next = nullptr;
+};
 
-  struct LayerGeometry {
-    ImVec2 border_min;
-    ImVec2 border_max;
-    ImVec2 clip_min;
-    ImVec2 clip_max;
-    float tl, tr, br, bl;
-  };
+static std::atomic<Completion*>& completions();
 
-  LayerGeometry get_layer_geometry(const litehtml::background_layer& layer) const {
-    ImVec2 screen_pos = ImGui::GetCursorScreenPos();
+/**
+ * Queues a function to run on the ImGui thread at the start of the next Canvas call. Safe to call from any thread.
+ */
+static void postCompletion(std::function<void()> run) {
+  Completion* completion = new Completion{std::move(run)};
+  completion->Next = completions().load(std::memory_order_relaxed);
+  while (!completions().compare_exchange_weak(
+      completion->Next, completion, std::memory_order_release, std::memory_order_relaxed)) {
+  }
+}
 
-    LayerGeometry g;
-    g.border_min = screen_pos + ImVec2((float)layer.border_box.x, (float)layer.border_box.y);
-    g.border_max = screen_pos + ImVec2((float)(layer.border_box.x + layer.border_box.width),
-                                       (float)(layer.border_box.y + layer.border_box.height));
-    g.clip_min = screen_pos + ImVec2((float)layer.clip_box.x, (float)layer.clip_box.y);
-    g.clip_max = screen_pos + ImVec2((float)(layer.clip_box.x + layer.clip_box.width),
-                                     (float)(layer.clip_box.y + layer.clip_box.height));
-
-    g.tl = (float)layer.border_radius.top_left_x;
-    g.tr = (float)layer.border_radius.top_right_x;
-    g.br = (float)layer.border_radius.bottom_right_x;
-    g.bl = (float)layer.border_radius.bottom_left_x;
-    return g;
+/**
+ * Runs all posted completions in the order they were posted.
+ */
+static void drainCompletions() {
+  Completion* stack = completions().exchange(nullptr, std::memory_order_acquire);
+
+  Completion* ordered = nullptr;
+  while (stack) {
+    Completion* next = stack->Next;
+    stack->Next = ordered;
+    ordered = stack;
+    stack = next;
   }
 
-  virtual void draw_list_marker(litehtml::uint_ptr hdc, const litehtml::list_marker& marker) override {
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
-    ImVec2 center = ImGui::GetCursorScreenPos() +
-                    ImVec2(marker.pos.x + marker.pos.width / 2.0f, marker.pos.y + marker.pos.height / 2.0f);
-    float radius = marker.pos.width / 2.0f;
-    ImU32 color = IM_COL32(marker.color.red, marker.color.green, marker.color.blue, marker.color.alpha);
-
-    switch (marker.marker_type) {
-      case litehtml::list_style_type_circle:
-        draw_list->AddCircle(center, radius, color, 0, 1.5f);
-        break;
-      case litehtml::list_style_type_disc:
-        draw_list->AddCircleFilled(center, radius, color);
-        break;
-      case litehtml::list_style_type_square: {
-        ImVec2 p_min = ImGui::GetCursorScreenPos() + ImVec2(marker.pos.x, marker.pos.y);
-        ImVec2 p_max = p_min + ImVec2(marker.pos.width, marker.pos.height);
-        draw_list->AddRectFilled(p_min, p_max, color);
-        break;
-      }
-      default:
-        draw_list->AddCircleFilled(center, radius, color);
-        break;
-    }
-
-    push_bottom_right(ImVec2(marker.pos.x + marker.pos.width, marker.pos.y + marker.pos.height));
+  while (ordered) {
+    Completion* next = ordered->Next;
+    ordered->Run();
+    delete ordered;
+    ordered = next;
   }
+}
 
-  virtual void load_image(const char* src, const char* baseurl, bool redraw_on_ready) override {
-    if (!config.LoadImage) {
-      return;
-    }
+//
+// Image cache
+//
 
-    config.LoadImage(src, baseurl);
-  }
+enum class ImageStatus : unsigned char {
+  Unknown,  // nothing known yet
+  Probed,   // size known, not decoded or evicted
+  Loading,  // decoding on a worker thread
+  Ready,    // decoded and uploaded
+  Failed,
+};
 
-  virtual void get_image_size(const char* src, const char* baseurl, litehtml::size& sz) override {
-    if (!config.GetImageMeta) {
-      return;
-    }
+struct ImageEntry {
+  ImageStatus Status = ImageStatus::Unknown;
+  int Width = 0;
+  int Height = 0;
+  ImU64 Content = 0;                      // key into textures once decoded
+  int TextureWidth = 0;                   // resolution of the uploaded texture, at most Width x Height
+  int TextureHeight = 0;
+  int DrawWidth = 0;                      // largest size the image has been drawn at, in framebuffer pixels
+  int DrawHeight = 0;
+  bool Redecoding = false;                // decoding at a higher resolution while the current texture is drawn
+  std::set<std::string> WaitingCanvases;  // canvases to lay out again once the image is ready
+};
 
-    auto image_meta = config.GetImageMeta(src, baseurl);
-    sz.width = image_meta.Width;
-    sz.height = image_meta.Height;
-  }
+struct ImageTexture {
+  ImTextureID Texture = 0;
+  size_t Bytes = 0;  // 0 for atlas slots, their page is counted instead
+  int Width = 0;     // of the uploaded image, told apart from others with the same content hash by size
+  int Height = 0;
+  size_t PixelBytes = 0;
+  int LastUsedFrame = 0;
+  ImVec2 Uv0 = ImVec2(0, 0);
+  ImVec2 Uv1 = ImVec2(1, 1);
+  int Page = -1;         // atlas page, -1 for a texture of its own
+  ImageData Padded;      // atlas slot pixels with a one pixel border, kept for repacking
+  bool Retired = false;  // replaced by a higher resolution, released once no frame in flight draws it
+};
 
-  virtual void draw_image(litehtml::uint_ptr hdc, const litehtml::background_layer& layer, const std::string& url,
-                          const std::string& base_url) override {
-    if (!config.GetImageTexture) {
-      return;
-    }
+// A row of the shelf packer, filled from left to right
+struct AtlasShelf {
+  int Y = 0;
+  int Height = 0;
+  int X = 0;
+};
 
-    ImTextureID texture = config.GetImageTexture(url.c_str(), base_url.c_str());
-    if (!texture) {
-      return;
-    }
+struct AtlasPage {
+  ImTextureID Texture = 0;
+  int Size = 0;
+  std::vector<AtlasShelf> Shelves;
+  int UsedArea = 0;  // pixels of live slots, freed slots leave gaps until the page is repacked
+  int Slots = 0;
+  int LastUsedFrame = 0;
+};
 
-    LayerGeometry lgm = this->get_layer_geometry(layer);
-    ImVec2 p_min = lgm.border_min;
-    ImVec2 p_max = lgm.border_max;
+struct DecodedImage {
+  std::string Key;
+  bool Ok = false;
+  int SourceWidth = 0;  // size before resampling, used for layout
+  int SourceHeight = 0;
+  ImageData Image;
+  ImU64 Content = 0;  // hash of the pixels and their size, never 0 when decoded
+};
 
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+// Images of the asynchronous pipeline, only touched on the ImGui thread
+static std::unordered_map<std::string, ImageEntry>& images();
 
-    float radius = std::min({lgm.tl, lgm.tr, lgm.br, lgm.bl});
+// Uploaded textures by content hash, so identical images share one texture
+static std::unordered_map<ImU64, ImageTexture>& imageTextures();
+static size_t& imageTextureBytes();
+static int& evictionFrame();  // frame of the last eviction pass
 
-    draw_list->PushClipRect(lgm.clip_min, lgm.clip_max, true);
+// Shared textures small images are packed into, indices stay stable while pages are destroyed and reused
+static std::vector<AtlasPage>& atlasPages();
 
-    if (radius > 0.0f) {
-      draw_list->AddImageRounded(texture, p_min, p_max, ImVec2(0, 0), ImVec2(1, 1), IM_COL32_WHITE, lgm.tl);
-    } else {
-      draw_list->AddImage(texture, p_min, p_max);
-    }
+static void completeImage(DecodedImage& result);
 
-    draw_list->PopClipRect();
+static bool useAsyncImages(const Config& cfg) { return cfg.DecodeImage && cfg.CreateTexture; }
 
-    push_bottom_right(ImVec2(lgm.border_max.x, lgm.border_max.y));
+static std::string resourceKey(const char* src, const char* baseurl) {
+  if (baseurl == nullptr || baseurl[0] == '\0') {
+    return src;
   }
+  return std::string(baseurl) + "|" + src;
+}
 
-  virtual void draw_solid_fill(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
-                               const litehtml::web_color& color) override {
-    if (color.alpha == 0) {
-      return;
+/**
+ * Returns the cache entry of an image. The first request probes its size from the header when
+ * ProbeImageSize is set.
+ */
+static ImageEntry& findImage(const Config& cfg, const char* src, const char* baseurl) {
+  auto [it, inserted] = images().try_emplace(resourceKey(src, baseurl));
+  ImageEntry& image = it->second;
+
+  if (inserted && cfg.ProbeImageSize) {
+    int width = 0, height = 0;
+    if (cfg.ProbeImageSize(src, baseurl, &width, &height) && width > 0 && height > 0) {
+      image.Status = ImageStatus::Probed;
+      image.Width = width;
+      image.Height = height;
     }
+  }
 
-    const litehtml::position& bg_box = layer.border_box;
-    const litehtml::position& clip_box = layer.clip_box;
+  return image;
+}
 
-    if (bg_box.width <= 0 || bg_box.height <= 0 || clip_box.width <= 0 || clip_box.height <= 0) {
-      return;
-    }
+/**
+ * Box filters RGBA8 pixels down to width x height.
+ */
+static ImageData resampleImage(const ImageData& src, int width, int height) {
+  ImageData dst;
+  dst.Width = width;
+  dst.Height = height;
+  dst.Pixels.resize((size_t)width * height * 4);
+
+  for (int y = 0; y < height; ++y) {
+    const int y0 = (int)((long long)y * src.Height / height);
+    const int y1 = std::max(y0 + 1, (int)((long long)(y + 1) * src.Height / height));
+
+    for (int x = 0; x < width; ++x) {
+      const int x0 = (int)((long long)x * src.Width / width);
+      const int x1 = std::max(x0 + 1, (int)((long long)(x + 1) * src.Width / width));
+
+      unsigned int sum[4] = {0, 0, 0, 0};
+      for (int sy = y0; sy < y1; ++sy) {
+        const unsigned char* row = &src.Pixels[((size_t)sy * src.Width + x0) * 4];
+        for (int sx = x0; sx < x1; ++sx, row += 4) {
+          sum[0] += row[0];
+          sum[1] += row[1];
+          sum[2] += row[2];
+          sum[3] += row[3];
+        }
+      }
 
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+      const unsigned int count = (unsigned int)((y1 - y0) * (x1 - x0));
+      unsigned char* out = &dst.Pixels[((size_t)y * width + x) * 4];
+      for (int c = 0; c < 4; ++c) {
+        out[c] = (unsigned char)((sum[c] + count / 2) / count);
+      }
+    }
+  }
 
-    LayerGeometry lgm = this->get_layer_geometry(layer);
+  return dst;
+}
 
-    ImU32 col = IM_COL32(color.red, color.green, color.blue, color.alpha);
+/**
+ * Fills image.Mips with successively halved levels down to 1x1.
+ */
+static void buildImageMips(ImageData& image) {
+  image.Mips.clear();
+
+  const ImageData* level = &image;
+  while (level->Width > 1 || level->Height > 1) {
+    ImageData next = resampleImage(*level, std::max(1, level->Width / 2), std::max(1, level->Height / 2));
+    image.Mips.push_back(std::move(next));
+    level = &image.Mips.back();
+  }
+}
 
-    draw_list->PushClipRect(lgm.clip_min, lgm.clip_max, true);
+static size_t imageBytes(const ImageData& image) {
+  size_t bytes = image.Pixels.size();
+  for (const ImageData& mip : image.Mips) {
+    bytes += mip.Pixels.size();
+  }
+  return bytes;
+}
 
-    if (lgm.tl == lgm.tr && lgm.tr == lgm.br && lgm.br == lgm.bl) {
-      draw_list->AddRectFilled(lgm.border_min, lgm.border_max, col, lgm.tl);
-    } else {
-      draw_list->PathClear();
+/**
+ * Starts decoding an image on a worker thread, unless it is already decoding or failed. With
+ * DownscaleImages the result is resampled to at most target_width x target_height, a resident image
+ * is then decoded again when it needs a higher resolution.
+ */
+static void decodeImage(const Config& cfg, ImageEntry& image, const char* src, const char* baseurl,
+                        JobPriority priority, int target_width = 0, int target_height = 0) {
+  const bool upgrade = image.Status == ImageStatus::Ready && !image.Redecoding;
+  if (image.Status != ImageStatus::Unknown && image.Status != ImageStatus::Probed && !upgrade) {
+    return;
+  }
 
-      if (lgm.tl > 0.0f)
-        draw_list->PathArcTo(ImVec2(lgm.border_min.x + lgm.tl, lgm.border_min.y + lgm.tl), lgm.tl, IM_PI, IM_PI * 1.5f);
-      else
-        draw_list->PathLineTo(ImVec2(lgm.border_min.x, lgm.border_min.y));
+  if (upgrade) {
+    image.Redecoding = true;
+  } else {
+    image.Status = ImageStatus::Loading;
+  }
 
-      if (lgm.tr > 0.0f)
-        draw_list->PathArcTo(
-            ImVec2(lgm.border_max.x - lgm.tr, lgm.border_min.y + lgm.tr), lgm.tr, IM_PI * 1.5f, IM_PI * 2.0f);
-      else
-        draw_list->PathLineTo(ImVec2(lgm.border_max.x, lgm.border_min.y));
+  if (!cfg.DownscaleImages) {
+    target_width = target_height = 0;
+  }
 
-      if (lgm.br > 0.0f)
-        draw_list->PathArcTo(ImVec2(lgm.border_max.x - lgm.br, lgm.border_max.y - lgm.br), lgm.br, 0.0f, IM_PI * 0.5f);
-      else
-        draw_list->PathLineTo(ImVec2(lgm.border_max.x, lgm.border_max.y));
+  runJob(cfg, priority, [key = resourceKey(src, baseurl), src = std::string(src),
+                         baseurl = std::string(baseurl ? baseurl : ""), decode = cfg.DecodeImage, target_width,
+                         target_height, mips = cfg.GenerateImageMips] {
+    DecodedImage decoded;
+    decoded.Key = key;
+    decoded.Ok = decode(src.c_str(), baseurl.c_str(), &decoded.Image);
 
-      if (lgm.bl > 0.0f)
-        draw_list->PathArcTo(ImVec2(lgm.border_min.x + lgm.bl, lgm.border_max.y - lgm.bl), lgm.bl, IM_PI * 0.5f, IM_PI);
-      else
-        draw_list->PathLineTo(ImVec2(lgm.border_min.x, lgm.border_max.y));
+    ImageData& image = decoded.Image;
+    decoded.SourceWidth = image.Width;
+    decoded.SourceHeight = image.Height;
 
-      draw_list->PathFillConvex(col);
+    if (decoded.Ok && image.Width > 0 && image.Height > 0) {
+      if (target_width > 0 && target_height > 0 && (target_width < image.Width || target_height < image.Height)) {
+        image = resampleImage(image, std::min(target_width, image.Width), std::min(target_height, image.Height));
+      }
+      if (mips) {
+        buildImageMips(image);
+      }
+    }
+    if (decoded.Ok && !image.Pixels.empty()) {
+      const int dims[2] = {image.Width, image.Height};
+      decoded.Content = hashBytes(image.Pixels.data(), image.Pixels.size(), hashBytes(dims, sizeof(dims))) | 1;
     }
 
-    draw_list->PopClipRect();
+    postCompletion([decoded = std::make_shared<DecodedImage>(std::move(decoded))] { completeImage(*decoded); });
+  });
+}
+
+/**
+ * Whether an image is drawn noticeably larger than its texture and a sharper one can be decoded.
+ */
+static bool needsHigherResolution(const ImageEntry& image) {
+  const bool downscaled = image.TextureWidth < image.Width || image.TextureHeight < image.Height;
+  return downscaled && (image.DrawWidth > image.TextureWidth * 5 / 4 || image.DrawHeight > image.TextureHeight * 5 / 4);
+}
 
-    push_bottom_right(ImVec2((float)(bg_box.x + bg_box.width), (float)(bg_box.y + bg_box.height)));
+/**
+ * Returns the texture of a decoded image and marks it as used this frame, or nullptr if it is not resident.
+ */
+static const ImageTexture* useImageTexture(ImageEntry& image) {
+  if (image.Status != ImageStatus::Ready) {
+    return nullptr;
   }
 
-  static constexpr float kEpsilon = 1e-6f;
+  auto it = imageTextures().find(image.Content);
+  if (it == imageTextures().end()) {
+    // Evicted, the size stays known so it can be decoded again without a new layout
+    image.Status = ImageStatus::Probed;
+    return nullptr;
+  }
 
-  static ImU32 to_im_col32(const litehtml::web_color& c) { return IM_COL32(c.red, c.green, c.blue, c.alpha); }
+  const int frame = ImGui::GetFrameCount();
+  it->second.LastUsedFrame = frame;
+  if (it->second.Page >= 0) {
+    atlasPages()[it->second.Page].LastUsedFrame = frame;
+  }
+  return &it->second;
+}
 
-  static litehtml::web_color sample_gradient_color(const std::vector<litehtml::background_layer::color_point>& points,
-                                                   float t) {
-    litehtml::web_color out{0, 0, 0, 0};
+//
+// Atlas of small images
+//
 
-    if (points.empty()) {
-      return out;
-    }
+static bool useAtlas(const Config& cfg, const ImageData& image) {
+  return cfg.UpdateTexture && cfg.AtlasMaxImageSize > 0 && image.Width <= cfg.AtlasMaxImageSize &&
+         image.Height <= cfg.AtlasMaxImageSize && image.Width + 2 <= cfg.AtlasPageSize &&
+         image.Height + 2 <= cfg.AtlasPageSize;
+}
 
-    if (t <= points.front().offset) {
-      return points.front().color;
+/**
+ * Copies an image with its edge pixels repeated once around it, so filtering never samples a neighbour.
+ */
+static ImageData padImage(const ImageData& image) {
+  ImageData padded;
+  padded.Width = image.Width + 2;
+  padded.Height = image.Height + 2;
+  padded.Pixels.resize((size_t)padded.Width * padded.Height * 4);
+
+  for (int y = 0; y < padded.Height; ++y) {
+    const int sy = ImClamp(y - 1, 0, image.Height - 1);
+    for (int x = 0; x < padded.Width; ++x) {
+      const int sx = ImClamp(x - 1, 0, image.Width - 1);
+      memcpy(&padded.Pixels[((size_t)y * padded.Width + x) * 4], &image.Pixels[((size_t)sy * image.Width + sx) * 4], 4);
     }
+  }
 
-    if (t >= points.back().offset) {
-      return points.back().color;
+  return padded;
+}
+
+/**
+ * Finds room for a width x height slot, preferring shelves that are not much taller than the slot.
+ */
+static bool allocateAtlasSlot(AtlasPage& page, int width, int height, int* x, int* y) {
+  AtlasShelf* best = nullptr;
+  AtlasShelf* loose = nullptr;
+  for (AtlasShelf& shelf : page.Shelves) {
+    if (height > shelf.Height || shelf.X + width > page.Size) {
+      continue;
     }
+    if (shelf.Height * 2 <= height * 3) {
+      if (!best || shelf.Height < best->Height) best = &shelf;
+    } else if (!loose || shelf.Height < loose->Height) {
+      loose = &shelf;
+    }
+  }
 
-    for (size_t i = 1; i < points.size(); ++i) {
-      const auto& a = points[i - 1];
-      const auto& b = points[i];
+  if (!best) {
+    const int top = page.Shelves.empty() ? 0 : page.Shelves.back().Y + page.Shelves.back().Height;
+    if (top + height <= page.Size && width <= page.Size) {
+      page.Shelves.push_back(AtlasShelf{top, height, 0});
+      best = &page.Shelves.back();
+    } else {
+      best = loose;
+    }
+  }
 
-      if (t >= a.offset && t <= b.offset) {
-        const float span = b.offset - a.offset;
-        const float u = (span > 0.0f) ? ((t - a.offset) / span) : 0.0f;
+  if (!best) {
+    return false;
+  }
 
-        auto lerp_u8 = [u](unsigned char x, unsigned char y) -> unsigned char {
-          return (unsigned char)(x + (y - x) * u);
-        };
+  *x = best->X;
+  *y = best->Y;
+  best->X += width;
+  page.UsedArea += width * height;
+  page.Slots++;
+  return true;
+}
 
-        out.red = lerp_u8(a.color.red, b.color.red);
-        out.green = lerp_u8(a.color.green, b.color.green);
-        out.blue = lerp_u8(a.color.blue, b.color.blue);
-        out.alpha = lerp_u8(a.color.alpha, b.color.alpha);
-        return out;
-      }
-    }
+static void placeInAtlas(const Config& cfg, int page_index, ImageTexture& tex, int x, int y) {
+  const AtlasPage& page = atlasPages()[page_index];
+  cfg.UpdateTexture(page.Texture, x, y, tex.Padded);
 
-    return points.back().color;
-  }
+  const float inv_size = 1.0f / (float)page.Size;
+  tex.Texture = page.Texture;
+  tex.Page = page_index;
+  tex.Uv0 = ImVec2((float)(x + 1) * inv_size, (float)(y + 1) * inv_size);
+  tex.Uv1 = ImVec2((float)(x + tex.Padded.Width - 1) * inv_size, (float)(y + tex.Padded.Height - 1) * inv_size);
+}
 
-  static float cross2(const ImVec2& a, const ImVec2& b) { return a.x * b.y - a.y * b.x; }
+// Pages count toward Config::ImageCacheBudget as a whole, the images in them count nothing
+static size_t atlasPageBytes(int size) { return (size_t)size * size * 4; }
 
-  static ImVec2 line_intersection(const ImVec2& p1, const ImVec2& p2, const ImVec2& q1, const ImVec2& q2) {
-    const ImVec2 r = p2 - p1;
-    const ImVec2 s = q2 - q1;
-    const float rxs = cross2(r, s);
+static ImageData blankAtlasPage(int size) {
+  ImageData blank;
+  blank.Width = size;
+  blank.Height = size;
+  blank.Pixels.assign((size_t)size * size * 4, 0);
+  return blank;
+}
 
-    if (fabsf(rxs) < kEpsilon) {
-      return p1;  // parallel fallback
+/**
+ * Packs the live slots of a page again from scratch, closing the gaps evicted images left behind.
+ */
+static void repackAtlasPage(const Config& cfg, int page_index) {
+  std::vector<std::pair<ImU64, ImageTexture*>> slots;
+  for (auto& [content, tex] : imageTextures()) {
+    if (tex.Page == page_index) {
+      slots.emplace_back(content, &tex);
     }
-
-    const float t = cross2(q1 - p1, s) / rxs;
-    return p1 + r * t;
   }
-
-  static bool is_inside_edge(const ImVec2& p, const ImVec2& a, const ImVec2& b) {
-    // For counter-clockwise clip polygon, inside is on the left side of edge AB.
-    return cross2(b - a, p - a) >= 0.0f;
+  std::sort(slots.begin(), slots.end(),
+            [](const auto& a, const auto& b) { return a.second->Padded.Height > b.second->Padded.Height; });
+
+  AtlasPage& page = atlasPages()[page_index];
+  page.Shelves.clear();
+  page.UsedArea = 0;
+  page.Slots = 0;
+  cfg.UpdateTexture(page.Texture, 0, 0, blankAtlasPage(page.Size));
+
+  for (auto& [content, tex] : slots) {
+    int x, y;
+    if (allocateAtlasSlot(page, tex->Padded.Width, tex->Padded.Height, &x, &y)) {
+      placeInAtlas(cfg, page_index, *tex, x, y);
+    } else {
+      // Did not fit in the new order, decoded again when it is next drawn
+      imageTextureBytes() -= tex->Bytes;
+      imageTextures().erase(content);
+    }
   }
+}
 
-  static std::vector<ImVec2> clip_polygon_convex(const std::vector<ImVec2>& subject_polygon,
-                                                 const std::vector<ImVec2>& clip_polygon) {
-    std::vector<ImVec2> result = subject_polygon;
-
-    for (size_t edge_index = 0; edge_index < clip_polygon.size(); ++edge_index) {
-      const ImVec2& clip_edge_start = clip_polygon[edge_index];
-      const ImVec2& clip_edge_end = clip_polygon[(edge_index + 1) % clip_polygon.size()];
+/**
+ * Places a padded image into an atlas page, repacking or creating pages as needed.
+ */
+static bool addToAtlas(const Config& cfg, ImageTexture& tex) {
+  const int width = tex.Padded.Width;
+  const int height = tex.Padded.Height;
+  int x, y;
+
+  std::vector<AtlasPage>& pages = atlasPages();
+  for (int i = 0; i < (int)pages.size(); ++i) {
+    if (pages[i].Texture && pages[i].Size == cfg.AtlasPageSize &&
+        allocateAtlasSlot(pages[i], width, height, &x, &y)) {
+      placeInAtlas(cfg, i, tex, x, y);
+      return true;
+    }
+  }
 
-      if (result.empty()) {
-        break;
+  // Repack a sparsely used page, unless this or the previous frame, which may still be in flight, drew from it
+  const int frame = ImGui::GetFrameCount();
+  for (int i = 0; i < (int)pages.size(); ++i) {
+    AtlasPage& page = pages[i];
+    if (page.Texture && page.Size == cfg.AtlasPageSize && page.LastUsedFrame < frame - 1 &&
+        page.UsedArea * 2 < page.Size * page.Size) {
+      repackAtlasPage(cfg, i);
+      if (allocateAtlasSlot(page, width, height, &x, &y)) {
+        placeInAtlas(cfg, i, tex, x, y);
+        return true;
       }
+    }
+  }
 
-      std::vector<ImVec2> input = std::move(result);
-      result.clear();
+  ImTextureID texture = cfg.CreateTexture(blankAtlasPage(cfg.AtlasPageSize));
+  if (!texture) {
+    return false;
+  }
 
-      ImVec2 previous_point = input.back();
-      bool previous_inside = is_inside_edge(previous_point, clip_edge_start, clip_edge_end);
+  int index = 0;
+  while (index < (int)pages.size() && pages[index].Texture) {
+    index++;
+  }
+  if (index == (int)pages.size()) {
+    pages.emplace_back();
+  }
 
-      for (const ImVec2& current_point : input) {
-        const bool current_inside = is_inside_edge(current_point, clip_edge_start, clip_edge_end);
+  AtlasPage& page = pages[index];
+  page = AtlasPage{};
+  page.Texture = texture;
+  page.Size = cfg.AtlasPageSize;
+  imageTextureBytes() += atlasPageBytes(page.Size);
+  if (!allocateAtlasSlot(page, width, height, &x, &y)) {
+    return false;
+  }
+  placeInAtlas(cfg, index, tex, x, y);
+  return true;
+}
 
-        if (current_inside) {
-          if (!previous_inside) {
-            result.push_back(line_intersection(previous_point, current_point, clip_edge_start, clip_edge_end));
-          }
+static void destroyAtlasPage(const Config& cfg, AtlasPage& page) {
+  cfg.DestroyTexture(page.Texture);
+  imageTextureBytes() -= atlasPageBytes(page.Size);
+  page = AtlasPage{};
+}
 
-          result.push_back(current_point);
+/**
+ * Frees the slot of an atlased image, destroying its page once empty. A page drawn this or the previous frame is left
+ * to releaseEmptyAtlasPages.
+ */
+static void releaseAtlasSlot(const Config& cfg, const ImageTexture& tex) {
+  AtlasPage& page = atlasPages()[tex.Page];
+  page.UsedArea -= tex.Padded.Width * tex.Padded.Height;
+  page.Slots--;
 
-        } else if (previous_inside) {
-          result.push_back(line_intersection(previous_point, current_point, clip_edge_start, clip_edge_end));
-        }
+  if (page.Slots == 0 && page.LastUsedFrame < ImGui::GetFrameCount() - 1 && cfg.DestroyTexture) {
+    destroyAtlasPage(cfg, page);
+  }
+}
 
-        previous_point = current_point;
-        previous_inside = current_inside;
-      }
+/**
+ * Destroys pages whose last image went while they were still being drawn, or whose first one failed to fit.
+ */
+static void releaseEmptyAtlasPages(const Config& cfg) {
+  const int frame = ImGui::GetFrameCount();
+  for (AtlasPage& page : atlasPages()) {
+    if (page.Texture && page.Slots == 0 && page.LastUsedFrame < frame - 1) {
+      destroyAtlasPage(cfg, page);
     }
-
-    return result;
   }
+}
 
-  template <typename ColorFunc>
-  static void draw_convex_shaded_polygon(ImDrawList* draw_list, const std::vector<ImVec2>& poly,
-                                         ColorFunc&& color_for_point) {
-    if (poly.size() < 3) {
-      return;
+/**
+ * Uploads a decoded image, into an atlas page when it is small enough. Returns the resident texture or
+ * nullptr on failure.
+ */
+static const ImageTexture* uploadImage(const Config& cfg, ImU64 content, const ImageData& data) {
+  ImageTexture tex;
+  if (useAtlas(cfg, data)) {
+    tex.Padded = padImage(data);
+    if (!addToAtlas(cfg, tex)) {
+      tex = ImageTexture{};
     }
+  }
 
-    const ImVec2 uv = draw_list->_Data->TexUvWhitePixel;
-    const ImDrawIdx base = draw_list->_VtxCurrentIdx;
-    const int vtx_count = (int)poly.size();
-    const int idx_count = (vtx_count - 2) * 3;
+  if (tex.Page < 0) {
+    tex.Texture = cfg.CreateTexture(data);
+    tex.Bytes = imageBytes(data);
+  }
 
-    draw_list->PrimReserve(idx_count, vtx_count);
+  if (!tex.Texture) {
+    return nullptr;
+  }
 
-    for (int i = 1; i < vtx_count - 1; ++i) {
-      draw_list->PrimWriteIdx(base + 0);
-      draw_list->PrimWriteIdx(base + i);
-      draw_list->PrimWriteIdx(base + i + 1);
-    }
+  tex.Width = data.Width;
+  tex.Height = data.Height;
+  tex.PixelBytes = data.Pixels.size();
+  tex.LastUsedFrame = ImGui::GetFrameCount();
+  imageTextureBytes() += tex.Bytes;
+  return &(imageTextures()[content] = std::move(tex));
+}
 
-    for (const ImVec2& p : poly) {
-      draw_list->PrimWriteVtx(p, uv, color_for_point(p));
-    }
+/**
+ * Destroys a texture, or frees its atlas slot, and forgets it.
+ *
+ * @return The next texture
+ */
+static std::unordered_map<ImU64, ImageTexture>::iterator releaseImageTexture(
+    const Config& cfg, std::unordered_map<ImU64, ImageTexture>::iterator it) {
+  if (it->second.Page >= 0) {
+    releaseAtlasSlot(cfg, it->second);
+  } else {
+    cfg.DestroyTexture(it->second.Texture);
   }
+  imageTextureBytes() -= it->second.Bytes;
+  return imageTextures().erase(it);
+}
 
-  template <typename ColorFunc>
-  static void draw_clipped_shaded_polygon(ImDrawList* draw_list, const std::vector<ImVec2>& poly,
-                                          const std::vector<ImVec2>& clip_poly, ColorFunc&& color_for_point) {
-    std::vector<ImVec2> clipped = clip_polygon_convex(poly, clip_poly);
-    if (clipped.size() < 3) {
-      return;
-    }
-
-    draw_convex_shaded_polygon(draw_list, clipped, std::forward<ColorFunc>(color_for_point));
+/**
+ * Destroys the least recently drawn textures until the cache fits its budget. Runs once per frame, before the first
+ * canvas draws, so every canvas of the previous frame has marked its textures. Textures drawn this or the previous
+ * frame are never evicted, the renderer may still be drawing the previous frame's draw lists.
+ */
+static void evictImageTextures(const Config& cfg) {
+  const int frame = ImGui::GetFrameCount();
+  if (!cfg.DestroyTexture || evictionFrame() == frame) {
+    return;
   }
+  evictionFrame() = frame;
 
-  static void append_point_if_distinct(std::vector<ImVec2>& pts, const ImVec2& p, float eps = 0.01f) {
-    if (pts.empty()) {
-      pts.push_back(p);
-      return;
+  // Textures replaced by a higher resolution go regardless of the budget
+  std::unordered_map<ImU64, ImageTexture>& textures = imageTextures();
+  for (auto it = textures.begin(); it != textures.end();) {
+    it = it->second.Retired && it->second.LastUsedFrame < frame - 1 ? releaseImageTexture(cfg, it) : std::next(it);
+  }
+  releaseEmptyAtlasPages(cfg);
+
+  while (imageTextureBytes() > cfg.ImageCacheBudget) {
+    auto oldest = textures.end();
+    for (auto it = textures.begin(); it != textures.end(); ++it) {
+      if (it->second.LastUsedFrame < frame - 1 &&
+          (oldest == textures.end() || it->second.LastUsedFrame < oldest->second.LastUsedFrame)) {
+        oldest = it;
+      }
     }
-
-    const ImVec2& last = pts.back();
-    if (fabsf(last.x - p.x) > eps || fabsf(last.y - p.y) > eps) {
-      pts.push_back(p);
+    if (oldest == textures.end()) {
+      break;
     }
+
+    releaseImageTexture(cfg, oldest);
   }
+}
 
-  static void append_arc_points(std::vector<ImVec2>& pts, const ImVec2& center, float radius, float a_min, float a_max,
-                                int segments, bool skip_first) {
-    if (radius <= 0.0f || segments <= 0) {
-      return;
-    }
+//
+// Stylesheets
+//
+
+struct StyleSheet {
+  std::string Url;  // as passed to Config::LoadCSS
+  std::string BaseUrl;
+  std::string Text;
+  ImU64 Hash = 0;
+  bool Loaded = false;
+  bool Stale = false;                    // invalidated, loaded again on next use
+  std::shared_future<std::string> Load;  // load in flight, from LoadCSSAsync or a prefetch
+};
 
-    for (int i = skip_first ? 1 : 0; i <= segments; ++i) {
-      const float t = (float)i / (float)segments;
-      const float a = a_min + (a_max - a_min) * t;
-      append_point_if_distinct(pts, ImVec2(center.x + cosf(a) * radius, center.y + sinf(a) * radius));
-    }
+// Stylesheets loaded through Config::LoadCSS by resolved URL, shared by all documents
+static std::unordered_map<std::string, StyleSheet>& styleSheets();
+
+static bool isStyleSheetReady(const StyleSheet& sheet) {
+  return !sheet.Load.valid() || sheet.Load.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+}
+
+/**
+ * Starts loading a stylesheet in the background unless it is loaded or in flight. Uses Config::LoadCSSAsync when set,
+ * otherwise runs Config::LoadCSS on a worker thread if load_on_worker is set.
+ */
+static StyleSheet& requestStyleSheet(const Config& cfg, const std::string& url, const std::string& baseurl,
+                                     bool load_on_worker) {
+  StyleSheet& sheet = styleSheets()[resourceKey(url.c_str(), baseurl.c_str())];
+  if ((sheet.Loaded && !sheet.Stale) || sheet.Load.valid()) {
+    return sheet;
   }
 
-  static std::vector<ImVec2> build_rect_polygon(const ImVec2& p_min, const ImVec2& p_max) {
-    return {
-        ImVec2(p_min.x, p_min.y),
-        ImVec2(p_max.x, p_min.y),
-        ImVec2(p_max.x, p_max.y),
-        ImVec2(p_min.x, p_max.y),
-    };
+  if (cfg.LoadCSSAsync) {
+    sheet.Load = cfg.LoadCSSAsync(url.c_str(), baseurl.c_str());
+  } else if (load_on_worker && cfg.LoadCSS) {
+    auto promise = std::make_shared<std::promise<std::string>>();
+    sheet.Load = promise->get_future().share();
+    runJob(cfg, JobPriority::Prefetch, [promise, url, baseurl, load = cfg.LoadCSS] {
+      promise->set_value(load(url.c_str(), baseurl.c_str()));
+    });
+  } else {
+    // Loaded synchronously by loadStyleSheet
+    return sheet;
   }
 
-  static std::vector<ImVec2> build_rounded_rect_polygon(const ImVec2& p_min, const ImVec2& p_max, float tl, float tr,
-                                                        float br, float bl, int arc_segments = 8) {
-    std::vector<ImVec2> pts;
-    pts.reserve(4 * (arc_segments + 1));
+  sheet.Url = url;
+  sheet.BaseUrl = baseurl;
+  sheet.Stale = false;
+  return sheet;
+}
 
-    const float w = p_max.x - p_min.x;
-    const float h = p_max.y - p_min.y;
-    const float max_r = ImMin(w * 0.5f, h * 0.5f);
+/**
+ * Returns a stylesheet, calling the loader only the first time it is requested or after it was invalidated. Waits
+ * for a load of it that is still in flight.
+ */
+static const StyleSheet& loadStyleSheet(const Config& cfg, const std::string& url, const std::string& baseurl) {
+  StyleSheet& sheet = requestStyleSheet(cfg, url, baseurl, false);
+
+  if (sheet.Load.valid()) {
+    sheet.Text = sheet.Load.get();
+    sheet.Load = {};
+  } else if (!sheet.Loaded || sheet.Stale) {
+    sheet.Url = url;
+    sheet.BaseUrl = baseurl;
+    sheet.Text = cfg.LoadCSS ? cfg.LoadCSS(url.c_str(), baseurl.c_str()) : std::string();
+    sheet.Stale = false;
+  } else {
+    return sheet;
+  }
 
-    tl = ImClamp(tl, 0.0f, max_r);
-    tr = ImClamp(tr, 0.0f, max_r);
-    br = ImClamp(br, 0.0f, max_r);
-    bl = ImClamp(bl, 0.0f, max_r);
+  sheet.Hash = hashBytes(sheet.Text.data(), sheet.Text.size());
+  sheet.Loaded = true;
+  return sheet;
+}
 
-    append_point_if_distinct(pts, ImVec2(p_min.x + tl, p_min.y));
-    append_point_if_distinct(pts, ImVec2(p_max.x - tr, p_min.y));
+//
+// Resource prefetch
+//
 
-    if (tr > 0.0f) {
-      append_arc_points(pts, ImVec2(p_max.x - tr, p_min.y + tr), tr, -IM_PI * 0.5f, 0.0f, arc_segments, true);
+static bool equalsIgnoreCase(const char* a, size_t length, const char* b) {
+  for (size_t i = 0; i < length; ++i) {
+    if (b[i] == '\0' || tolower((unsigned char)a[i]) != b[i]) {
+      return false;
     }
+  }
+  return b[length] == '\0';
+}
 
-    append_point_if_distinct(pts, ImVec2(p_max.x, p_max.y - br));
-
-    if (br > 0.0f) {
-      append_arc_points(pts, ImVec2(p_max.x - br, p_max.y - br), br, 0.0f, IM_PI * 0.5f, arc_segments, true);
+/**
+ * Parses the attributes of a tag starting after its name, up to and including the closing '>'.
+ */
+static const char* scanAttributes(const char* p, std::map<std::string, std::string>& attributes) {
+  while (*p && *p != '>') {
+    if (isspace((unsigned char)*p) || *p == '/') {
+      p++;
+      continue;
     }
 
-    append_point_if_distinct(pts, ImVec2(p_min.x + bl, p_max.y));
+    const char* name = p;
+    while (*p && !isspace((unsigned char)*p) && *p != '=' && *p != '>' && *p != '/') p++;
+    std::string key(name, p);
+    for (char& c : key) c = (char)tolower((unsigned char)c);
 
-    if (bl > 0.0f) {
-      append_arc_points(pts, ImVec2(p_min.x + bl, p_max.y - bl), bl, IM_PI * 0.5f, IM_PI, arc_segments, true);
+    while (isspace((unsigned char)*p)) p++;
+    if (*p != '=') {
+      attributes[key] = "";
+      continue;
+    }
+    p++;
+    while (isspace((unsigned char)*p)) p++;
+
+    const char* value = p;
+    if (*p == '"' || *p == '\'') {
+      const char quote = *p++;
+      value = p;
+      while (*p && *p != quote) p++;
+      attributes[key] = std::string(value, p);
+      if (*p) p++;
+    } else {
+      while (*p && !isspace((unsigned char)*p) && *p != '>') p++;
+      attributes[key] = std::string(value, p);
     }
+  }
 
-    append_point_if_distinct(pts, ImVec2(p_min.x, p_min.y + tl));
+  return *p ? p + 1 : p;
+}
 
-    if (tl > 0.0f) {
-      append_arc_points(pts, ImVec2(p_min.x + tl, p_min.y + tl), tl, IM_PI, IM_PI * 1.5f, arc_segments, true);
+/**
+ * Collects the urls of @import rules in a stylesheet.
+ */
+static void scanImports(const char* css, const char* end, std::vector<std::string>& styles) {
+  static const char kImport[] = "@import";
+  for (const char* p = css; p + sizeof(kImport) - 1 < end; ++p) {
+    if (*p != '@' || !equalsIgnoreCase(p, sizeof(kImport) - 1, kImport)) {
+      continue;
     }
 
-    return pts;
-  }
+    p += sizeof(kImport) - 1;
+    while (p < end && isspace((unsigned char)*p)) p++;
+    if (end - p > 4 && equalsIgnoreCase(p, 4, "url(")) {
+      p += 4;
+      while (p < end && isspace((unsigned char)*p)) p++;
+    }
 
-  static bool has_rounded_corners(const LayerGeometry& lgm) {
-    return lgm.tl > 0.0f || lgm.tr > 0.0f || lgm.br > 0.0f || lgm.bl > 0.0f;
+    char quote = 0;
+    if (p < end && (*p == '"' || *p == '\'')) {
+      quote = *p++;
+    }
+    const char* url = p;
+    while (p < end && (quote ? *p != quote : (*p != ')' && *p != ';' && !isspace((unsigned char)*p)))) p++;
+    if (p > url) {
+      styles.emplace_back(url, p);
+    }
   }
+}
 
-  static std::vector<ImVec2> build_layer_fill_polygon(const LayerGeometry& lgm, int arc_segments = 12) {
-    if (has_rounded_corners(lgm)) {
-      return build_rounded_rect_polygon(lgm.border_min, lgm.border_max, lgm.tl, lgm.tr, lgm.br, lgm.bl, arc_segments);
+/**
+ * Quick scan of HTML source for external stylesheets, stylesheet imports and eagerly loaded images, without
+ * building a DOM.
+ */
+static void scanResources(const char* html, std::vector<std::string>& styles, std::vector<std::string>& images) {
+  const char* p = html;
+  while ((p = strchr(p, '<')) != nullptr) {
+    p++;
+
+    if (strncmp(p, "!--", 3) == 0) {
+      const char* end = strstr(p + 3, "-->");
+      if (!end) {
+        return;
+      }
+      p = end + 3;
+      continue;
     }
 
-    return build_rect_polygon(lgm.border_min, lgm.border_max);
+    const char* name = p;
+    while (isalnum((unsigned char)*p) || *p == '-') p++;
+    const size_t name_length = (size_t)(p - name);
+
+    const bool is_link = equalsIgnoreCase(name, name_length, "link");
+    const bool is_img = equalsIgnoreCase(name, name_length, "img");
+    const bool is_style = equalsIgnoreCase(name, name_length, "style");
+    if (!is_link && !is_img && !is_style) {
+      continue;
+    }
+
+    std::map<std::string, std::string> attributes;
+    p = scanAttributes(p, attributes);
+
+    if (is_link) {
+      auto rel = attributes.find("rel");
+      auto href = attributes.find("href");
+      if (rel != attributes.end() && href != attributes.end() && !href->second.empty()) {
+        std::string type = rel->second;
+        for (char& c : type) c = (char)tolower((unsigned char)c);
+        if (type.find("stylesheet") != std::string::npos) {
+          styles.push_back(href->second);
+        }
+      }
+    } else if (is_img) {
+      auto src = attributes.find("src");
+      auto loading = attributes.find("loading");
+      if (src != attributes.end() && !src->second.empty() &&
+          (loading == attributes.end() || loading->second != "lazy")) {
+        images.push_back(src->second);
+      }
+    } else {
+      const char* end = strstr(p, "</");
+      end = end ? end : p + strlen(p);
+      scanImports(p, end, styles);
+      p = end;
+    }
   }
+}
 
-  static std::vector<ImVec2> build_ellipse_polygon(const ImVec2& center, float rx, float ry, float t, int segments) {
-    std::vector<ImVec2> pts;
-    pts.reserve(segments);
+/**
+ * Starts loading the stylesheets and images a document will ask for, all at once on the worker pool, so by the time
+ * litehtml requests them they are ready or in flight.
+ */
+static void prefetchResources(const Config& cfg, const char* html) {
+  std::vector<std::string> styles, sources;
+  scanResources(html, styles, sources);
 
-    const float ex = rx * t;
-    const float ey = ry * t;
+  if (cfg.LoadCSS || cfg.LoadCSSAsync) {
+    for (const std::string& url : styles) {
+      requestStyleSheet(cfg, url, "", true);
+    }
+  }
 
-    for (int i = 0; i < segments; ++i) {
-      const float a = ((float)i / (float)segments) * IM_PI * 2.0f;
-      pts.push_back(ImVec2(center.x + cosf(a) * ex, center.y + sinf(a) * ey));
+  // With probed sizes images are only decoded once drawn, there is nothing to load ahead of time
+  if (useAsyncImages(cfg) && !cfg.ProbeImageSize && !cfg.LazyLoadImages) {
+    for (const std::string& src : sources) {
+      decodeImage(cfg, findImage(cfg, src.c_str(), ""), src.c_str(), "", JobPriority::Prefetch);
     }
+  }
+}
 
-    return pts;
+/**
+ * Loads the stylesheets that are not cached and ready yet, in parallel on the caller and the pool, each only once.
+ * A load still in flight is started again instead of waited for, its queued job may not get a worker until later.
+ *
+ * @param requests URL and base URL pairs as passed to Config::LoadCSS, may repeat
+ */
+static void loadStyleSheetsParallel(const Config& cfg,
+                                    const std::vector<std::pair<std::string, std::string>>& requests) {
+  if (!cfg.LoadCSS && !cfg.LoadCSSAsync) {
+    return;
   }
 
-  static ImVec2 conic_point_on_circle(const ImVec2& center, float radius, float angle_deg) {
-    const float a = angle_deg * IM_PI / 180.0f;
+  struct Load {
+    std::string Key;
+    std::string Url;
+    std::string BaseUrl;
+    std::string Text;
+  };
 
-    // 0 degrees at top, clockwise positive
-    const float x = sinf(a);
-    const float y = -cosf(a);
+  std::vector<Load> loads;
+  std::set<std::string> seen;
+  for (const auto& [url, baseurl] : requests) {
+    std::string key = resourceKey(url.c_str(), baseurl.c_str());
+    if (!seen.insert(key).second) {
+      continue;
+    }
+    auto it = styleSheets().find(key);
+    if (it != styleSheets().end() && !it->second.Stale && (it->second.Loaded || it->second.Load.valid()) &&
+        isStyleSheetReady(it->second)) {
+      continue;
+    }
+    loads.push_back({.Key = std::move(key), .Url = url, .BaseUrl = baseurl});
+  }
 
-    return ImVec2(center.x + x * radius, center.y + y * radius);
+  runParallel(cfg, (int)loads.size(), [&cfg, &loads](int i) {
+    Load& load = loads[i];
+    load.Text = cfg.LoadCSSAsync ? cfg.LoadCSSAsync(load.Url.c_str(), load.BaseUrl.c_str()).get()
+                                 : cfg.LoadCSS(load.Url.c_str(), load.BaseUrl.c_str());
+  });
+
+  for (Load& load : loads) {
+    StyleSheet& sheet = styleSheets()[load.Key];
+    sheet.Url = std::move(load.Url);
+    sheet.BaseUrl = std::move(load.BaseUrl);
+    sheet.Text = std::move(load.Text);
+    sheet.Hash = hashBytes(sheet.Text.data(), sheet.Text.size());
+    sheet.Loaded = true;
+    sheet.Stale = false;
+    sheet.Load = {};
   }
+}
 
-  static std::vector<ImVec2> build_conic_wedge_polygon(const ImVec2& center, float radius, float angle0_deg,
-                                                       float angle1_deg, int arc_segments) {
-    std::vector<ImVec2> pts;
-    pts.reserve(arc_segments + 3);
+/**
+ * Returns the stylesheet every document starts from, litehtml's built-in one unless the config replaces it.
+ */
+static const char* masterCSS(const Config& cfg) {
+  return cfg.MasterCSS.empty() ? litehtml::master_css : cfg.MasterCSS.c_str();
+}
 
-    pts.push_back(center);
+static ImFont* getFontFromFamily(const FontFamily& family, FontStyle style) {
+  switch (style) {
+    case FontStyle::Regular:
+      return family.Regular;
+    case FontStyle::Bold:
+      return family.Bold ? family.Bold : family.Regular;
+    case FontStyle::Italic:
+      return family.Italic ? family.Italic : family.Regular;
+    case FontStyle::BoldItalic:
+      if (family.BoldItalic) return family.BoldItalic;
+      if (family.Bold) return family.Bold;
+      if (family.Italic) return family.Italic;
+      return family.Regular;
+    default:
+      return family.Regular;
+  }
+}
 
-    for (int i = 0; i <= arc_segments; ++i) {
-      const float t = (float)i / (float)arc_segments;
-      const float a = angle0_deg + (angle1_deg - angle0_deg) * t;
-      pts.push_back(conic_point_on_circle(center, radius, a));
+static ImFont* resolveFont(const Config& cfg, const std::string& family_name, FontStyle style,
+                           ImFont* fallback = nullptr) {
+  if (!family_name.empty()) {
+    auto it = cfg.FontFamilies.find(family_name);
+    if (it != cfg.FontFamilies.end()) {
+      if (ImFont* f = getFontFromFamily(it->second, style)) {
+        return f;
+      }
     }
+  }
 
-    return pts;
+  if (ImFont* f = getFontFromFamily(cfg.DefaultFont, style)) {
+    return f;
   }
 
-  void draw_linear_gradient_impl(const LayerGeometry& lgm,
-                                 const litehtml::background_layer::linear_gradient& gradient) {
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+  return fallback ? fallback : ImGui::GetFont();
+}
 
-    const ImVec2 screen_pos = ImGui::GetCursorScreenPos();
-    const ImVec2 start = screen_pos + ImVec2(gradient.start.x, gradient.start.y);
-    const ImVec2 end = screen_pos + ImVec2(gradient.end.x, gradient.end.y);
+//
+// Background layout
+//
 
-    const ImVec2 axis = end - start;
-    const float axis_len_sq = axis.x * axis.x + axis.y * axis.y;
-    if (axis_len_sq <= 0.0001f) {
-      return;
-    }
+/**
+ * Metrics and advances of the fonts a document may use, copied on the ImGui thread so the document can be laid out on
+ * a worker without touching ImGui. Captured at BaseFontSize and scaled to the sizes the document asks for.
+ */
+struct FontSnapshot {
+  struct Face {
+    float Size = 0.0f;
+    float Ascent = 0.0f;
+    float Descent = 0.0f;
+    float FallbackAdvance = 0.0f;
+    std::unordered_map<unsigned int, float> Advances;
+  };
 
-    const float axis_len = sqrtf(axis_len_sq);
-    const ImVec2 dir(axis.x / axis_len, axis.y / axis_len);
-    const ImVec2 normal(-dir.y, dir.x);
+  ImFont* Fallback = nullptr;  // ImGui::GetFont() when captured
+  std::unordered_map<const ImFont*, Face> Faces;
+};
 
-    const float w = lgm.border_max.x - lgm.border_min.x;
-    const float h = lgm.border_max.y - lgm.border_min.y;
-    const float extent = sqrtf(w * w + h * h) + 2.0f;
-    const float approx_span = ImMax(w, h);
+static void snapshotFont(FontSnapshot& snapshot, ImFont* font, float size, const std::vector<unsigned int>& codepoints) {
+  if (!font || snapshot.Faces.count(font) > 0) {
+    return;
+  }
 
-    const int strips = (int)ImClamp(axis_len / 2.0f + approx_span / 4.0f, 16.0f, 128.0f);
-    const std::vector<ImVec2> fill_poly = build_layer_fill_polygon(lgm, 8);
+  ImFontBaked* baked = font->GetFontBaked(size);
+  FontSnapshot::Face& face = snapshot.Faces[font];
+  face.Size = baked->Size;
+  face.Ascent = baked->Ascent;
+  face.Descent = baked->Descent;
+  face.FallbackAdvance = baked->FallbackAdvanceX;
+  face.Advances.reserve(codepoints.size());
+  for (unsigned int c : codepoints) {
+    face.Advances[c] = baked->GetCharAdvance((ImWchar)c);
+  }
+}
 
-    auto color_for_point = [&](const ImVec2& p) -> ImU32 {
-      float t = ((p.x - start.x) * axis.x + (p.y - start.y) * axis.y) / axis_len_sq;
-      t = ImClamp(t, 0.0f, 1.0f);
-      return to_im_col32(sample_gradient_color(gradient.color_points, t));
-    };
+/**
+ * Snapshots every font of the config for printable ASCII and the codepoints that appear in html. Bakes missing
+ * glyphs, so it has to run on the ImGui thread.
+ */
+static std::shared_ptr<const FontSnapshot> captureFonts(const Config& cfg, const char* html) {
+  std::vector<unsigned int> codepoints;
+  for (unsigned int c = 32; c < 127; ++c) {
+    codepoints.push_back(c);
+  }
 
-    for (int i = 0; i < strips; ++i) {
-      const float t0 = (float)i / (float)strips;
-      const float t1 = (float)(i + 1) / (float)strips;
+  const char* end = html + strlen(html);
+  for (const char* p = html; p < end;) {
+    unsigned int c = 0;
+    p += ImTextCharFromUtf8(&c, p, end);
+    if (c >= 127 && c <= IM_UNICODE_CODEPOINT_MAX) {
+      codepoints.push_back(c);
+    }
+  }
+  std::sort(codepoints.begin(), codepoints.end());
+  codepoints.erase(std::unique(codepoints.begin(), codepoints.end()), codepoints.end());
 
-      const ImVec2 p0 = start + dir * (t0 * axis_len);
-      const ImVec2 p1 = start + dir * (t1 * axis_len);
+  auto snapshot = std::make_shared<FontSnapshot>();
+  snapshot->Fallback = ImGui::GetFont();
+  snapshotFont(*snapshot, snapshot->Fallback, cfg.BaseFontSize, codepoints);
 
-      const std::vector<ImVec2> strip_quad = {
-          p0 - normal * extent,
-          p0 + normal * extent,
-          p1 + normal * extent,
-          p1 - normal * extent,
-      };
+  auto add_family = [&](const FontFamily& family) {
+    for (ImFont* font : {family.Regular, family.Bold, family.Italic, family.BoldItalic}) {
+      snapshotFont(*snapshot, font, cfg.BaseFontSize, codepoints);
+    }
+  };
+  add_family(cfg.DefaultFont);
+  for (const auto& [name, family] : cfg.FontFamilies) {
+    add_family(family);
+  }
 
-      draw_clipped_shaded_polygon(draw_list, strip_quad, fill_poly, color_for_point);
+  return snapshot;
+}
+
+/**
+ * Glyphs of one font at one size, copied from its ImFontBaked
+ */
+struct BakedGlyphs {
+  float Scale = 1.0f;  // from the baked size to the drawn size
+  float LineHeight = 0.0f;
+  std::array<ImFontGlyph, 95> Ascii{};  // ' ' .. '~'
+  std::unordered_map<unsigned int, ImFontGlyph> Other;
+  ImFontGlyph Fallback{};
+
+  const ImFontGlyph& find(unsigned int c) const {
+    if (c >= 32 && c < 127) {
+      return Ascii[c - 32];
     }
+    auto it = Other.find(c);
+    return it != Other.end() ? it->second : Fallback;
+  }
+};
+
+/**
+ * Glyphs of every font and size a display list draws text with, taken on the ImGui thread so draw bands can emit text
+ * on workers without baking glyphs or touching the font's caches
+ */
+struct GlyphSnapshot {
+  std::map<std::pair<const ImFont*, float>, BakedGlyphs> Fonts;
+  const ImTextureData* Texture = nullptr;  // font atlas texture the glyph UVs point into, null until taken
+
+  const BakedGlyphs* find(const ImFont* font, float size) const {
+    auto it = Fonts.find({font, size});
+    return it != Fonts.end() ? &it->second : nullptr;
   }
+};
 
-  void draw_radial_gradient_impl(const LayerGeometry& lgm,
-                                 const litehtml::background_layer::radial_gradient& gradient) {
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+// Held by draw bands around the caches shared by all canvases (images, shapes, gradient ramps)
+static std::mutex& bandMutex();
 
-    const ImVec2 screen_pos = ImGui::GetCursorScreenPos();
-    const ImVec2 center = screen_pos + ImVec2(gradient.position.x, gradient.position.y);
+/**
+ * What a container parsing and laying out a document on a worker uses instead of ImGui and the ImGui-thread caches,
+ * and what it leaves for the ImGui thread to finish after the document was swapped in.
+ */
+struct OffThreadLayout {
+  struct ImageLoad {
+    std::string Src;
+    std::string BaseUrl;
+    bool RedrawOnReady = false;
+  };
 
-    const float rx = gradient.radius.x;
-    const float ry = gradient.radius.y;
+  std::shared_ptr<const FontSnapshot> Fonts;
+  ImVec2 Viewport;
+  std::unordered_map<std::string, ImageMeta> ImageSizes;  // known image sizes by resource key
+  std::unordered_map<std::string, StyleSheet> Styles;     // copies of cached stylesheets by resource key
+  std::set<std::string> CustomElements;                   // tag names registered when the layout started
 
-    if (rx <= 0.0001f || ry <= 0.0001f || gradient.color_points.empty()) {
-      return;
-    }
+  std::vector<ImageLoad> ImageLoads;      // load_image calls, replayed on the ImGui thread
+  std::vector<std::string> LoadedStyles;  // keys of the Styles the worker loaded itself
+  bool FontMisses = false;                // text used a glyph missing from Fonts
+};
 
-    const std::vector<ImVec2> fill_poly = build_layer_fill_polygon(lgm, 12);
+/**
+ * The draw calls of one layout of a document, recorded in paint order from litehtml's draw traversal and replayed into
+ * draw lists by the container's emit functions. Positions are in document coordinates, so the same list is replayed
+ * wherever the canvas is scrolled to. The kind, payload and vertical extent of each op are parallel arrays, the
+ * arguments of the ops live in one array per kind.
+ */
+struct DisplayList {
+  enum class OpKind : unsigned char {
+    Text,
+    ListMarker,
+    Image,
+    SolidFill,
+    LinearGradient,
+    RadialGradient,
+    ConicGradient,
+    Borders,
+    CustomElement,
+  };
 
-    // Draw from outside to inside so smaller inner ellipses overwrite larger ones.
-    const int ring_count = 64;
-    const int ellipse_segments = 64;
+  struct TextRun {
+    unsigned int Offset = 0;  // into Chars
+    unsigned int Length = 0;
+    litehtml::uint_ptr Font = 0;
+    litehtml::web_color Color;
+    litehtml::position Pos;
+  };
 
-    for (int i = ring_count; i >= 1; --i) {
-      const float t = (float)i / (float)ring_count;
-      const std::vector<ImVec2> ellipse = build_ellipse_polygon(center, rx, ry, t, ellipse_segments);
+  struct ListMarker {
+    litehtml::list_marker Marker;  // baseurl is null, see BaseUrl
+    std::string BaseUrl;
+  };
 
-      std::vector<ImVec2> clipped = clip_polygon_convex(ellipse, fill_poly);
-      if (clipped.size() < 3) {
-        continue;
-      }
+  struct Image {
+    litehtml::background_layer Layer;
+    std::string Url;
+    std::string BaseUrl;
+  };
+
+  struct SolidFill {
+    litehtml::background_layer Layer;
+    litehtml::web_color Color;
+  };
+
+  struct LinearGradient {
+    litehtml::background_layer Layer;
+    litehtml::background_layer::linear_gradient Gradient;
+  };
+
+  struct RadialGradient {
+    litehtml::background_layer Layer;
+    litehtml::background_layer::radial_gradient Gradient;
+  };
+
+  struct ConicGradient {
+    litehtml::background_layer Layer;
+    litehtml::background_layer::conic_gradient Gradient;
+  };
+
+  struct Border {
+    litehtml::borders Borders;
+    litehtml::position DrawPos;
+    bool Root = false;
+  };
+
+  struct Custom {
+    std::string Tag;
+    litehtml::position Pos;
+    std::map<std::string, std::string> Attributes;
+  };
+
+  // Ops taller than this skip the y-index and are tested one by one, so a page-sized background does not widen the
+  // range every query scans
+  static constexpr float kMaxIndexedHeight = 512.0f;
+
+  // Document and draw clip the list was recorded for
+  const litehtml::document* Doc = nullptr;
+  litehtml::position Clip;
+
+  // One entry per op, in paint order
+  std::vector<OpKind> Kinds;
+  std::vector<unsigned int> Args;  // index into the argument array of the op's kind
+  std::vector<float> Tops;         // vertical extent of the op's geometry
+  std::vector<float> Bottoms;
+
+  // Arguments by kind
+  std::string Chars;  // text of all runs
+  std::vector<TextRun> Texts;
+  std::vector<ListMarker> Markers;
+  std::vector<Image> Images;
+  std::vector<SolidFill> Fills;
+  std::vector<LinearGradient> LinearGradients;
+  std::vector<RadialGradient> RadialGradients;
+  std::vector<ConicGradient> ConicGradients;
+  std::vector<Border> Borders;
+  std::vector<Custom> Customs;
+
+  // Y-index built by finish(): the ops up to kMaxIndexedHeight tall sorted by top, and the taller ones
+  std::vector<unsigned int> ByTop;
+  std::vector<float> SortedTops;
+  std::vector<unsigned int> Tall;
+
+  ImVec2 BottomRight = ImVec2(0, 0);  // extent of everything recorded
+  float RecordTime = 0.0f;            // seconds the recording took
+
+  GlyphSnapshot Glyphs;  // for draw bands, taken on first use after recording
+
+  int size() const { return (int)Kinds.size(); }
+
+  void clear() {
+    Doc = nullptr;
+    Kinds.clear();
+    Args.clear();
+    Tops.clear();
+    Bottoms.clear();
+    Chars.clear();
+    Texts.clear();
+    Markers.clear();
+    Images.clear();
+    Fills.clear();
+    LinearGradients.clear();
+    RadialGradients.clear();
+    ConicGradients.clear();
+    Borders.clear();
+    Customs.clear();
+    ByTop.clear();
+    SortedTops.clear();
+    Tall.clear();
+    BottomRight = ImVec2(0, 0);
+    Glyphs = GlyphSnapshot();
+  }
+
+  // Appends an op whose arguments were just added at index arg, with its geometry between top and bottom
+  void add(OpKind kind, size_t arg, float top, float bottom) {
+    Kinds.push_back(kind);
+    Args.push_back((unsigned int)arg);
+    Tops.push_back(top);
+    Bottoms.push_back(bottom);
+  }
+
+  void extend(const ImVec2& point) {
+    BottomRight.x = std::max(BottomRight.x, point.x);
+    BottomRight.y = std::max(BottomRight.y, point.y);
+  }
+
+  void finish() {
+    for (unsigned int i = 0; i < Kinds.size(); ++i) {
+      (Bottoms[i] - Tops[i] > kMaxIndexedHeight ? Tall : ByTop).push_back(i);
+    }
+    std::stable_sort(ByTop.begin(), ByTop.end(), [this](unsigned int a, unsigned int b) { return Tops[a] < Tops[b]; });
+
+    SortedTops.reserve(ByTop.size());
+    for (unsigned int i : ByTop) {
+      SortedTops.push_back(Tops[i]);
+    }
+  }
+
+  // Collects the ops whose geometry overlaps the rows top .. bottom, in paint order
+  void query(float top, float bottom, std::vector<unsigned int>& ops) const {
+    ops.clear();
+
+    // Indexed ops start at most kMaxIndexedHeight above the rows
+    const auto first = std::lower_bound(SortedTops.begin(), SortedTops.end(), top - kMaxIndexedHeight);
+    const auto last = std::lower_bound(first, SortedTops.end(), bottom);
+    for (auto it = first; it != last; ++it) {
+      const unsigned int op = ByTop[it - SortedTops.begin()];
+      if (Bottoms[op] >= top) {
+        ops.push_back(op);
+      }
+    }
+    for (unsigned int op : Tall) {
+      if (Tops[op] < bottom && Bottoms[op] >= top) {
+        ops.push_back(op);
+      }
+    }
+
+    std::sort(ops.begin(), ops.end());
+  }
+};
+
+//
+// Display list captures
+//
+// A capture starts with kCaptureMagic and kCaptureVersion, followed by the visible area and the draw clip of the canvas,
+// the fonts the text ops use, and the ops in paint order, each as its kind and the arguments of its draw callback.
+// Numbers are stored in host byte order, strings with their length in front.
+//
+
+static constexpr char kCaptureMagic[4] = {'I', 'M', 'D', 'L'};
+static constexpr unsigned int kCaptureVersion = 1;
+
+struct CaptureWriter {
+  std::string Bytes;
+
+  template <typename T>
+  void raw(const T& value) {
+    Bytes.append(reinterpret_cast<const char*>(&value), sizeof(T));
+  }
+
+  void u32(unsigned int value) { raw(value); }
+  void f32(float value) { raw(value); }
+
+  void str(const std::string& value) {
+    u32((unsigned int)value.size());
+    Bytes.append(value);
+  }
+
+  template <typename Point>
+  void point(const Point& value) {
+    f32((float)value.x);
+    f32((float)value.y);
+  }
+
+  void color(const litehtml::web_color& value) {
+    raw(value.red);
+    raw(value.green);
+    raw(value.blue);
+    raw(value.alpha);
+  }
+
+  void position(const litehtml::position& value) {
+    f32((float)value.x);
+    f32((float)value.y);
+    f32((float)value.width);
+    f32((float)value.height);
+  }
+
+  void radii(const litehtml::border_radiuses& value) {
+    for (litehtml::pixel_t radius : {value.top_left_x,
+                                     value.top_left_y,
+                                     value.top_right_x,
+                                     value.top_right_y,
+                                     value.bottom_right_x,
+                                     value.bottom_right_y,
+                                     value.bottom_left_x,
+                                     value.bottom_left_y}) {
+      f32((float)radius);
+    }
+  }
+
+  void layer(const litehtml::background_layer& value) {
+    position(value.border_box);
+    radii(value.border_radius);
+    position(value.clip_box);
+    position(value.origin_box);
+    u32((unsigned int)value.attachment);
+    u32((unsigned int)value.repeat);
+    u32(value.is_root ? 1 : 0);
+  }
+
+  void gradient(const litehtml::background_layer::gradient_base& value) {
+    u32((unsigned int)value.color_points.size());
+    for (const auto& point : value.color_points) {
+      f32(point.offset);
+      color(point.color);
+    }
+    u32((unsigned int)value.color_space);
+    u32((unsigned int)value.hue_interpolation);
+  }
+
+  void border(const litehtml::border& value) {
+    f32((float)value.width);
+    u32((unsigned int)value.style);
+    color(value.color);
+  }
+};
+
+// Reads what CaptureWriter wrote. Reading past the end yields zeroes and clears Ok.
+struct CaptureReader {
+  const unsigned char* Data = nullptr;
+  size_t Size = 0;
+  size_t Offset = 0;
+  bool Ok = true;
+
+  template <typename T>
+  T raw() {
+    T value{};
+    if (Size - Offset < sizeof(T)) {
+      Ok = false;
+      return value;
+    }
+    memcpy(&value, Data + Offset, sizeof(T));
+    Offset += sizeof(T);
+    return value;
+  }
+
+  unsigned int u32() { return raw<unsigned int>(); }
+  float f32() { return raw<float>(); }
+
+  std::string str() {
+    const unsigned int length = u32();
+    if (Size - Offset < length) {
+      Ok = false;
+      return {};
+    }
+    std::string value(reinterpret_cast<const char*>(Data + Offset), length);
+    Offset += length;
+    return value;
+  }
+
+  template <typename Point>
+  void point(Point& value) {
+    value.x = f32();
+    value.y = f32();
+  }
+
+  void color(litehtml::web_color& value) {
+    value.red = raw<unsigned char>();
+    value.green = raw<unsigned char>();
+    value.blue = raw<unsigned char>();
+    value.alpha = raw<unsigned char>();
+  }
+
+  void position(litehtml::position& value) {
+    value.x = (litehtml::pixel_t)f32();
+    value.y = (litehtml::pixel_t)f32();
+    value.width = (litehtml::pixel_t)f32();
+    value.height = (litehtml::pixel_t)f32();
+  }
+
+  void radii(litehtml::border_radiuses& value) {
+    for (litehtml::pixel_t* radius : {&value.top_left_x,
+                                      &value.top_left_y,
+                                      &value.top_right_x,
+                                      &value.top_right_y,
+                                      &value.bottom_right_x,
+                                      &value.bottom_right_y,
+                                      &value.bottom_left_x,
+                                      &value.bottom_left_y}) {
+      *radius = (litehtml::pixel_t)f32();
+    }
+  }
+
+  void layer(litehtml::background_layer& value) {
+    position(value.border_box);
+    radii(value.border_radius);
+    position(value.clip_box);
+    position(value.origin_box);
+    value.attachment = (decltype(value.attachment))u32();
+    value.repeat = (decltype(value.repeat))u32();
+    value.is_root = u32() != 0;
+  }
+
+  void gradient(litehtml::background_layer::gradient_base& value) {
+    const unsigned int count = u32();
+    for (unsigned int i = 0; i < count && Ok; ++i) {
+      litehtml::background_layer::color_point point;
+      point.offset = f32();
+      color(point.color);
+      value.color_points.push_back(point);
+    }
+    value.color_space = (decltype(value.color_space))u32();
+    value.hue_interpolation = (decltype(value.hue_interpolation))u32();
+  }
+
+  void border(litehtml::border& value) {
+    value.width = (litehtml::pixel_t)f32();
+    value.style = (decltype(value.style))u32();
+    color(value.color);
+  }
+};
+
+}  // namespace
+
+class BrowserContainer : public litehtml::document_container {
+ private:
+  std::string title = "Browser";
+  std::string loadUrl = "";
+  std::string currentUrl = "";
+  std::vector<std::string> history = {};
+  float width;
+  Config config;
+  std::string canvasId;
+  std::set<std::string> lazyImages;  // src of <img loading="lazy">
+  std::unordered_map<std::string, ImU64> importedStyles;  // content hash of each stylesheet the document imported
+  std::unique_ptr<OffThreadLayout> offThread;  // set while the document is parsed and laid out on a worker
+  DisplayList displayList;                     // draw ops of the current layout
+
+ public:
+  BrowserContainer(float width, std::string canvasId = "") : width(width), canvasId(std::move(canvasId)) {}
+
+  ImVec2 get_bottom_right() { return displayList.BottomRight; }
+  std::string get_title() { return title; }
+  std::string pop_load_url() {
+    if (loadUrl.empty()) {
+      return "";
+    }
+
+    auto url = loadUrl;
+    loadUrl = "";
+    return url;
+  }
+  void go_back() {
+    if (!history.empty()) {
+      loadUrl = history.back();
+      history.pop_back();
+    }
+  }
+  bool can_go_back() { return !history.empty(); }
+  void set_current_url(std::string url) { currentUrl = url; }
+  std::string get_current_url() { return currentUrl; }
+  void refresh() { loadUrl = currentUrl; }
+  void set_config(Config config) { this->config = config; }
+
+  /**
+   * Hands the container to a worker: until end_off_thread, layout reads fonts, sizes and stylesheets from the
+   * snapshots in layout and defers image requests instead of touching ImGui or the ImGui-thread caches.
+   */
+  void begin_off_thread(std::unique_ptr<OffThreadLayout> layout) {
+    offThread = std::move(layout);
+    invalidate_display_list();
+  }
+
+  /**
+   * Back on the ImGui thread: adds the stylesheets the worker loaded to the cache and replays the image requests it
+   * deferred. Returns whether the layout has to run again because text used glyphs missing from the snapshot.
+   */
+  bool end_off_thread() {
+    std::unique_ptr<OffThreadLayout> layout = std::move(offThread);
+    if (!layout) {
+      return false;
+    }
+
+    for (const std::string& key : layout->LoadedStyles) {
+      StyleSheet& cached = styleSheets()[key];
+      if (!cached.Loaded && !cached.Load.valid()) {
+        cached = std::move(layout->Styles[key]);
+      }
+    }
+
+    for (const OffThreadLayout::ImageLoad& load : layout->ImageLoads) {
+      load_image(load.Src.c_str(), load.BaseUrl.c_str(), load.RedrawOnReady);
+    }
+
+    return layout->FontMisses;
+  }
+
+  ImVec2 available_size() const { return offThread ? offThread->Viewport : ImGui::GetContentRegionAvail(); }
+
+  //
+  // Texture batching
+  //
+
+  static constexpr int kMaxBatchChannels = 8;
+
+  struct BatchChannel {
+    ImTextureID Texture = 0;
+    ImRect Bounds = ImRect(FLT_MAX, FLT_MAX, -FLT_MAX, -FLT_MAX);  // union of Rects
+    std::vector<ImRect> Rects;
+  };
+
+  /**
+   * Where a draw pass emits geometry, and the clip and batching state of that draw list. The canvas draws into
+   * mainTarget, each band of a banded draw into its own target on a worker.
+   */
+  struct DrawTarget {
+    ImDrawList* DrawList = nullptr;
+    ImVec2 Origin;  // screen position of the document's top-left corner
+    // Clip rect of the draw list when the pass started
+    ImVec4 BaseClip = ImVec4(-FLT_MAX, -FLT_MAX, FLT_MAX, FLT_MAX);
+    // Clip rect pushed by the container, kept active across consecutive primitives that share it
+    bool ClipActive = false;
+    ImVec4 ActiveClip;
+    ImDrawListSplitter Splitter;
+    std::vector<BatchChannel> Channels;
+    std::vector<unsigned int> Ops;  // display list ops this pass emits
+    int EmittedOps = 0;
+
+    // Set for the bands of a banded draw, which run concurrently on workers
+    bool Band = false;
+    const GlyphSnapshot* Glyphs = nullptr;
+    std::vector<std::vector<litehtml::background_layer::color_point>> PendingRamps;  // created after the bands
+  };
+
+  DrawTarget mainTarget;
+  // Target of the draw pass running on this thread
+  static inline thread_local DrawTarget* drawTarget = nullptr;
+
+  static DrawTarget& target() { return *drawTarget; }
+
+  // Locks the caches shared by all canvases while bands draw concurrently, does nothing otherwise
+  static std::unique_lock<std::mutex> lock_shared_caches() {
+    return target().Band ? std::unique_lock<std::mutex>(bandMutex()) : std::unique_lock<std::mutex>();
+  }
+
+  bool overlaps_later_channels(int channel, const ImRect& bounds) const {
+    const std::vector<BatchChannel>& channels = target().Channels;
+    for (size_t i = channel + 1; i < channels.size(); ++i) {
+      if (!channels[i].Bounds.Overlaps(bounds)) {
+        continue;
+      }
+      for (const ImRect& rect : channels[i].Rects) {
+        if (rect.Overlaps(bounds)) {
+          return true;
+        }
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Routes the next primitive into a splitter channel of its texture. A primitive may join an earlier channel of the
+   * same texture only if it does not overlap anything already drawn into later channels, otherwise it would end up
+   * below geometry it was drawn on top of. Channels are merged back in order, so the result looks identical while the
+   * atlas geometry and each image's quads end up in few draw commands.
+   */
+  void route_primitive(ImDrawList* draw_list, ImTextureID texture, const ImRect& bounds) {
+    if (!config.BatchByTexture) {
+      return;
+    }
+
+    ImDrawListSplitter& splitter = target().Splitter;
+    std::vector<BatchChannel>& channels = target().Channels;
+    if (splitter._Count <= 1) {
+      splitter.Split(draw_list, kMaxBatchChannels);
+      channels.clear();
+    }
+
+    int target = -1;
+    for (int i = (int)channels.size() - 1; i >= 0; --i) {
+      if (channels[i].Texture == texture) {
+        target = i;
+        break;
+      }
+    }
+
+    if (target < 0 || overlaps_later_channels(target, bounds)) {
+      if ((int)channels.size() == kMaxBatchChannels) {
+        // Out of channels: everything so far is drawn first, start over with a fresh set.
+        splitter.Merge(draw_list);
+        splitter.Split(draw_list, kMaxBatchChannels);
+        channels.clear();
+      }
+
+      channels.push_back(BatchChannel{.Texture = texture});
+      target = (int)channels.size() - 1;
+    }
+
+    BatchChannel& channel = channels[target];
+    channel.Bounds.Add(bounds);
+    channel.Rects.push_back(bounds);
+    splitter.SetCurrentChannel(draw_list, target);
+  }
+
+  //
+  // Clip rect management
+  //
+
+  static bool clip_contains(const ImVec4& clip, const ImVec2& p_min, const ImVec2& p_max) {
+    return p_min.x >= clip.x && p_min.y >= clip.y && p_max.x <= clip.z && p_max.y <= clip.w;
+  }
+
+  static bool clip_equals(const ImVec4& a, const ImVec4& b) {
+    return a.x == b.x && a.y == b.y && a.z == b.z && a.w == b.w;
+  }
+
+  void begin_draw(ImDrawList* draw_list) { begin_draw(mainTarget, draw_list, ImGui::GetCursorScreenPos()); }
+
+  static void begin_draw(DrawTarget& t, ImDrawList* draw_list, const ImVec2& origin) {
+    t.DrawList = draw_list;
+    t.Origin = origin;
+    t.BaseClip = draw_list->_CmdHeader.ClipRect;
+    t.ClipActive = false;
+    t.EmittedOps = 0;
+    drawTarget = &t;
+  }
+
+  static void end_draw() {
+    yield_draw_list(target().DrawList);
+    drawTarget = nullptr;
+  }
+
+  /**
+   * Hands the draw list back to plain ImGui calls: releases the active clip rect and merges the batching channels.
+   */
+  static void yield_draw_list(ImDrawList* draw_list) {
+    release_clip(draw_list);
+
+    DrawTarget& t = target();
+    if (t.Splitter._Count > 1) {
+      t.Splitter.Merge(draw_list);
+    }
+    t.Channels.clear();
+  }
+
+  static void release_clip(ImDrawList* draw_list) {
+    DrawTarget& t = target();
+    if (t.ClipActive) {
+      draw_list->PopClipRect();
+      t.ClipActive = false;
+    }
+  }
+
+  /**
+   * Prepares the draw list for geometry inside bounds that must be clipped to clip_min/clip_max. No clip rect is pushed
+   * when the clip would not cut the geometry, and a clip rect pushed for a previous primitive is reused when it is the
+   * same, so consecutive primitives stay in one ImDrawCmd. The texture is used for batching, 0 stands for the font
+   * atlas and untextured geometry.
+   */
+  void use_clip(ImDrawList* draw_list, ImTextureID texture, const ImVec2& clip_min, const ImVec2& clip_max,
+                const ImVec2& bounds_min, const ImVec2& bounds_max) {
+    route_primitive(draw_list,
+                    texture,
+                    ImRect(ImMax(bounds_min, clip_min), ImMin(bounds_max, clip_max)));
+
+    DrawTarget& t = target();
+    const ImVec4& baseClip = t.BaseClip;
+    const ImVec4 clip(ImMax(clip_min.x, baseClip.x),
+                      ImMax(clip_min.y, baseClip.y),
+                      ImMin(clip_max.x, baseClip.z),
+                      ImMin(clip_max.y, baseClip.w));
+
+    if (clip_equals(clip, baseClip) || clip_contains(clip, bounds_min, bounds_max)) {
+      // The clip is redundant; only an active clip that would cut the geometry has to go.
+      if (t.ClipActive && !clip_contains(t.ActiveClip, bounds_min, bounds_max)) {
+        release_clip(draw_list);
+      }
+      return;
+    }
+
+    if (t.ClipActive && clip_equals(t.ActiveClip, clip)) {
+      return;
+    }
+
+    release_clip(draw_list);
+    draw_list->PushClipRect(ImVec2(clip.x, clip.y), ImVec2(clip.z, clip.w), false);
+    t.ActiveClip = clip;
+    t.ClipActive = true;
+  }
+
+  // Prepares the draw list for geometry that is not clipped by the document.
+  void use_no_clip(ImDrawList* draw_list, ImTextureID texture, const ImVec2& bounds_min, const ImVec2& bounds_max) {
+    route_primitive(draw_list, texture, ImRect(bounds_min, bounds_max));
+
+    const DrawTarget& t = target();
+    if (t.ClipActive && !clip_contains(t.ActiveClip, bounds_min, bounds_max)) {
+      release_clip(draw_list);
+    }
+  }
+
+  //
+  // Font functions
+  //
+
+  struct ResolvedFont {
+    ImFont* Font = nullptr;
+    FontStyle Style = FontStyle::Regular;
+    std::string Family;
+    float Size = 16.0f;
+    litehtml::font_metrics Metrics{};
+  };
+
+  std::vector<std::unique_ptr<ResolvedFont>> fonts_;
+
+  static ResolvedFont* from_handle(litehtml::uint_ptr hFont) { return reinterpret_cast<ResolvedFont*>(hFont); }
+
+  virtual litehtml::uint_ptr create_font(const litehtml::font_description& descr, const litehtml::document* doc,
+                                         litehtml::font_metrics* fm) override {
+    bool bold = descr.weight > 400;
+    bool italic = descr.style == litehtml::font_style_italic;
+
+    FontStyle font_style = FontStyle::Regular;
+    if (bold && italic) {
+      font_style = FontStyle::BoldItalic;
+    } else if (bold) {
+      font_style = FontStyle::Bold;
+    } else if (italic) {
+      font_style = FontStyle::Italic;
+    }
+
+    ImFont* font = resolveFont(config, descr.family, font_style, offThread ? offThread->Fonts->Fallback : nullptr);
+
+    auto rf = std::make_unique<ResolvedFont>();
+    rf->Font = font;
+    rf->Style = font_style;
+    rf->Family = descr.family;
+    rf->Size = descr.size;
+
+    if (offThread) {
+      const FontSnapshot::Face* face = find_snapshot_face(font);
+      const float scale = face && face->Size > 0.0f ? descr.size / face->Size : 1.0f;
+
+      rf->Metrics.font_size = (int)descr.size;
+      rf->Metrics.height = (int)descr.size;
+      rf->Metrics.ascent = face ? (int)(face->Ascent * scale) : (int)(descr.size * 0.8f);
+      rf->Metrics.descent = face ? (int)(-face->Descent * scale) : (int)(descr.size * 0.2f);
+      rf->Metrics.x_height = rf->Metrics.ascent / 2;
+
+      if (fm) {
+        *fm = rf->Metrics;
+      }
+
+      ResolvedFont* raw = rf.get();
+      fonts_.push_back(std::move(rf));
+      return reinterpret_cast<litehtml::uint_ptr>(raw);
+    }
+
+    const float base_size = font ? font->GetFontBaked(descr.size)->Size : ImGui::GetFontSize();
+    const float scale = base_size > 0.0f ? (descr.size / base_size) : 1.0f;
+
+    rf->Metrics.font_size = (int)descr.size;
+    rf->Metrics.height = (int)(base_size * scale);
+    rf->Metrics.ascent = font ? (int)(font->GetFontBaked(descr.size)->Ascent * scale) : (int)(base_size * 0.8f);
+    rf->Metrics.descent = font ? (int)(-font->GetFontBaked(descr.size)->Descent * scale) : (int)(base_size * 0.2f);
+    rf->Metrics.x_height = rf->Metrics.ascent / 2;
+
+    if (fm) {
+      *fm = rf->Metrics;
+    }
+
+    ResolvedFont* raw = rf.get();
+    fonts_.push_back(std::move(rf));
+    return reinterpret_cast<litehtml::uint_ptr>(raw);
+  }
+
+  virtual void delete_font(litehtml::uint_ptr hFont) override {
+    // do nothing for now
+  }
+
+  virtual litehtml::pixel_t text_width(const char* text, litehtml::uint_ptr hFont) override {
+    auto* rf = from_handle(hFont);
+    if (!rf || !rf->Font || !text) {
+      return 0;
+    }
+
+    const char* end = text + strlen(text);
+    if (offThread) {
+      return (litehtml::pixel_t)snapshot_text_width(rf, text, end);
+    }
+
+    ImVec2 size = rf->Font->CalcTextSizeA(rf->Size, FLT_MAX, 0.0f, text, end, nullptr);
+    return (litehtml::pixel_t)size.x;
+  }
+
+  const FontSnapshot::Face* find_snapshot_face(const ImFont* font) const {
+    auto it = offThread->Fonts->Faces.find(font);
+    return it != offThread->Fonts->Faces.end() ? &it->second : nullptr;
+  }
+
+  // Width of text as CalcTextSizeA measures it, from the font snapshot
+  float snapshot_text_width(const ResolvedFont* rf, const char* text, const char* end) {
+    const FontSnapshot::Face* face = find_snapshot_face(rf->Font);
+    if (!face || face->Size <= 0.0f) {
+      offThread->FontMisses = true;
+      return 0.0f;
+    }
+
+    float width = 0.0f, line_width = 0.0f;
+    for (const char* p = text; p < end;) {
+      unsigned int c = 0;
+      p += ImTextCharFromUtf8(&c, p, end);
+      if (c == '\n') {
+        width = std::max(width, line_width);
+        line_width = 0.0f;
+        continue;
+      }
+      if (c == '\r') {
+        continue;
+      }
+
+      auto advance = face->Advances.find(c);
+      if (advance != face->Advances.end()) {
+        line_width += advance->second;
+      } else {
+        line_width += face->FallbackAdvance;
+        offThread->FontMisses = true;
+      }
+    }
+
+    return std::max(width, line_width) * (rf->Size / face->Size);
+  }
+
+  virtual void draw_text(litehtml::uint_ptr hdc, const char* text, litehtml::uint_ptr hFont, litehtml::web_color color,
+                         const litehtml::position& pos) override {
+    auto* rf = from_handle(hFont);
+    if (!rf || !rf->Font || !text) {
+      return;
+    }
+
+    const size_t length = strlen(text);
+    const ImVec2 size = rf->Font->CalcTextSizeA(rf->Size, FLT_MAX, 0.0f, text, text + length, nullptr);
+
+    DisplayList& list = displayList;
+    list.Texts.push_back(DisplayList::TextRun{
+        .Offset = (unsigned int)list.Chars.size(),
+        .Length = (unsigned int)length,
+        .Font = hFont,
+        .Color = color,
+        .Pos = pos,
+    });
+    list.Chars.append(text, length);
+    list.add(DisplayList::OpKind::Text, list.Texts.size() - 1, pos.y, pos.y + size.y);
+    list.extend(ImVec2(pos.x + size.x, pos.y + size.y));
+  }
+
+  void emit_text(const DisplayList::TextRun& run) {
+    const ResolvedFont* rf = from_handle(run.Font);
+    const char* text = displayList.Chars.data() + run.Offset;
+    const char* end = text + run.Length;
+
+    ImVec2 p = target().Origin + ImVec2(run.Pos.x, run.Pos.y);
+    ImU32 col = IM_COL32(run.Color.red, run.Color.green, run.Color.blue, run.Color.alpha);
+    ImDrawList* draw_list = target().DrawList;
+
+    if (const GlyphSnapshot* snapshot = target().Glyphs) {
+      if (const BakedGlyphs* glyphs = snapshot->find(rf->Font, rf->Size)) {
+        const ImVec2 size = measure_snapshot_text(*glyphs, text, end);
+        use_no_clip(draw_list, 0, p, p + size);
+        emit_snapshot_text(draw_list, *glyphs, p, col, text, end);
+      }
+      return;
+    }
+
+    ImVec2 size = rf->Font->CalcTextSizeA(rf->Size, FLT_MAX, 0.0f, text, end, nullptr);
+    use_no_clip(draw_list, 0, p, p + size);
+    draw_list->AddText(rf->Font, rf->Size, p, col, text, end);
+  }
+
+  static ImVec2 measure_snapshot_text(const BakedGlyphs& glyphs, const char* text, const char* end) {
+    float width = 0.0f, line_width = 0.0f;
+    int lines = 1;
+    for (const char* p = text; p < end;) {
+      unsigned int c = 0;
+      p += ImTextCharFromUtf8(&c, p, end);
+      if (c == '\n') {
+        width = std::max(width, line_width);
+        line_width = 0.0f;
+        lines++;
+      } else if (c != '\r') {
+        line_width += glyphs.find(c).AdvanceX * glyphs.Scale;
+      }
+    }
+    return ImVec2(std::max(width, line_width), (float)lines * glyphs.LineHeight);
+  }
+
+  /**
+   * Emits text the way ImFont::RenderText does, from a glyph snapshot.
+   */
+  static void emit_snapshot_text(ImDrawList* draw_list, const BakedGlyphs& glyphs, const ImVec2& pos, ImU32 col,
+                                 const char* text, const char* end) {
+    const float scale = glyphs.Scale;
+    const ImU32 col_untinted = col | ~IM_COL32_A_MASK;
+    const float line_start = IM_TRUNC(pos.x);
+    float x = line_start;
+    float y = IM_TRUNC(pos.y);
+
+    const int reserved = (int)(end - text);
+    draw_list->PrimReserve(reserved * 6, reserved * 4);
+
+    int quads = 0;
+    for (const char* p = text; p < end;) {
+      unsigned int c = 0;
+      p += ImTextCharFromUtf8(&c, p, end);
+      if (c == '\n') {
+        x = line_start;
+        y += glyphs.LineHeight;
+        continue;
+      }
+      if (c == '\r') {
+        continue;
+      }
+
+      const ImFontGlyph& glyph = glyphs.find(c);
+      if (glyph.Visible) {
+        draw_list->PrimRectUV(ImVec2(x + glyph.X0 * scale, y + glyph.Y0 * scale),
+                              ImVec2(x + glyph.X1 * scale, y + glyph.Y1 * scale),
+                              ImVec2(glyph.U0, glyph.V0),
+                              ImVec2(glyph.U1, glyph.V1),
+                              glyph.Colored ? col_untinted : col);
+        quads++;
+      }
+      x += glyph.AdvanceX * scale;
+    }
+
+    draw_list->PrimUnreserve((reserved - quads) * 6, (reserved - quads) * 4);
+  }
+
+  //
+  // Measurement and defaults
+  //
+
+  virtual litehtml::pixel_t pt_to_px(float pt) const override { return pt; }
+  virtual litehtml::pixel_t get_default_font_size() const override { return config.BaseFontSize; }
+  virtual const char* get_default_font_name() const override { return "Default"; }
+
+  //
+  // Drawing functions
+  //
+
+  struct LayerGeometry {
+    ImVec2 border_min;
+    ImVec2 border_max;
+    ImVec2 clip_min;
+    ImVec2 clip_max;
+    float tl, tr, br, bl;
+  };
+
+  LayerGeometry get_layer_geometry(const litehtml::background_layer& layer) const {
+    ImVec2 screen_pos = target().Origin;
+
+    LayerGeometry g;
+    g.border_min = screen_pos + ImVec2((float)layer.border_box.x, (float)layer.border_box.y);
+    g.border_max = screen_pos + ImVec2((float)(layer.border_box.x + layer.border_box.width),
+                                       (float)(layer.border_box.y + layer.border_box.height));
+    g.clip_min = screen_pos + ImVec2((float)layer.clip_box.x, (float)layer.clip_box.y);
+    g.clip_max = screen_pos + ImVec2((float)(layer.clip_box.x + layer.clip_box.width),
+                                     (float)(layer.clip_box.y + layer.clip_box.height));
+
+    g.tl = (float)layer.border_radius.top_left_x;
+    g.tr = (float)layer.border_radius.top_right_x;
+    g.br = (float)layer.border_radius.bottom_right_x;
+    g.bl = (float)layer.border_radius.bottom_left_x;
+    return g;
+  }
+
+  virtual void draw_list_marker(litehtml::uint_ptr hdc, const litehtml::list_marker& marker) override {
+    DisplayList& list = displayList;
+    list.Markers.push_back(DisplayList::ListMarker{.Marker = marker, .BaseUrl = marker.baseurl ? marker.baseurl : ""});
+    list.Markers.back().Marker.baseurl = nullptr;
+    list.add(DisplayList::OpKind::ListMarker,
+             list.Markers.size() - 1,
+             marker.pos.y - 1.0f,
+             marker.pos.y + marker.pos.height + 1.0f);
+    list.extend(ImVec2(marker.pos.x + marker.pos.width, marker.pos.y + marker.pos.height));
+  }
+
+  void emit_list_marker(const litehtml::list_marker& marker) {
+    ImDrawList* draw_list = target().DrawList;
+    ImVec2 center = target().Origin +
+                    ImVec2(marker.pos.x + marker.pos.width / 2.0f, marker.pos.y + marker.pos.height / 2.0f);
+    float radius = marker.pos.width / 2.0f;
+    ImU32 color = IM_COL32(marker.color.red, marker.color.green, marker.color.blue, marker.color.alpha);
+
+    const ImVec2 marker_min = target().Origin + ImVec2(marker.pos.x, marker.pos.y);
+    use_no_clip(
+        draw_list, 0, marker_min - ImVec2(1, 1), marker_min + ImVec2(marker.pos.width + 1, marker.pos.height + 1));
+
+    switch (marker.marker_type) {
+      case litehtml::list_style_type_circle:
+        draw_list->AddCircle(center, radius, color, 0, 1.5f);
+        break;
+      case litehtml::list_style_type_disc:
+        draw_list->AddCircleFilled(center, radius, color);
+        break;
+      case litehtml::list_style_type_square: {
+        ImVec2 p_min = target().Origin + ImVec2(marker.pos.x, marker.pos.y);
+        ImVec2 p_max = p_min + ImVec2(marker.pos.width, marker.pos.height);
+        draw_list->AddRectFilled(p_min, p_max, color);
+        break;
+      }
+      default:
+        draw_list->AddCircleFilled(center, radius, color);
+        break;
+    }
+  }
+
+  bool is_lazy_image(const char* src) const { return config.LazyLoadImages || lazyImages.count(src) > 0; }
+
+  /**
+   * Has the canvas laid out again when a decode in flight turns out a different size than layout used. Images that
+   * keep their size only get redrawn, which happens anyway.
+   */
+  void wait_for_image(ImageEntry& image) const {
+    if (image.Status == ImageStatus::Loading && !canvasId.empty()) {
+      image.WaitingCanvases.insert(canvasId);
+    }
+  }
+
+  /**
+   * Whether a box is within LazyLoadMargin of the visible part of the canvas
+   */
+  bool is_near_visible(const ImVec2& p_min, const ImVec2& p_max) const {
+    const float margin = config.LazyLoadMargin;
+    const ImVec4& baseClip = target().BaseClip;
+    return p_max.x >= baseClip.x - margin && p_max.y >= baseClip.y - margin && p_min.x <= baseClip.z + margin &&
+           p_min.y <= baseClip.w + margin;
+  }
+
+  virtual void load_image(const char* src, const char* baseurl, bool redraw_on_ready) override {
+    if (offThread) {
+      offThread->ImageLoads.push_back(OffThreadLayout::ImageLoad{src, baseurl, redraw_on_ready});
+      return;
+    }
+
+    if (useAsyncImages(config)) {
+      ImageEntry& image = findImage(config, src, baseurl);
+      if (image.Status == ImageStatus::Unknown && !is_lazy_image(src)) {
+        // Without a probed size the image has to be decoded before layout is final
+        decodeImage(config, image, src, baseurl, JobPriority::Normal);
+      }
+      // Registered whatever redraw_on_ready says: litehtml passes false exactly when layout depends on the image size
+      wait_for_image(image);
+      return;
+    }
+
+    if (!config.LoadImage) {
+      return;
+    }
+
+    config.LoadImage(src, baseurl);
+  }
+
+  virtual void get_image_size(const char* src, const char* baseurl, litehtml::size& sz) override {
+    if (offThread && useAsyncImages(config)) {
+      auto [it, inserted] = offThread->ImageSizes.try_emplace(resourceKey(src, baseurl), ImageMeta{0, 0});
+      if (inserted && config.ProbeImageSize) {
+        config.ProbeImageSize(src, baseurl, &it->second.Width, &it->second.Height);
+      }
+
+      const bool known = it->second.Width > 0 && it->second.Height > 0;
+      sz.width = known ? it->second.Width : config.ImagePlaceholderSize.Width;
+      sz.height = known ? it->second.Height : config.ImagePlaceholderSize.Height;
+      return;
+    }
+
+    // list-style-image markers ask for their size while drawing, maybe from a band
+    std::unique_lock<std::mutex> lock = drawTarget ? lock_shared_caches() : std::unique_lock<std::mutex>();
+
+    if (useAsyncImages(config)) {
+      ImageEntry& image = findImage(config, src, baseurl);
+      if (image.Status == ImageStatus::Unknown && !is_lazy_image(src)) {
+        decodeImage(config, image, src, baseurl, JobPriority::Normal);
+      }
+      wait_for_image(image);
+
+      if (image.Width > 0 && image.Height > 0) {
+        sz.width = image.Width;
+        sz.height = image.Height;
+      } else if (image.Status == ImageStatus::Loading || image.Status == ImageStatus::Unknown) {
+        sz.width = config.ImagePlaceholderSize.Width;
+        sz.height = config.ImagePlaceholderSize.Height;
+      }
+      return;
+    }
+
+    if (!config.GetImageMeta) {
+      return;
+    }
+
+    auto image_meta = config.GetImageMeta(src, baseurl);
+    sz.width = image_meta.Width;
+    sz.height = image_meta.Height;
+  }
+
+  virtual void draw_image(litehtml::uint_ptr hdc, const litehtml::background_layer& layer, const std::string& url,
+                          const std::string& base_url) override {
+    DisplayList& list = displayList;
+    list.Images.push_back(DisplayList::Image{.Layer = layer, .Url = url, .BaseUrl = base_url});
+
+    // Tiles cover the clip box, which may reach past the border box
+    const litehtml::position& border = layer.border_box;
+    const litehtml::position& clip = layer.clip_box;
+    list.add(DisplayList::OpKind::Image,
+             list.Images.size() - 1,
+             (float)std::min(border.y, clip.y) - 1.0f,
+             (float)std::max(border.y + border.height, clip.y + clip.height) + 1.0f);
+    list.extend(ImVec2((float)(border.x + border.width), (float)(border.y + border.height)));
+  }
+
+  void emit_image(const litehtml::background_layer& layer, const std::string& url, const std::string& base_url) {
+    LayerGeometry lgm = this->get_layer_geometry(layer);
+    ImVec2 p_min = lgm.border_min;
+    ImVec2 p_max = lgm.border_max;
+
+    ImTextureID texture = 0;
+    ImVec2 uv0(0, 0), uv1(1, 1);
+    std::unique_lock<std::mutex> lock = lock_shared_caches();
+    if (useAsyncImages(config)) {
+      // Images are only decoded and uploaded once they are actually drawn
+      ImageEntry& image = findImage(config, url.c_str(), base_url.c_str());
+
+      const ImVec2 scale = ImGui::GetIO().DisplayFramebufferScale;
+      image.DrawWidth = std::max(image.DrawWidth, (int)ceilf((float)layer.origin_box.width * scale.x));
+      image.DrawHeight = std::max(image.DrawHeight, (int)ceilf((float)layer.origin_box.height * scale.y));
+
+      const ImageTexture* resident = useImageTexture(image);
+      if (resident) {
+        texture = resident->Texture;
+        uv0 = resident->Uv0;
+        uv1 = resident->Uv1;
+      }
+
+      if (!texture) {
+        if (is_lazy_image(url.c_str()) && !is_near_visible(p_min, p_max)) {
+          return;
+        }
+
+        decodeImage(
+            config, image, url.c_str(), base_url.c_str(), JobPriority::Visible, image.DrawWidth, image.DrawHeight);
+        wait_for_image(image);
+      } else if (config.DownscaleImages && needsHigherResolution(image)) {
+        decodeImage(
+            config, image, url.c_str(), base_url.c_str(), JobPriority::Visible, image.DrawWidth, image.DrawHeight);
+      }
+    } else if (config.GetImageTexture) {
+      texture = config.GetImageTexture(url.c_str(), base_url.c_str());
+    }
+    lock = {};
+
+    if (!texture) {
+      return;
+    }
+
+    draw_image_tiles(layer, lgm, texture, uv0, uv1);
+  }
+
+  /**
+   * Draws an image layer, repeated over its clip box according to background-repeat. Textures with repeat addressing
+   * are drawn as a single quad with UVs past 1, others (including atlas slots) as one quad per visible tile. Rounded
+   * border boxes clip the geometry itself.
+   */
+  void draw_image_tiles(const litehtml::background_layer& layer, const LayerGeometry& lgm, ImTextureID texture,
+                        const ImVec2& uv0, const ImVec2& uv1) {
+    const ImVec2 tile_min = target().Origin + ImVec2((float)layer.origin_box.x, (float)layer.origin_box.y);
+    const ImVec2 tile_size((float)layer.origin_box.width, (float)layer.origin_box.height);
+    if (tile_size.x < 1.0f || tile_size.y < 1.0f) {
+      return;
+    }
+
+    const bool repeat_x = layer.repeat == litehtml::background_repeat_repeat ||
+                          layer.repeat == litehtml::background_repeat_repeat_x;
+    const bool repeat_y = layer.repeat == litehtml::background_repeat_repeat ||
+                          layer.repeat == litehtml::background_repeat_repeat_y;
+
+    // Painted area: the clip box, narrowed to the tile's row, column or the tile itself
+    ImVec2 area_min = lgm.clip_min;
+    ImVec2 area_max = lgm.clip_max;
+    if (!repeat_x) {
+      area_min.x = ImMax(area_min.x, tile_min.x);
+      area_max.x = ImMin(area_max.x, tile_min.x + tile_size.x);
+    }
+    if (!repeat_y) {
+      area_min.y = ImMax(area_min.y, tile_min.y);
+      area_max.y = ImMin(area_max.y, tile_min.y + tile_size.y);
+    }
+    if (area_min.x >= area_max.x || area_min.y >= area_max.y) {
+      return;
+    }
+
+    ImDrawList* draw_list = target().DrawList;
+    const bool rounded = has_rounded_corners(lgm);
+
+    if (!repeat_x && !repeat_y && !rounded) {
+      const ImVec2 tile_max = tile_min + tile_size;
+      use_clip(draw_list, texture, lgm.clip_min, lgm.clip_max, tile_min, tile_max);
+      if (config.PixelSnapBoxes) {
+        draw_list->AddImage(texture, snap_to_pixel(tile_min), snap_to_pixel(tile_max), uv0, uv1);
+      } else {
+        draw_list->AddImage(texture, tile_min, tile_max, uv0, uv1);
+      }
+      return;
+    }
+
+    // Tiles outside the visible part of the canvas are never generated
+    const ImVec4& visible = target().BaseClip;
+    const ImVec2 visible_min = ImMax(area_min, ImVec2(visible.x, visible.y));
+    const ImVec2 visible_max = ImMin(area_max, ImVec2(visible.z, visible.w));
+    if (visible_min.x >= visible_max.x || visible_min.y >= visible_max.y) {
+      return;
+    }
+
+    use_clip(draw_list, texture, lgm.clip_min, lgm.clip_max, area_min, area_max);
+
+    const std::vector<ImVec2> fill_poly = rounded ? build_layer_fill_polygon(lgm) : std::vector<ImVec2>();
+    // Atlas slots and clamped textures cannot be repeated by the sampler
+    const bool wrap = config.ImageTexturesRepeat && uv0.x == 0.0f && uv0.y == 0.0f && uv1.x == 1.0f && uv1.y == 1.0f;
+
+    const int first_x = repeat_x ? (int)floorf((visible_min.x - tile_min.x) / tile_size.x) : 0;
+    const int last_x = repeat_x ? (int)ceilf((visible_max.x - tile_min.x) / tile_size.x) - 1 : 0;
+    const int first_y = repeat_y ? (int)floorf((visible_min.y - tile_min.y) / tile_size.y) : 0;
+    const int last_y = repeat_y ? (int)ceilf((visible_max.y - tile_min.y) / tile_size.y) - 1 : 0;
+
+    draw_list->PushTexture(texture);
+
+    if (wrap) {
+      // One quad over the whole area, the sampler repeats the texture
+      auto uv_for_point = [&](const ImVec2& p) { return (p - tile_min) / tile_size; };
+      if (rounded) {
+        draw_convex_textured_polygon(
+            draw_list, clip_polygon_convex(build_rect_polygon(area_min, area_max), fill_poly), uv_for_point);
+      } else {
+        draw_list->PrimReserve(6, 4);
+        draw_list->PrimRectUV(area_min, area_max, uv_for_point(area_min), uv_for_point(area_max), IM_COL32_WHITE);
+      }
+    } else {
+      for (int ty = first_y; ty <= last_y; ++ty) {
+        for (int tx = first_x; tx <= last_x; ++tx) {
+          const ImVec2 t_min = tile_min + ImVec2(tile_size.x * (float)tx, tile_size.y * (float)ty);
+          const ImVec2 q_min = ImMax(t_min, visible_min);
+          const ImVec2 q_max = ImMin(t_min + tile_size, visible_max);
+          if (q_min.x >= q_max.x || q_min.y >= q_max.y) {
+            continue;
+          }
+
+          auto uv_for_point = [&](const ImVec2& p) { return uv0 + (p - t_min) / tile_size * (uv1 - uv0); };
+          if (rounded) {
+            draw_convex_textured_polygon(
+                draw_list, clip_polygon_convex(build_rect_polygon(q_min, q_max), fill_poly), uv_for_point);
+          } else {
+            draw_list->PrimReserve(6, 4);
+            draw_list->PrimRectUV(q_min, q_max, uv_for_point(q_min), uv_for_point(q_max), IM_COL32_WHITE);
+          }
+        }
+      }
+    }
+
+    draw_list->PopTexture();
+  }
+
+  //
+  // Pixel snapping
+  //
+
+  static ImVec2 snap_to_pixel(const ImVec2& p) { return ImFloor(p + ImVec2(0.5f, 0.5f)); }
+  static bool is_whole_pixel(float v) { return fabsf(v - roundf(v)) < 0.01f; }
+
+  /**
+   * Draws an unrounded border snapped to the pixel grid, without anti-aliasing. Uniform colours become four
+   * non-overlapping bars, mixed colours four mitred trapezoids.
+   */
+  static void draw_snapped_borders(ImDrawList* draw_list, const ImVec2& top_left, const ImVec2& bottom_right,
+                                   const float widths[4], const ImU32 colors[4]) {
+    const ImVec2 p_min = snap_to_pixel(top_left);
+    const ImVec2 p_max = snap_to_pixel(bottom_right);
+    const float t = roundf(widths[0]);
+    const float r = roundf(widths[1]);
+    const float b = roundf(widths[2]);
+    const float l = roundf(widths[3]);
+
+    if (colors[0] == colors[1] && colors[0] == colors[2] && colors[0] == colors[3]) {
+      const ImU32 col = colors[0];
+      if (t > 0.0f) draw_list->AddRectFilled(p_min, ImVec2(p_max.x, p_min.y + t), col);
+      if (b > 0.0f) draw_list->AddRectFilled(ImVec2(p_min.x, p_max.y - b), p_max, col);
+      if (l > 0.0f) draw_list->AddRectFilled(ImVec2(p_min.x, p_min.y + t), ImVec2(p_min.x + l, p_max.y - b), col);
+      if (r > 0.0f) draw_list->AddRectFilled(ImVec2(p_max.x - r, p_min.y + t), ImVec2(p_max.x, p_max.y - b), col);
+      return;
+    }
+
+    const ImVec2 i_min(p_min.x + l, p_min.y + t);
+    const ImVec2 i_max(p_max.x - r, p_max.y - b);
+    const std::vector<ImVec2> sides[4] = {
+        {p_min, ImVec2(p_max.x, p_min.y), ImVec2(i_max.x, i_min.y), i_min},
+        {ImVec2(p_max.x, p_min.y), p_max, i_max, ImVec2(i_max.x, i_min.y)},
+        {p_max, ImVec2(p_min.x, p_max.y), ImVec2(i_min.x, i_max.y), i_max},
+        {ImVec2(p_min.x, p_max.y), p_min, i_min, ImVec2(i_min.x, i_max.y)},
+    };
+    const float rounded_widths[4] = {t, r, b, l};
+
+    for (int side = 0; side < 4; ++side) {
+      if (rounded_widths[side] > 0.0f && (colors[side] & IM_COL32_A_MASK) != 0) {
+        draw_convex_shaded_polygon(draw_list, sides[side], [&](const ImVec2&) -> ImU32 { return colors[side]; });
+      }
+    }
+  }
+
+  //
+  // Shape cache
+  //
+
+  enum class ShapeKind : int { Fill, Border };
+
+  static ShapeKey make_shape_key(ImDrawList* draw_list, ShapeKind kind, const ImVec2& size) {
+    ShapeKey key{};
+    key.Kind = (int)kind;
+    key.Width = size.x;
+    key.Height = size.y;
+    key.Flags = draw_list->Flags;
+    key.FringeScale = draw_list->_FringeScale;
+    key.CircleSegmentMaxError = draw_list->_Data->CircleSegmentMaxError;
+    return key;
+  }
+
+  /**
+   * Draws a shape from the shape cache, translated to origin. On a cache miss the shape is built with build(dl) into a
+   * scratch draw list, with the box's top-left corner at (0, 0).
+   */
+  template <typename BuildFn>
+  static void draw_cached_shape(ImDrawList* draw_list, const ShapeKey& key, const ImVec2& origin, BuildFn&& build) {
+    const ImU64 hash = hashBytes(&key, sizeof(key));
+
+    // Only the lookup and the insertion hold the lock, bands tessellate and copy concurrently
+    std::shared_ptr<const ShapeMesh> cached;
+    {
+      std::unique_lock<std::mutex> lock = lock_shared_caches();
+      auto it = shapeCache().find(hash);
+      if (it != shapeCache().end() && memcmp(&it->second.Mesh->Key, &key, sizeof(key)) == 0) {
+        it->second.LastUse = ++shapeCacheUses();
+        cached = it->second.Mesh;
+      }
+    }
+
+    if (!cached) {
+      ImDrawList scratch(draw_list->_Data);
+      scratch._ResetForNewFrame();
+      // Textured AA lines sample the font atlas, keep everything on the white pixel so the UVs can be replaced.
+      scratch.Flags = draw_list->Flags & ~ImDrawListFlags_AntiAliasedLinesUseTex;
+      scratch._FringeScale = draw_list->_FringeScale;
+      scratch.PushClipRectFullScreen();
+      build(&scratch);
+
+      auto built = std::make_shared<ShapeMesh>();
+      built->Key = key;
+      built->Vertices.assign(scratch.VtxBuffer.begin(), scratch.VtxBuffer.end());
+      built->Indices.assign(scratch.IdxBuffer.begin(), scratch.IdxBuffer.end());
+      cached = built;
+
+      std::unique_lock<std::mutex> lock = lock_shared_caches();
+      if (shapeCache().size() >= kMaxCachedShapes) {
+        trimShapeCache();
+      }
+      shapeCache()[hash] = CachedShape{.Mesh = cached, .LastUse = ++shapeCacheUses()};
+    }
+
+    const ShapeMesh& mesh = *cached;
+    if (mesh.Indices.empty()) {
+      return;
+    }
+
+    draw_list->PrimReserve((int)mesh.Indices.size(), (int)mesh.Vertices.size());
+
+    const ImVec2 uv = draw_list->_Data->TexUvWhitePixel;
+    const unsigned int base = draw_list->_VtxCurrentIdx;
+
+    ImDrawVert* vtx = draw_list->_VtxWritePtr;
+    for (const ImDrawVert& v : mesh.Vertices) {
+      vtx->pos = v.pos + origin;
+      vtx->uv = uv;
+      vtx->col = v.col;
+      ++vtx;
+    }
+
+    ImDrawIdx* idx = draw_list->_IdxWritePtr;
+    for (ImDrawIdx i : mesh.Indices) {
+      *idx++ = (ImDrawIdx)(base + i);
+    }
+
+    draw_list->_VtxWritePtr = vtx;
+    draw_list->_IdxWritePtr = idx;
+    draw_list->_VtxCurrentIdx += (unsigned int)mesh.Vertices.size();
+  }
+
+  static void build_rounded_path(ImDrawList* draw_list, const ImVec2& p_min, const ImVec2& p_max, float tl, float tr,
+                                 float br, float bl) {
+    const float max_r = ImMin((p_max.x - p_min.x) * 0.5f, (p_max.y - p_min.y) * 0.5f);
+    tl = ImClamp(tl, 0.0f, max_r);
+    tr = ImClamp(tr, 0.0f, max_r);
+    br = ImClamp(br, 0.0f, max_r);
+    bl = ImClamp(bl, 0.0f, max_r);
+
+    draw_list->PathClear();
+
+    if (tl > 0.0f)
+      draw_list->PathArcTo(ImVec2(p_min.x + tl, p_min.y + tl), tl, IM_PI, IM_PI * 1.5f);
+    else
+      draw_list->PathLineTo(ImVec2(p_min.x, p_min.y));
+
+    if (tr > 0.0f)
+      draw_list->PathArcTo(ImVec2(p_max.x - tr, p_min.y + tr), tr, IM_PI * 1.5f, IM_PI * 2.0f);
+    else
+      draw_list->PathLineTo(ImVec2(p_max.x, p_min.y));
+
+    if (br > 0.0f)
+      draw_list->PathArcTo(ImVec2(p_max.x - br, p_max.y - br), br, 0.0f, IM_PI * 0.5f);
+    else
+      draw_list->PathLineTo(ImVec2(p_max.x, p_max.y));
+
+    if (bl > 0.0f)
+      draw_list->PathArcTo(ImVec2(p_min.x + bl, p_max.y - bl), bl, IM_PI * 0.5f, IM_PI);
+    else
+      draw_list->PathLineTo(ImVec2(p_min.x, p_max.y));
+  }
+
+  /**
+   * Builds a border with different widths and colours per side as a ring between the outer rounded box and the inner
+   * (padding) edge. Corners are split between their two sides along the mitre line from the outer to the inner corner.
+   *
+   * @param size The border box size, the ring is built with its top-left corner at (0, 0)
+   * @param radii Outer radii: top-left, top-right, bottom-right, bottom-left
+   * @param widths Side widths: top, right, bottom, left
+   * @param colors Side colours: top, right, bottom, left
+   */
+  static void build_border_ring(ImDrawList* draw_list, const ImVec2& size, const float radii[4], const float widths[4],
+                                const ImU32 colors[4], int arc_segments = 12) {
+    struct RingSample {
+      ImVec2 outer;
+      ImVec2 inner;
+    };
+
+    // Corners clockwise from the top-left: direction of the corner and start quadrant of its arc.
+    static const ImVec2 corner_dirs[4] = {ImVec2(-1, -1), ImVec2(1, -1), ImVec2(1, 1), ImVec2(-1, 1)};
+    static const int corner_quadrants[4] = {2, 3, 0, 1};
+
+    const float max_r = ImMin(size.x * 0.5f, size.y * 0.5f);
+
+    std::vector<RingSample> samples;
+    std::vector<int> owners;  // side index of the segment starting at each sample
+    samples.reserve(4 * (arc_segments + 1));
+    owners.reserve(4 * (arc_segments + 1));
+
+    for (int c = 0; c < 4; ++c) {
+      const ImVec2 dir = corner_dirs[c];
+      const ImVec2 corner(dir.x < 0 ? 0.0f : size.x, dir.y < 0 ? 0.0f : size.y);
+      const int side_a = (c + 3) % 4;  // side before the corner (clockwise)
+      const int side_b = c;            // side after the corner
+
+      const float wv = dir.x < 0 ? widths[3] : widths[1];  // width of the vertical side at this corner
+      const float wh = dir.y < 0 ? widths[0] : widths[2];  // width of the horizontal side at this corner
+      const float r = ImClamp(radii[c], 0.0f, max_r);
+      const float irx = ImMax(0.0f, r - wv);
+      const float iry = ImMax(0.0f, r - wh);
+
+      const ImVec2 outer_center(corner.x - dir.x * r, corner.y - dir.y * r);
+      const ImVec2 inner_center(corner.x - dir.x * (wv + irx), corner.y - dir.y * (wh + iry));
+      const ImVec2 inner_corner(corner.x - dir.x * wv, corner.y - dir.y * wh);
+
+      // Mitre line from the outer to the inner corner. The reference points along side_a away from the corner.
+      const ImVec2 mitre = inner_corner - corner;
+      const ImVec2 reference = (c % 2 == 0) ? ImVec2(0.0f, -dir.y) : ImVec2(-dir.x, 0.0f);
+      const float reference_side = cross2(mitre, reference);
+
+      const int segments = r > 0.0f ? arc_segments : 0;
+      const size_t first = samples.size();
+
+      for (int i = 0; i <= segments; ++i) {
+        const ImVec2 unit = segments > 0 ? quarter_arc_unit(corner_quadrants[c], i, segments) : ImVec2(0, 0);
+        samples.push_back({ImVec2(outer_center.x + unit.x * r, outer_center.y + unit.y * r),
+                           ImVec2(inner_center.x + unit.x * irx, inner_center.y + unit.y * iry)});
+        owners.push_back(side_b);
+      }
+
+      for (size_t i = first; i + 1 < samples.size(); ++i) {
+        const ImVec2 mid =
+            (samples[i].outer + samples[i + 1].outer + samples[i].inner + samples[i + 1].inner) * 0.25f - corner;
+        owners[i] = cross2(mitre, mid) * reference_side > 0.0f ? side_a : side_b;
+      }
+    }
+
+    const int count = (int)samples.size();
+    std::vector<ImVec2> outer(count), inner(count);
+    for (int i = 0; i < count; ++i) {
+      outer[i] = samples[i].outer;
+      inner[i] = samples[i].inner;
+    }
+
+    // Each side is one strip, so only the outer and inner edges get an anti-aliased fringe and neighbouring segments
+    // share their vertices instead of overlapping with translucent fringes.
+    RingEdges edges;
+    edges.Fringe = (draw_list->Flags & ImDrawListFlags_AntiAliasedFill) ? draw_list->_FringeScale * 0.5f : 0.0f;
+    loop_normals(outer, edges.OuterNormals);
+    loop_normals(inner, edges.InnerNormals);
+
+    // Start at a change of side so no strip wraps around the start, unless the whole ring is one side
+    int start = 0;
+    while (start < count && owners[start] == owners[(start + count - 1) % count]) {
+      start++;
+    }
+    if (start == count) {
+      start = 0;
+    }
+
+    for (int i = 0; i < count;) {
+      const int first = (start + i) % count;
+      const int side = owners[first];
+      int segments = 1;
+      while (i + segments < count && owners[(first + segments) % count] == side) {
+        segments++;
+      }
+      i += segments;
+
+      if (widths[side] > 0.0f && (colors[side] & IM_COL32_A_MASK) != 0) {
+        add_ring_strip(draw_list, outer, inner, edges, first, segments, colors[side]);
+      }
+    }
+  }
+
+  struct RingEdges {
+    std::vector<ImVec2> OuterNormals;
+    std::vector<ImVec2> InnerNormals;
+    float Fringe = 0.0f;  // half the anti-aliasing fringe, 0 without anti-aliasing
+  };
+
+  /**
+   * Normals of a closed loop in clockwise screen order, pointing out of the loop and scaled like ImGui's polygon
+   * fringes, so that moving a point by its normal moves both adjacent edges by one unit. Zero-length edges (collapsed
+   * inner corners) take the normal of the edge before them.
+   */
+  static void loop_normals(const std::vector<ImVec2>& points, std::vector<ImVec2>& normals) {
+    const int count = (int)points.size();
+    std::vector<ImVec2> edges(count);
+    std::vector<bool> valid(count, false);
+    int last_valid = -1;
+    for (int i = 0; i < count; ++i) {
+      const ImVec2 d = points[(i + 1) % count] - points[i];
+      const float length2 = d.x * d.x + d.y * d.y;
+      if (length2 > 1e-8f) {
+        const float inv_length = 1.0f / sqrtf(length2);
+        edges[i] = ImVec2(d.y * inv_length, -d.x * inv_length);
+        valid[i] = true;
+        last_valid = i;
+      }
+    }
+
+    normals.assign(count, ImVec2(0.0f, 0.0f));
+    if (last_valid < 0) {
+      return;
+    }
+    for (int k = 1; k < count; ++k) {
+      const int i = (last_valid + k) % count;
+      if (!valid[i]) {
+        edges[i] = edges[(i + count - 1) % count];
+      }
+    }
+
+    for (int i = 0; i < count; ++i) {
+      ImVec2 n = (edges[(i + count - 1) % count] + edges[i]) * 0.5f;
+      const float length2 = n.x * n.x + n.y * n.y;
+      if (length2 > 1e-6f) {
+        n = n * ImMin(1.0f / length2, 100.0f);
+      }
+      normals[i] = n;
+    }
+  }
+
+  /**
+   * Adds the part of a border ring from sample first over `segments` segments as one strip: a solid core between the
+   * outer and inner edge, with a fringe fading out past each of them when anti-aliased.
+   */
+  static void add_ring_strip(ImDrawList* draw_list, const std::vector<ImVec2>& outer, const std::vector<ImVec2>& inner,
+                             const RingEdges& edges, int first, int segments, ImU32 col) {
+    const int count = (int)outer.size();
+    const int stride = edges.Fringe > 0.0f ? 4 : 2;  // vertices per sample, from outside to inside
+    const ImU32 transparent = col & ~IM_COL32_A_MASK;
+    const ImVec2 uv = draw_list->_Data->TexUvWhitePixel;
+
+    draw_list->PrimReserve(segments * (stride - 1) * 6, (segments + 1) * stride);
+    const unsigned int base = draw_list->_VtxCurrentIdx;
+
+    for (int k = 0; k <= segments; ++k) {
+      const int i = (first + k) % count;
+      if (stride == 4) {
+        // The inner loop's normals point into the ring, away from the hole
+        const ImVec2 out = edges.OuterNormals[i] * edges.Fringe;
+        const ImVec2 in = edges.InnerNormals[i] * edges.Fringe;
+        draw_list->PrimWriteVtx(outer[i] + out, uv, transparent);
+        draw_list->PrimWriteVtx(outer[i] - out, uv, col);
+        draw_list->PrimWriteVtx(inner[i] + in, uv, col);
+        draw_list->PrimWriteVtx(inner[i] - in, uv, transparent);
+      } else {
+        draw_list->PrimWriteVtx(outer[i], uv, col);
+        draw_list->PrimWriteVtx(inner[i], uv, col);
+      }
+    }
+
+    for (int k = 0; k < segments; ++k) {
+      const unsigned int a = base + k * stride;
+      const unsigned int b = a + stride;
+      for (int band = 0; band + 1 < stride; ++band) {
+        draw_list->PrimWriteIdx((ImDrawIdx)(a + band));
+        draw_list->PrimWriteIdx((ImDrawIdx)(b + band));
+        draw_list->PrimWriteIdx((ImDrawIdx)(b + band + 1));
+        draw_list->PrimWriteIdx((ImDrawIdx)(a + band));
+        draw_list->PrimWriteIdx((ImDrawIdx)(b + band + 1));
+        draw_list->PrimWriteIdx((ImDrawIdx)(a + band + 1));
+      }
+    }
+  }
+
+  virtual void draw_solid_fill(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
+                               const litehtml::web_color& color) override {
+    if (color.alpha == 0 || !has_visible_box(layer)) {
+      return;
+    }
+
+    DisplayList& list = displayList;
+    list.Fills.push_back(DisplayList::SolidFill{.Layer = layer, .Color = color});
+    add_layer_op(DisplayList::OpKind::SolidFill, list.Fills.size() - 1, layer);
+  }
+
+  static bool has_visible_box(const litehtml::background_layer& layer) {
+    return layer.border_box.width > 0 && layer.border_box.height > 0 && layer.clip_box.width > 0 &&
+           layer.clip_box.height > 0;
+  }
+
+  // Records an op drawn into the border box of a layer
+  void add_layer_op(DisplayList::OpKind kind, size_t arg, const litehtml::background_layer& layer) {
+    const litehtml::position& bg_box = layer.border_box;
+    displayList.add(kind, arg, (float)bg_box.y - 1.0f, (float)(bg_box.y + bg_box.height) + 1.0f);
+    displayList.extend(ImVec2((float)(bg_box.x + bg_box.width), (float)(bg_box.y + bg_box.height)));
+  }
+
+  void emit_solid_fill(const litehtml::background_layer& layer, const litehtml::web_color& color) {
+    ImDrawList* draw_list = target().DrawList;
+
+    LayerGeometry lgm = this->get_layer_geometry(layer);
+
+    ImU32 col = IM_COL32(color.red, color.green, color.blue, color.alpha);
+
+    use_clip(draw_list, 0, lgm.clip_min, lgm.clip_max, lgm.border_min - ImVec2(1, 1), lgm.border_max + ImVec2(1, 1));
+
+    if (!has_rounded_corners(lgm)) {
+      if (config.PixelSnapBoxes) {
+        draw_list->AddRectFilled(snap_to_pixel(lgm.border_min), snap_to_pixel(lgm.border_max), col);
+      } else {
+        draw_list->AddRectFilled(lgm.border_min, lgm.border_max, col);
+      }
+    } else {
+      ShapeKey key = make_shape_key(draw_list, ShapeKind::Fill, lgm.border_max - lgm.border_min);
+      key.Radii[0] = lgm.tl;
+      key.Radii[1] = lgm.tr;
+      key.Radii[2] = lgm.br;
+      key.Radii[3] = lgm.bl;
+      key.Colors[0] = col;
+
+      draw_cached_shape(draw_list, key, lgm.border_min, [&](ImDrawList* dl) {
+        build_rounded_path(dl, ImVec2(0, 0), ImVec2(key.Width, key.Height), lgm.tl, lgm.tr, lgm.br, lgm.bl);
+        dl->PathFillConvex(col);
+      });
+    }
+  }
+
+  static constexpr float kEpsilon = 1e-6f;
+
+  static ImU32 to_im_col32(const litehtml::web_color& c) { return IM_COL32(c.red, c.green, c.blue, c.alpha); }
+
+  static litehtml::web_color sample_gradient_color(const std::vector<litehtml::background_layer::color_point>& points,
+                                                   float t) {
+    litehtml::web_color out{0, 0, 0, 0};
+
+    if (points.empty()) {
+      return out;
+    }
+
+    if (t <= points.front().offset) {
+      return points.front().color;
+    }
+
+    if (t >= points.back().offset) {
+      return points.back().color;
+    }
+
+    for (size_t i = 1; i < points.size(); ++i) {
+      const auto& a = points[i - 1];
+      const auto& b = points[i];
+
+      if (t >= a.offset && t <= b.offset) {
+        const float span = b.offset - a.offset;
+        const float u = (span > 0.0f) ? ((t - a.offset) / span) : 0.0f;
+
+        auto lerp_u8 = [u](unsigned char x, unsigned char y) -> unsigned char {
+          return (unsigned char)(x + (y - x) * u);
+        };
+
+        out.red = lerp_u8(a.color.red, b.color.red);
+        out.green = lerp_u8(a.color.green, b.color.green);
+        out.blue = lerp_u8(a.color.blue, b.color.blue);
+        out.alpha = lerp_u8(a.color.alpha, b.color.alpha);
+        return out;
+      }
+    }
+
+    return points.back().color;
+  }
+
+  static float cross2(const ImVec2& a, const ImVec2& b) { return a.x * b.y - a.y * b.x; }
+
+  static ImVec2 line_intersection(const ImVec2& p1, const ImVec2& p2, const ImVec2& q1, const ImVec2& q2) {
+    const ImVec2 r = p2 - p1;
+    const ImVec2 s = q2 - q1;
+    const float rxs = cross2(r, s);
+
+    if (fabsf(rxs) < kEpsilon) {
+      return p1;  // parallel fallback
+    }
+
+    const float t = cross2(q1 - p1, s) / rxs;
+    return p1 + r * t;
+  }
+
+  static bool is_inside_edge(const ImVec2& p, const ImVec2& a, const ImVec2& b) {
+    // For counter-clockwise clip polygon, inside is on the left side of edge AB.
+    return cross2(b - a, p - a) >= 0.0f;
+  }
+
+  static std::vector<ImVec2> clip_polygon_convex(const std::vector<ImVec2>& subject_polygon,
+                                                 const std::vector<ImVec2>& clip_polygon) {
+    std::vector<ImVec2> result = subject_polygon;
+
+    for (size_t edge_index = 0; edge_index < clip_polygon.size(); ++edge_index) {
+      const ImVec2& clip_edge_start = clip_polygon[edge_index];
+      const ImVec2& clip_edge_end = clip_polygon[(edge_index + 1) % clip_polygon.size()];
+
+      if (result.empty()) {
+        break;
+      }
+
+      std::vector<ImVec2> input = std::move(result);
+      result.clear();
+
+      ImVec2 previous_point = input.back();
+      bool previous_inside = is_inside_edge(previous_point, clip_edge_start, clip_edge_end);
+
+      for (const ImVec2& current_point : input) {
+        const bool current_inside = is_inside_edge(current_point, clip_edge_start, clip_edge_end);
+
+        if (current_inside) {
+          if (!previous_inside) {
+            result.push_back(line_intersection(previous_point, current_point, clip_edge_start, clip_edge_end));
+          }
+
+          result.push_back(current_point);
+
+        } else if (previous_inside) {
+          result.push_back(line_intersection(previous_point, current_point, clip_edge_start, clip_edge_end));
+        }
+
+        previous_point = current_point;
+        previous_inside = current_inside;
+      }
+    }
+
+    return result;
+  }
+
+  template <typename ColorFunc>
+  static void draw_convex_shaded_polygon(ImDrawList* draw_list, const std::vector<ImVec2>& poly,
+                                         ColorFunc&& color_for_point) {
+    if (poly.size() < 3) {
+      return;
+    }
+
+    const ImVec2 uv = draw_list->_Data->TexUvWhitePixel;
+    const ImDrawIdx base = draw_list->_VtxCurrentIdx;
+    const int vtx_count = (int)poly.size();
+    const int idx_count = (vtx_count - 2) * 3;
+
+    draw_list->PrimReserve(idx_count, vtx_count);
+
+    for (int i = 1; i < vtx_count - 1; ++i) {
+      draw_list->PrimWriteIdx(base + 0);
+      draw_list->PrimWriteIdx(base + i);
+      draw_list->PrimWriteIdx(base + i + 1);
+    }
+
+    for (const ImVec2& p : poly) {
+      draw_list->PrimWriteVtx(p, uv, color_for_point(p));
+    }
+  }
+
+  template <typename ColorFunc>
+  static void draw_clipped_shaded_polygon(ImDrawList* draw_list, const std::vector<ImVec2>& poly,
+                                          const std::vector<ImVec2>& clip_poly, ColorFunc&& color_for_point) {
+    std::vector<ImVec2> clipped = clip_polygon_convex(poly, clip_poly);
+    if (clipped.size() < 3) {
+      return;
+    }
+
+    draw_convex_shaded_polygon(draw_list, clipped, std::forward<ColorFunc>(color_for_point));
+  }
+
+  // Expects the texture to be pushed on the draw list by the caller.
+  template <typename UvFunc>
+  static void draw_convex_textured_polygon(ImDrawList* draw_list, const std::vector<ImVec2>& poly,
+                                           UvFunc&& uv_for_point) {
+    if (poly.size() < 3) {
+      return;
+    }
+
+    const ImDrawIdx base = draw_list->_VtxCurrentIdx;
+    const int vtx_count = (int)poly.size();
+    const int idx_count = (vtx_count - 2) * 3;
+
+    draw_list->PrimReserve(idx_count, vtx_count);
+
+    for (int i = 1; i < vtx_count - 1; ++i) {
+      draw_list->PrimWriteIdx(base + 0);
+      draw_list->PrimWriteIdx(base + i);
+      draw_list->PrimWriteIdx(base + i + 1);
+    }
+
+    for (const ImVec2& p : poly) {
+      draw_list->PrimWriteVtx(p, uv_for_point(p), IM_COL32_WHITE);
+    }
+  }
+
+  //
+  // Gradient ramp textures
+  //
+
+  static constexpr int kGradientRampWidth = 256;
+
+  static ImU64 hash_color_points(const std::vector<litehtml::background_layer::color_point>& points) {
+    ImU64 hash = hashBytes(nullptr, 0);
+    for (const auto& point : points) {
+      const unsigned char rgba[4] = {point.color.red, point.color.green, point.color.blue, point.color.alpha};
+      hash = hashBytes(&point.offset, sizeof(point.offset), hash);
+      hash = hashBytes(rgba, sizeof(rgba), hash);
+    }
+    return hash;
+  }
+
+  /**
+   * Returns the cached ramp texture for the given colour stops, creating it through Config::CreateGradientTexture on
+   * first use. Returns 0 when ramp textures are not available, in which case the mesh based gradients are used.
+   */
+  ImTextureID get_gradient_ramp(const std::vector<litehtml::background_layer::color_point>& points) {
+    if (!config.CreateGradientTexture || points.empty()) {
+      return 0;
+    }
+
+    const ImU64 hash = hash_color_points(points);
+    std::unique_lock<std::mutex> lock = lock_shared_caches();
+    if (auto it = gradientTextures().find(hash); it != gradientTextures().end()) {
+      it->second.LastUsedFrame = ImGui::GetFrameCount();
+      return it->second.Texture;
+    }
+    if (target().Band) {
+      // Textures are only created on the ImGui thread, the band uses the mesh gradient this once
+      target().PendingRamps.push_back(points);
+      return 0;
+    }
+
+    std::vector<unsigned char> rgba(kGradientRampWidth * 4);
+    for (int i = 0; i < kGradientRampWidth; ++i) {
+      const litehtml::web_color c = sample_gradient_color(points, (float)i / (float)(kGradientRampWidth - 1));
+      rgba[i * 4 + 0] = c.red;
+      rgba[i * 4 + 1] = c.green;
+      rgba[i * 4 + 2] = c.blue;
+      rgba[i * 4 + 3] = c.alpha;
+    }
+
+    if (gradientTextures().size() >= kMaxGradientRamps && config.DestroyTexture) {
+      evictGradientRamp(config);
+    }
+
+    ImTextureID texture = config.CreateGradientTexture(rgba.data(), kGradientRampWidth);
+    if (texture) {
+      gradientTextures()[hash] = GradientRamp{.Texture = texture, .LastUsedFrame = ImGui::GetFrameCount()};
+    }
+    return texture;
+  }
+
+  // Maps a gradient position t in [0, 1] to the texel centres of the ramp.
+  static ImVec2 gradient_ramp_uv(float t) {
+    t = ImClamp(t, 0.0f, 1.0f);
+    return ImVec2((0.5f + t * (float)(kGradientRampWidth - 1)) / (float)kGradientRampWidth, 0.5f);
+  }
+
+  static void append_point_if_distinct(std::vector<ImVec2>& pts, const ImVec2& p, float eps = 0.01f) {
+    if (pts.empty()) {
+      pts.push_back(p);
+      return;
+    }
+
+    const ImVec2& last = pts.back();
+    if (fabsf(last.x - p.x) > eps || fabsf(last.y - p.y) > eps) {
+      pts.push_back(p);
+    }
+  }
+
+  //
+  // Unit circle tables
+  //
+
+  template <int N>
+  static const ImVec2* unit_circle() {
+    static const std::array<ImVec2, N> table = [] {
+      std::array<ImVec2, N> points;
+      for (int i = 0; i < N; ++i) {
+        const double a = (double)i / (double)N * 2.0 * 3.14159265358979323846;
+        points[i] = ImVec2((float)cos(a), (float)sin(a));
+      }
+      return points;
+    }();
+    return table.data();
+  }
+
+  /**
+   * Returns `segments` points (cos, sin) evenly spaced around the unit circle, starting at angle 0. Tables exist for the
+   * counts the container uses: 8 and 12 segment corners (32, 48), radial ellipses (64) and conic wedges (128).
+   *
+   * @return The table or nullptr if there is none for this count
+   */
+  static const ImVec2* unit_circle_table(int segments) {
+    switch (segments) {
+      case 32:
+        return unit_circle<32>();
+      case 48:
+        return unit_circle<48>();
+      case 64:
+        return unit_circle<64>();
+      case 128:
+        return unit_circle<128>();
+      default:
+        return nullptr;
+    }
+  }
+
+  /**
+   * Point i of a quarter arc with `segments` steps, starting at quadrant * 90 degrees.
+   */
+  static ImVec2 quarter_arc_unit(int quadrant, int i, int segments) {
+    if (const ImVec2* table = unit_circle_table(segments * 4)) {
+      return table[(((quadrant % 4) + 4) % 4 * segments + i) % (segments * 4)];
+    }
+
+    const float a = (IM_PI * 0.5f) * ((float)quadrant + (float)i / (float)segments);
+    return ImVec2(cosf(a), sinf(a));
+  }
+
+  static void append_arc_points(std::vector<ImVec2>& pts, const ImVec2& center, float radius, float a_min, float a_max,
+                                int segments, bool skip_first) {
+    if (radius <= 0.0f || segments <= 0) {
+      return;
+    }
+
+    // Quarter arcs starting on a multiple of 90 degrees come from the unit circle tables.
+    const float quadrant = a_min / (IM_PI * 0.5f);
+    if (fabsf(quadrant - roundf(quadrant)) < 1e-4f && fabsf(a_max - a_min - IM_PI * 0.5f) < 1e-4f) {
+      for (int i = skip_first ? 1 : 0; i <= segments; ++i) {
+        append_point_if_distinct(pts, center + quarter_arc_unit((int)roundf(quadrant), i, segments) * radius);
+      }
+      return;
+    }
+
+    for (int i = skip_first ? 1 : 0; i <= segments; ++i) {
+      const float t = (float)i / (float)segments;
+      const float a = a_min + (a_max - a_min) * t;
+      append_point_if_distinct(pts, ImVec2(center.x + cosf(a) * radius, center.y + sinf(a) * radius));
+    }
+  }
+
+  static std::vector<ImVec2> build_rect_polygon(const ImVec2& p_min, const ImVec2& p_max) {
+    return {
+        ImVec2(p_min.x, p_min.y),
+        ImVec2(p_max.x, p_min.y),
+        ImVec2(p_max.x, p_max.y),
+        ImVec2(p_min.x, p_max.y),
+    };
+  }
+
+  static std::vector<ImVec2> build_rounded_rect_polygon(const ImVec2& p_min, const ImVec2& p_max, float tl, float tr,
+                                                        float br, float bl, int arc_segments = 8) {
+    std::vector<ImVec2> pts;
+    pts.reserve(4 * (arc_segments + 1));
+
+    const float w = p_max.x - p_min.x;
+    const float h = p_max.y - p_min.y;
+    const float max_r = ImMin(w * 0.5f, h * 0.5f);
+
+    tl = ImClamp(tl, 0.0f, max_r);
+    tr = ImClamp(tr, 0.0f, max_r);
+    br = ImClamp(br, 0.0f, max_r);
+    bl = ImClamp(bl, 0.0f, max_r);
+
+    append_point_if_distinct(pts, ImVec2(p_min.x + tl, p_min.y));
+    append_point_if_distinct(pts, ImVec2(p_max.x - tr, p_min.y));
+
+    if (tr > 0.0f) {
+      append_arc_points(pts, ImVec2(p_max.x - tr, p_min.y + tr), tr, -IM_PI * 0.5f, 0.0f, arc_segments, true);
+    }
+
+    append_point_if_distinct(pts, ImVec2(p_max.x, p_max.y - br));
+
+    if (br > 0.0f) {
+      append_arc_points(pts, ImVec2(p_max.x - br, p_max.y - br), br, 0.0f, IM_PI * 0.5f, arc_segments, true);
+    }
+
+    append_point_if_distinct(pts, ImVec2(p_min.x + bl, p_max.y));
+
+    if (bl > 0.0f) {
+      append_arc_points(pts, ImVec2(p_min.x + bl, p_max.y - bl), bl, IM_PI * 0.5f, IM_PI, arc_segments, true);
+    }
+
+    append_point_if_distinct(pts, ImVec2(p_min.x, p_min.y + tl));
+
+    if (tl > 0.0f) {
+      append_arc_points(pts, ImVec2(p_min.x + tl, p_min.y + tl), tl, IM_PI, IM_PI * 1.5f, arc_segments, true);
+    }
+
+    return pts;
+  }
+
+  static bool has_rounded_corners(const LayerGeometry& lgm) {
+    return lgm.tl > 0.0f || lgm.tr > 0.0f || lgm.br > 0.0f || lgm.bl > 0.0f;
+  }
+
+  static std::vector<ImVec2> build_layer_fill_polygon(const LayerGeometry& lgm, int arc_segments = 12) {
+    if (has_rounded_corners(lgm)) {
+      return build_rounded_rect_polygon(lgm.border_min, lgm.border_max, lgm.tl, lgm.tr, lgm.br, lgm.bl, arc_segments);
+    }
+
+    return build_rect_polygon(lgm.border_min, lgm.border_max);
+  }
+
+  static std::vector<ImVec2> build_ellipse_polygon(const ImVec2& center, float rx, float ry, float t, int segments) {
+    std::vector<ImVec2> pts;
+    pts.reserve(segments);
+
+    const float ex = rx * t;
+    const float ey = ry * t;
+
+    if (const ImVec2* unit = unit_circle_table(segments)) {
+      for (int i = 0; i < segments; ++i) {
+        pts.push_back(ImVec2(center.x + unit[i].x * ex, center.y + unit[i].y * ey));
+      }
+      return pts;
+    }
+
+    for (int i = 0; i < segments; ++i) {
+      const float a = ((float)i / (float)segments) * IM_PI * 2.0f;
+      pts.push_back(ImVec2(center.x + cosf(a) * ex, center.y + sinf(a) * ey));
+    }
+
+    return pts;
+  }
+
+  static ImVec2 conic_point_on_circle(const ImVec2& center, float radius, float angle_deg) {
+    const float a = angle_deg * IM_PI / 180.0f;
+
+    // 0 degrees at top, clockwise positive
+    const float x = sinf(a);
+    const float y = -cosf(a);
+
+    return ImVec2(center.x + x * radius, center.y + y * radius);
+  }
+
+  void draw_linear_gradient_impl(const LayerGeometry& lgm, const litehtml::background_layer::linear_gradient& gradient,
+                                 ImTextureID ramp) {
+    ImDrawList* draw_list = target().DrawList;
+
+    const ImVec2 screen_pos = target().Origin;
+    const ImVec2 start = screen_pos + ImVec2(gradient.start.x, gradient.start.y);
+    const ImVec2 end = screen_pos + ImVec2(gradient.end.x, gradient.end.y);
+
+    const ImVec2 axis = end - start;
+    const float axis_len_sq = axis.x * axis.x + axis.y * axis.y;
+    if (axis_len_sq <= 0.0001f) {
+      return;
+    }
+
+    const float axis_len = sqrtf(axis_len_sq);
+    const ImVec2 dir(axis.x / axis_len, axis.y / axis_len);
+    const ImVec2 normal(-dir.y, dir.x);
+
+    const float w = lgm.border_max.x - lgm.border_min.x;
+    const float h = lgm.border_max.y - lgm.border_min.y;
+    const float extent = sqrtf(w * w + h * h) + 2.0f;
+    const float approx_span = ImMax(w, h);
+
+    const int strips = (int)ImClamp(axis_len / 2.0f + approx_span / 4.0f, 16.0f, 128.0f);
+    const std::vector<ImVec2> fill_poly = build_layer_fill_polygon(lgm, 8);
+
+    if (ramp) {
+      // t is linear in screen space, so a single band from start to end with per-vertex UVs is exact.
+      const std::vector<ImVec2> band = {
+          start - normal * extent,
+          start + normal * extent,
+          end + normal * extent,
+          end - normal * extent,
+      };
+
+      std::vector<ImVec2> clipped = clip_polygon_convex(band, fill_poly);
+      draw_list->PushTexture(ramp);
+      draw_convex_textured_polygon(draw_list, clipped, [&](const ImVec2& p) -> ImVec2 {
+        return gradient_ramp_uv(((p.x - start.x) * axis.x + (p.y - start.y) * axis.y) / axis_len_sq);
+      });
+      draw_list->PopTexture();
+      return;
+    }
+
+    auto color_for_point = [&](const ImVec2& p) -> ImU32 {
+      float t = ((p.x - start.x) * axis.x + (p.y - start.y) * axis.y) / axis_len_sq;
+      t = ImClamp(t, 0.0f, 1.0f);
+      return to_im_col32(sample_gradient_color(gradient.color_points, t));
+    };
+
+    for (int i = 0; i < strips; ++i) {
+      const float t0 = (float)i / (float)strips;
+      const float t1 = (float)(i + 1) / (float)strips;
+
+      const ImVec2 p0 = start + dir * (t0 * axis_len);
+      const ImVec2 p1 = start + dir * (t1 * axis_len);
+
+      const std::vector<ImVec2> strip_quad = {
+          p0 - normal * extent,
+          p0 + normal * extent,
+          p1 + normal * extent,
+          p1 - normal * extent,
+      };
+
+      draw_clipped_shaded_polygon(draw_list, strip_quad, fill_poly, color_for_point);
+    }
+  }
+
+  void draw_radial_gradient_impl(const LayerGeometry& lgm, const litehtml::background_layer::radial_gradient& gradient,
+                                 ImTextureID ramp) {
+    ImDrawList* draw_list = target().DrawList;
+
+    const ImVec2 screen_pos = target().Origin;
+    const ImVec2 center = screen_pos + ImVec2(gradient.position.x, gradient.position.y);
+
+    const float rx = gradient.radius.x;
+    const float ry = gradient.radius.y;
+
+    if (rx <= 0.0001f || ry <= 0.0001f || gradient.color_points.empty()) {
+      return;
+    }
+
+    const std::vector<ImVec2> fill_poly = build_layer_fill_polygon(lgm, 12);
+
+    // Draw from outside to inside so smaller inner ellipses overwrite larger ones.
+    const int ring_count = 64;
+    const int ellipse_segments = 64;
+
+    if (ramp) {
+      // t grows linearly along every ray from the center, so a triangle fan with t=0 at the center and t=1 on the
+      // ellipse replaces all rings.
+      const std::vector<ImVec2> ellipse = build_ellipse_polygon(center, rx, ry, 1.0f, ellipse_segments);
+      auto uv_for_point = [&](const ImVec2& p) -> ImVec2 {
+        const float dx = (p.x - center.x) / rx;
+        const float dy = (p.y - center.y) / ry;
+        return gradient_ramp_uv(sqrtf(dx * dx + dy * dy));
+      };
+
+      draw_list->PushTexture(ramp);
+      for (int i = 0; i < ellipse_segments; ++i) {
+        const std::vector<ImVec2> wedge = {center, ellipse[i], ellipse[(i + 1) % ellipse_segments]};
+        std::vector<ImVec2> clipped = clip_polygon_convex(wedge, fill_poly);
+        draw_convex_textured_polygon(draw_list, clipped, uv_for_point);
+      }
+      draw_list->PopTexture();
+      return;
+    }
+
+    for (int i = ring_count; i >= 1; --i) {
+      const float t = (float)i / (float)ring_count;
+      const std::vector<ImVec2> ellipse = build_ellipse_polygon(center, rx, ry, t, ellipse_segments);
+
+      std::vector<ImVec2> clipped = clip_polygon_convex(ellipse, fill_poly);
+      if (clipped.size() < 3) {
+        continue;
+      }
+
+      const ImU32 col = to_im_col32(sample_gradient_color(gradient.color_points, t));
+      draw_convex_shaded_polygon(draw_list, clipped, [&](const ImVec2&) -> ImU32 { return col; });
+    }
+
+    // Fill the center with t=0 color.
+    {
+      const std::vector<ImVec2> center_poly =
+          build_ellipse_polygon(center, rx, ry, 1.0f / (float)ring_count, ellipse_segments);
+
+      std::vector<ImVec2> clipped = clip_polygon_convex(center_poly, fill_poly);
+      if (clipped.size() >= 3) {
+        const ImU32 col = to_im_col32(sample_gradient_color(gradient.color_points, 0.0f));
+        draw_convex_shaded_polygon(draw_list, clipped, [&](const ImVec2&) -> ImU32 { return col; });
+      }
+    }
+  }
+
+  void draw_conic_gradient_impl(const LayerGeometry& lgm, const litehtml::background_layer::conic_gradient& gradient) {
+    ImDrawList* draw_list = target().DrawList;
+
+    const ImVec2 screen_pos = target().Origin;
+    const ImVec2 center = screen_pos + ImVec2(gradient.position.x, gradient.position.y);
+
+    const float radius = gradient.radius;
+    if (radius <= 0.0001f || gradient.color_points.empty()) {
+      return;
+    }
+
+    const std::vector<ImVec2> fill_poly = build_layer_fill_polygon(lgm, 12);
+
+    const int wedge_count = 128;
+
+    // Rotating the unit circle table by the start angle leaves one sin/cos pair per gradient.
+    const ImVec2* unit = unit_circle_table(wedge_count);
+    const float start = gradient.angle * IM_PI / 180.0f;
+    const float start_sin = sinf(start);
+    const float start_cos = cosf(start);
+
+    auto rim_point = [&](int i) -> ImVec2 {
+      if (!unit) {
+        return conic_point_on_circle(center, radius, gradient.angle + (float)i / (float)wedge_count * 360.0f);
+      }
+
+      // 0 degrees at top, clockwise positive
+      const ImVec2& u = unit[i % wedge_count];
+      return ImVec2(center.x + (start_sin * u.x + start_cos * u.y) * radius,
+                    center.y + (start_sin * u.y - start_cos * u.x) * radius);
+    };
+
+    ImVec2 rim_start = rim_point(0);
+
+    for (int i = 0; i < wedge_count; ++i) {
+      const float t0 = (float)i / (float)wedge_count;
+      const ImVec2 rim_end = rim_point(i + 1);
+
+      const std::vector<ImVec2> wedge = {center, rim_start, rim_end};
+      rim_start = rim_end;
+
+      std::vector<ImVec2> clipped = clip_polygon_convex(wedge, fill_poly);
+      if (clipped.size() < 3) {
+        continue;
+      }
+
+      const ImU32 col = to_im_col32(sample_gradient_color(gradient.color_points, t0));
+
+      draw_convex_shaded_polygon(draw_list, clipped, [&](const ImVec2&) -> ImU32 { return col; });
+    }
+  }
+
+  template <typename DrawFn>
+  void draw_gradient_common(const litehtml::background_layer& layer, ImTextureID texture, DrawFn&& draw_fn) {
+    LayerGeometry lgm = this->get_layer_geometry(layer);
+    ImDrawList* draw_list = target().DrawList;
+
+    use_clip(
+        draw_list, texture, lgm.clip_min, lgm.clip_max, lgm.border_min - ImVec2(1, 1), lgm.border_max + ImVec2(1, 1));
+    draw_fn(lgm);
+  }
+
+  virtual void draw_linear_gradient(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
+                                    const litehtml::background_layer::linear_gradient& gradient) override {
+    const ImVec2 axis = ImVec2(gradient.end.x, gradient.end.y) - ImVec2(gradient.start.x, gradient.start.y);
+    const float axis_len_sq = axis.x * axis.x + axis.y * axis.y;
+
+    if (axis_len_sq <= 0.0001f) {
+      if (!gradient.color_points.empty()) {
+        draw_solid_fill(hdc, layer, gradient.color_points.back().color);
+      }
+      return;
+    }
+
+    if (gradient.color_points.empty() || !has_visible_box(layer)) {
+      return;
+    }
+
+    DisplayList& list = displayList;
+    list.LinearGradients.push_back(DisplayList::LinearGradient{.Layer = layer, .Gradient = gradient});
+    add_layer_op(DisplayList::OpKind::LinearGradient, list.LinearGradients.size() - 1, layer);
+  }
+
+  virtual void draw_radial_gradient(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
+                                    const litehtml::background_layer::radial_gradient& gradient) override {
+    if (gradient.color_points.empty() || !has_visible_box(layer)) {
+      return;
+    }
+
+    DisplayList& list = displayList;
+    list.RadialGradients.push_back(DisplayList::RadialGradient{.Layer = layer, .Gradient = gradient});
+    add_layer_op(DisplayList::OpKind::RadialGradient, list.RadialGradients.size() - 1, layer);
+  }
+
+  virtual void draw_conic_gradient(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
+                                   const litehtml::background_layer::conic_gradient& gradient) override {
+    if (gradient.color_points.empty() || !has_visible_box(layer)) {
+      return;
+    }
+
+    DisplayList& list = displayList;
+    list.ConicGradients.push_back(DisplayList::ConicGradient{.Layer = layer, .Gradient = gradient});
+    add_layer_op(DisplayList::OpKind::ConicGradient, list.ConicGradients.size() - 1, layer);
+  }
+
+  void emit_linear_gradient(const DisplayList::LinearGradient& fill) {
+    const ImTextureID ramp = get_gradient_ramp(fill.Gradient.color_points);
+    draw_gradient_common(
+        fill.Layer, ramp, [&](const LayerGeometry& lgm) { draw_linear_gradient_impl(lgm, fill.Gradient, ramp); });
+  }
+
+  void emit_radial_gradient(const DisplayList::RadialGradient& fill) {
+    const ImTextureID ramp = get_gradient_ramp(fill.Gradient.color_points);
+    draw_gradient_common(
+        fill.Layer, ramp, [&](const LayerGeometry& lgm) { draw_radial_gradient_impl(lgm, fill.Gradient, ramp); });
+  }
+
+  void emit_conic_gradient(const DisplayList::ConicGradient& fill) {
+    draw_gradient_common(
+        fill.Layer, 0, [&](const LayerGeometry& lgm) { draw_conic_gradient_impl(lgm, fill.Gradient); });
+  }
+
+  virtual void on_mouse_event(const litehtml::element::ptr& el, litehtml::mouse_event event) override {
+    // TODO
+  }
+
+  virtual void draw_borders(litehtml::uint_ptr hdc, const litehtml::borders& borders,
+                            const litehtml::position& draw_pos, bool root) override {
+    DisplayList& list = displayList;
+    list.Borders.push_back(DisplayList::Border{.Borders = borders, .DrawPos = draw_pos, .Root = root});
+    list.add(DisplayList::OpKind::Borders,
+             list.Borders.size() - 1,
+             draw_pos.y - 1.0f,
+             draw_pos.y + draw_pos.height + 1.0f);
+    list.extend(ImVec2(draw_pos.x + draw_pos.width, draw_pos.y + draw_pos.height));
+  }
+
+  void emit_borders(const litehtml::borders& borders, const litehtml::position& draw_pos) {
+    ImVec2 base_pos = target().Origin;
+    ImVec2 top_left = base_pos + ImVec2(draw_pos.x, draw_pos.y);
+    ImVec2 bottom_right = base_pos + ImVec2(draw_pos.x + draw_pos.width, draw_pos.y + draw_pos.height);
+
+    auto* draw_list = target().DrawList;
+    use_no_clip(draw_list, 0, top_left - ImVec2(1, 1), bottom_right + ImVec2(1, 1));
+
+    const float radii[4] = {(float)borders.radius.top_left_x,
+                            (float)borders.radius.top_right_x,
+                            (float)borders.radius.bottom_right_x,
+                            (float)borders.radius.bottom_left_x};
+
+    // Check if all sides and colors are equal
+    if (borders.top.width == borders.right.width && borders.top.width == borders.bottom.width &&
+        borders.top.width == borders.left.width && borders.top.color == borders.right.color &&
+        borders.top.color == borders.bottom.color && borders.top.color == borders.left.color) {
+      float w = borders.top.width;
+      if (w > 0) {
+        // ImGui path strokes are centered. We must offset the path inward by half the width
+        // to conform to the CSS Box Model (borders grow inwards from the bounding box).
+        float half_w = w * 0.5f;
+        ImVec2 p_min = top_left + ImVec2(half_w, half_w);
+        ImVec2 p_max = bottom_right - ImVec2(half_w, half_w);
+
+        // We also must reduce the border radius by half the width so the outer edge matches CSS.
+        float tl = std::max(0.0f, radii[0] - half_w);
+        float tr = std::max(0.0f, radii[1] - half_w);
+        float br = std::max(0.0f, radii[2] - half_w);
+        float bl = std::max(0.0f, radii[3] - half_w);
+
+        ImU32 color = to_im_col32(borders.top.color);
+
+        if (tl == 0.0f && tr == 0.0f && br == 0.0f && bl == 0.0f) {
+          if (config.PixelSnapBoxes && is_whole_pixel(w)) {
+            const float widths[4] = {w, w, w, w};
+            const ImU32 colors[4] = {color, color, color, color};
+            draw_snapped_borders(draw_list, top_left, bottom_right, widths, colors);
+          } else {
+            draw_list->AddRect(p_min, p_max, color, 0.0f, 0, w);
+          }
+        } else {
+          ShapeKey key = make_shape_key(draw_list, ShapeKind::Border, bottom_right - top_left);
+          std::copy(radii, radii + 4, key.Radii);
+          std::fill(key.Widths, key.Widths + 4, w);
+          std::fill(key.Colors, key.Colors + 4, color);
+
+          draw_cached_shape(draw_list, key, top_left, [&](ImDrawList* dl) {
+            const ImVec2 size = p_max - p_min;
+            if (tl == tr && tr == br && br == bl) {
+              dl->AddRect(ImVec2(half_w, half_w), ImVec2(half_w, half_w) + size, color, tl, 0, w);
+            } else {
+              build_rounded_path(dl, ImVec2(half_w, half_w), ImVec2(half_w, half_w) + size, tl, tr, br, bl);
+              dl->PathStroke(color, ImDrawFlags_Closed, w);
+            }
+          });
+        }
+      }
+    } else {
+      // The Non-Uniform Path (Mitered Borders, rounded corners included)
+      ShapeKey key = make_shape_key(draw_list, ShapeKind::Border, bottom_right - top_left);
+      std::copy(radii, radii + 4, key.Radii);
+      key.Widths[0] = borders.top.width;
+      key.Widths[1] = borders.right.width;
+      key.Widths[2] = borders.bottom.width;
+      key.Widths[3] = borders.left.width;
+      key.Colors[0] = to_im_col32(borders.top.color);
+      key.Colors[1] = to_im_col32(borders.right.color);
+      key.Colors[2] = to_im_col32(borders.bottom.color);
+      key.Colors[3] = to_im_col32(borders.left.color);
+
+      const bool rounded = radii[0] > 0.0f || radii[1] > 0.0f || radii[2] > 0.0f || radii[3] > 0.0f;
+      if (config.PixelSnapBoxes && !rounded && is_whole_pixel(key.Widths[0]) && is_whole_pixel(key.Widths[1]) &&
+          is_whole_pixel(key.Widths[2]) && is_whole_pixel(key.Widths[3])) {
+        draw_snapped_borders(draw_list, top_left, bottom_right, key.Widths, key.Colors);
+      } else {
+        draw_cached_shape(draw_list, key, top_left, [&](ImDrawList* dl) {
+          build_border_ring(dl, ImVec2(key.Width, key.Height), key.Radii, key.Widths, key.Colors);
+        });
+      }
+    }
+  }
+  //
+  // Document related functions
+  //
+
+  virtual void set_caption(const char* caption) override { title = caption; }
+  virtual void set_base_url(const char* base_url) override {}
+  virtual void link(const std::shared_ptr<litehtml::document>& doc, const litehtml::element::ptr& el) override {}
+  virtual void on_anchor_click(const char* url, const litehtml::element::ptr& el) override {
+    history.push_back(currentUrl);
+    loadUrl = url;
+  }
+  virtual void set_cursor(const char* cursor) override {
+    if (std::string(cursor) == "pointer" && ImGui::IsWindowHovered()) {
+      ImGui::SetMouseCursor(ImGuiMouseCursor_Hand);
+    }
+  }
+  virtual void transform_text(std::string& text, litehtml::text_transform tt) override {}
+  // Recorded in importedStyles for a stylesheet the document was parsed without because it had not arrived yet
+  static constexpr ImU64 kPendingStyle = 0;
+
+  virtual void import_css(std::string& text, const std::string& url, std::string& baseurl) override {
+    if (!config.LoadCSS && !config.LoadCSSAsync) {
+      return;
+    }
+
+    // With a synchronous loader a prefetch still in flight is waited for, parsing twice would cost more
+    const std::string key = resourceKey(url.c_str(), baseurl.c_str());
+    if (offThread) {
+      import_css_off_thread(text, key, url, baseurl);
+      return;
+    }
+
+    const StyleSheet& requested = requestStyleSheet(config, url, baseurl, false);
+    if (config.LoadCSSAsync && !isStyleSheetReady(requested)) {
+      // Parsed without it for now, the document is created again once all its stylesheets arrived
+      importedStyles[key] = kPendingStyle;
+      return;
+    }
+
+    const StyleSheet& sheet = loadStyleSheet(config, url, baseurl);
+    importedStyles[key] = sheet.Hash;
+    text = sheet.Text;
+  }
+
+  /**
+   * import_css on a worker: uses the copy of the cached stylesheet, otherwise loads it right here. A worker can afford
+   * to wait for LoadCSSAsync, so the document never has to be parsed again for a stylesheet that was pending. Copies
+   * are only taken of finished loads, so this never waits for another queued pool job.
+   */
+  void import_css_off_thread(std::string& text, const std::string& key, const std::string& url,
+                             const std::string& baseurl) {
+    auto [it, inserted] = offThread->Styles.try_emplace(key);
+    StyleSheet& sheet = it->second;
+    if (inserted) {
+      sheet.Url = url;
+      sheet.BaseUrl = baseurl;
+      sheet.Load = config.LoadCSSAsync ? config.LoadCSSAsync(url.c_str(), baseurl.c_str())
+                                       : std::shared_future<std::string>();
+      if (!sheet.Load.valid()) {
+        sheet.Text = config.LoadCSS ? config.LoadCSS(url.c_str(), baseurl.c_str()) : std::string();
+        sheet.Hash = hashBytes(sheet.Text.data(), sheet.Text.size());
+        sheet.Loaded = true;
+      }
+      offThread->LoadedStyles.push_back(key);
+    }
+
+    if (sheet.Load.valid()) {
+      // Copied while in flight (e.g. a prefetch) or started above
+      sheet.Text = sheet.Load.get();
+      sheet.Load = {};
+      sheet.Hash = hashBytes(sheet.Text.data(), sheet.Text.size());
+      sheet.Loaded = true;
+    }
+
+    importedStyles[key] = sheet.Hash;
+    text = sheet.Text;
+  }
+
+  /**
+   * Forgets everything remembered about the current document, before a new one is created.
+   */
+  void reset_document() {
+    lazyImages.clear();
+    importedStyles.clear();
+    invalidate_display_list();
+  }
+
+  const std::unordered_map<std::string, ImU64>& get_imported_styles() const { return importedStyles; }
+
+  bool styles_pending() const {
+    for (const auto& [key, hash] : importedStyles) {
+      if (hash == kPendingStyle) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  /**
+   * Whether the document has to be created again because a stylesheet it imported changed or arrived. Reloads
+   * invalidated stylesheets and waits until every stylesheet is ready, so the styles are applied in one go.
+   */
+  bool imported_styles_changed() {
+    bool changed = false;
+    bool waiting = false;
+
+    for (const auto& [key, hash] : importedStyles) {
+      auto it = styleSheets().find(key);
+      if (it == styleSheets().end()) {
+        changed = true;
+        continue;
+      }
+
+      StyleSheet& sheet = it->second;
+      if (sheet.Stale) {
+        requestStyleSheet(config, sheet.Url, sheet.BaseUrl, false);
+      }
+      if (!isStyleSheetReady(sheet)) {
+        waiting = true;
+        continue;
+      }
+      if (sheet.Stale || sheet.Load.valid()) {
+        loadStyleSheet(config, sheet.Url, sheet.BaseUrl);
+      }
+      changed |= sheet.Hash != hash;
+    }
+
+    return changed && !waiting;
+  }
+
+  //
+  // Display list
+  //
+
+  // Drops the recorded ops, the next draw records them again. Keeps the extent until then.
+  void invalidate_display_list() { displayList.Doc = nullptr; }
+
+  bool display_list_current(const litehtml::document* doc, const litehtml::position& clip) const {
+    const litehtml::position& recorded = displayList.Clip;
+    return displayList.Doc == doc && recorded.x == clip.x && recorded.y == clip.y && recorded.width == clip.width &&
+           recorded.height == clip.height;
+  }
+
+  /**
+   * Runs litehtml's draw traversal of the laid out document, which records its draw calls into the display list
+   * instead of drawing them.
+   */
+  void record_display_list(litehtml::document& doc, const litehtml::position& clip) {
+    const auto start = std::chrono::high_resolution_clock::now();
+
+    displayList.clear();
+    doc.draw(0, 0, 0, &clip);
+    displayList.finish();
+    displayList.Doc = &doc;
+    displayList.Clip = clip;
+
+    displayList.RecordTime =
+        std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+  }
+
+  const DisplayList& get_display_list() const { return displayList; }
+  int emitted_ops() const { return mainTarget.EmittedOps; }
+
+  void record_custom_element(const std::string& tag, const litehtml::position& pos,
+                             const std::map<std::string, std::string>& attributes) {
+    DisplayList& list = displayList;
+    list.Customs.push_back(DisplayList::Custom{.Tag = tag, .Pos = pos, .Attributes = attributes});
+    // Never culled: the element's ImGui calls may have to run while it is scrolled out of view
+    list.add(DisplayList::OpKind::CustomElement, list.Customs.size() - 1, -FLT_MAX, FLT_MAX);
+    list.extend(ImVec2(pos.x + pos.width, pos.y + pos.height));
+  }
+
+  void emit_custom_element(const DisplayList::Custom& custom) {
+    auto draw = customElements().find(custom.Tag);
+    if (draw == customElements().end()) {
+      return;
+    }
+
+    // Custom elements draw with plain ImGui calls, which must not inherit the container's clip rect or channels.
+    yield_draw_list(target().DrawList);
+
+    const ImVec2 cursor = ImGui::GetCursorScreenPos();
+    const ImVec2 min = target().Origin + ImVec2(custom.Pos.x, custom.Pos.y);
+    draw->second(ImRect(min, min + ImVec2(custom.Pos.width, custom.Pos.height)), custom.Attributes);
+    ImGui::SetCursorScreenPos(cursor);
+  }
+
+  /**
+   * Emits the ops of the display list that reach into the clip rect of the draw target. Images within LazyLoadMargin
+   * are emitted too, so lazy images start loading before they scroll into view.
+   */
+  void emit_display_list() {
+    DrawTarget& t = target();
+    const DisplayList& list = displayList;
+    const float top = t.BaseClip.y - t.Origin.y;
+    const float bottom = t.BaseClip.w - t.Origin.y;
+    const float margin = useAsyncImages(config) ? config.LazyLoadMargin : 0.0f;
+
+    list.query(top - margin, bottom + margin, t.Ops);
+    for (unsigned int op : t.Ops) {
+      const DisplayList::OpKind kind = list.Kinds[op];
+      if (kind != DisplayList::OpKind::Image && (list.Bottoms[op] < top || list.Tops[op] >= bottom)) {
+        continue;
+      }
+
+      const unsigned int arg = list.Args[op];
+      switch (kind) {
+        case DisplayList::OpKind::Text:
+          emit_text(list.Texts[arg]);
+          break;
+        case DisplayList::OpKind::ListMarker:
+          emit_list_marker(list.Markers[arg].Marker);
+          break;
+        case DisplayList::OpKind::Image:
+          emit_image(list.Images[arg].Layer, list.Images[arg].Url, list.Images[arg].BaseUrl);
+          break;
+        case DisplayList::OpKind::SolidFill:
+          emit_solid_fill(list.Fills[arg].Layer, list.Fills[arg].Color);
+          break;
+        case DisplayList::OpKind::LinearGradient:
+          emit_linear_gradient(list.LinearGradients[arg]);
+          break;
+        case DisplayList::OpKind::RadialGradient:
+          emit_radial_gradient(list.RadialGradients[arg]);
+          break;
+        case DisplayList::OpKind::ConicGradient:
+          emit_conic_gradient(list.ConicGradients[arg]);
+          break;
+        case DisplayList::OpKind::Borders:
+          emit_borders(list.Borders[arg].Borders, list.Borders[arg].DrawPos);
+          break;
+        case DisplayList::OpKind::CustomElement:
+          emit_custom_element(list.Customs[arg]);
+          break;
+      }
+      t.EmittedOps++;
+    }
+  }
+
+  //
+  // Display list captures
+  //
+
+  bool has_display_list() const { return displayList.Doc != nullptr; }
+
+  /**
+   * Writes the display list with the visible area of the last draw. Font handles are written as indices into a table
+   * of the family, style and size of each font.
+   */
+  void capture_display_list(CaptureWriter& out) const {
+    const DisplayList& list = displayList;
+
+    std::vector<const ResolvedFont*> fonts;
+    std::unordered_map<litehtml::uint_ptr, unsigned int> font_indices;
+    auto font_index = [&](litehtml::uint_ptr handle) -> unsigned int {
+      if (!handle) {
+        return UINT_MAX;
+      }
+      auto [it, inserted] = font_indices.try_emplace(handle, (unsigned int)fonts.size());
+      if (inserted) {
+        fonts.push_back(from_handle(handle));
+      }
+      return it->second;
+    };
+    for (const DisplayList::TextRun& run : list.Texts) {
+      font_index(run.Font);
+    }
+    for (const DisplayList::ListMarker& marker : list.Markers) {
+      font_index(marker.Marker.font);
+    }
+
+    out.Bytes.append(kCaptureMagic, sizeof(kCaptureMagic));
+    out.u32(kCaptureVersion);
+
+    const DrawTarget& t = mainTarget;
+    out.point(ImVec2(t.BaseClip.x, t.BaseClip.y) - t.Origin);
+    out.point(ImVec2(t.BaseClip.z, t.BaseClip.w) - t.Origin);
+    out.position(list.Clip);
+
+    out.u32((unsigned int)fonts.size());
+    for (const ResolvedFont* rf : fonts) {
+      out.str(rf->Family);
+      out.u32((unsigned int)rf->Style);
+      out.f32(rf->Size);
+    }
+
+    out.u32((unsigned int)list.size());
+    for (int op = 0; op < list.size(); ++op) {
+      const unsigned int arg = list.Args[op];
+      out.raw((unsigned char)list.Kinds[op]);
+
+      switch (list.Kinds[op]) {
+        case DisplayList::OpKind::Text: {
+          const DisplayList::TextRun& run = list.Texts[arg];
+          out.u32(font_index(run.Font));
+          out.color(run.Color);
+          out.position(run.Pos);
+          out.str(list.Chars.substr(run.Offset, run.Length));
+          break;
+        }
+        case DisplayList::OpKind::ListMarker: {
+          const DisplayList::ListMarker& marker = list.Markers[arg];
+          out.str(marker.Marker.image);
+          out.str(marker.BaseUrl);
+          out.u32((unsigned int)marker.Marker.marker_type);
+          out.color(marker.Marker.color);
+          out.position(marker.Marker.pos);
+          out.u32((unsigned int)marker.Marker.index);
+          out.u32(font_index(marker.Marker.font));
+          break;
+        }
+        case DisplayList::OpKind::Image:
+          out.layer(list.Images[arg].Layer);
+          out.str(list.Images[arg].Url);
+          out.str(list.Images[arg].BaseUrl);
+          break;
+        case DisplayList::OpKind::SolidFill:
+          out.layer(list.Fills[arg].Layer);
+          out.color(list.Fills[arg].Color);
+          break;
+        case DisplayList::OpKind::LinearGradient: {
+          const DisplayList::LinearGradient& fill = list.LinearGradients[arg];
+          out.layer(fill.Layer);
+          out.gradient(fill.Gradient);
+          out.point(fill.Gradient.start);
+          out.point(fill.Gradient.end);
+          break;
+        }
+        case DisplayList::OpKind::RadialGradient: {
+          const DisplayList::RadialGradient& fill = list.RadialGradients[arg];
+          out.layer(fill.Layer);
+          out.gradient(fill.Gradient);
+          out.point(fill.Gradient.position);
+          out.point(fill.Gradient.radius);
+          break;
+        }
+        case DisplayList::OpKind::ConicGradient: {
+          const DisplayList::ConicGradient& fill = list.ConicGradients[arg];
+          out.layer(fill.Layer);
+          out.gradient(fill.Gradient);
+          out.point(fill.Gradient.position);
+          out.f32(fill.Gradient.angle);
+          out.f32(fill.Gradient.radius);
+          break;
+        }
+        case DisplayList::OpKind::Borders: {
+          const DisplayList::Border& border = list.Borders[arg];
+          out.border(border.Borders.top);
+          out.border(border.Borders.right);
+          out.border(border.Borders.bottom);
+          out.border(border.Borders.left);
+          out.radii(border.Borders.radius);
+          out.position(border.DrawPos);
+          out.u32(border.Root ? 1 : 0);
+          break;
+        }
+        case DisplayList::OpKind::CustomElement: {
+          const DisplayList::Custom& custom = list.Customs[arg];
+          out.str(custom.Tag);
+          out.position(custom.Pos);
+          out.u32((unsigned int)custom.Attributes.size());
+          for (const auto& [name, value] : custom.Attributes) {
+            out.str(name);
+            out.str(value);
+          }
+          break;
+        }
+      }
+    }
+  }
+
+  /**
+   * Records the ops of a capture into the display list through the draw callbacks, as if litehtml drew them. Fonts
+   * are resolved through the config by family and style. Returns false for files that are not captures or are cut
+   * short.
+   */
+  bool load_display_list(CaptureReader& in, ImVec4* visible) {
+    char magic[sizeof(kCaptureMagic)];
+    for (char& c : magic) {
+      c = in.raw<char>();
+    }
+    if (memcmp(magic, kCaptureMagic, sizeof(kCaptureMagic)) != 0 || in.u32() != kCaptureVersion) {
+      return false;
+    }
+
+    ImVec2 visible_min, visible_max;
+    in.point(visible_min);
+    in.point(visible_max);
+    *visible = ImVec4(visible_min.x, visible_min.y, visible_max.x, visible_max.y);
+    litehtml::position clip;
+    in.position(clip);
+
+    std::vector<litehtml::uint_ptr> fonts;
+    const unsigned int font_count = in.u32();
+    for (unsigned int i = 0; i < font_count && in.Ok; ++i) {
+      litehtml::font_description descr{};
+      descr.family = in.str();
+      const FontStyle style = (FontStyle)in.u32();
+      descr.size = (litehtml::pixel_t)in.f32();
+      descr.weight = style == FontStyle::Bold || style == FontStyle::BoldItalic ? 700 : 400;
+      descr.style = style == FontStyle::Italic || style == FontStyle::BoldItalic ? litehtml::font_style_italic
+                                                                                  : litehtml::font_style_normal;
+      fonts.push_back(create_font(descr, nullptr, nullptr));
+    }
+    auto font = [&](unsigned int index) { return index < fonts.size() ? fonts[index] : 0; };
+
+    displayList.clear();
+    const unsigned int op_count = in.u32();
+    for (unsigned int i = 0; i < op_count && in.Ok; ++i) {
+      switch ((DisplayList::OpKind)in.raw<unsigned char>()) {
+        case DisplayList::OpKind::Text: {
+          const litehtml::uint_ptr hFont = font(in.u32());
+          litehtml::web_color color;
+          in.color(color);
+          litehtml::position pos;
+          in.position(pos);
+          const std::string text = in.str();
+          draw_text(0, text.c_str(), hFont, color, pos);
+          break;
+        }
+        case DisplayList::OpKind::ListMarker: {
+          litehtml::list_marker marker{};
+          marker.image = in.str();
+          const std::string baseurl = in.str();
+          marker.baseurl = baseurl.c_str();
+          marker.marker_type = (decltype(marker.marker_type))in.u32();
+          in.color(marker.color);
+          in.position(marker.pos);
+          marker.index = (int)in.u32();
+          marker.font = font(in.u32());
+          draw_list_marker(0, marker);
+          break;
+        }
+        case DisplayList::OpKind::Image: {
+          litehtml::background_layer layer;
+          in.layer(layer);
+          const std::string url = in.str();
+          const std::string base_url = in.str();
+          draw_image(0, layer, url, base_url);
+          break;
+        }
+        case DisplayList::OpKind::SolidFill: {
+          litehtml::background_layer layer;
+          in.layer(layer);
+          litehtml::web_color color;
+          in.color(color);
+          draw_solid_fill(0, layer, color);
+          break;
+        }
+        case DisplayList::OpKind::LinearGradient: {
+          litehtml::background_layer layer;
+          in.layer(layer);
+          litehtml::background_layer::linear_gradient gradient;
+          in.gradient(gradient);
+          in.point(gradient.start);
+          in.point(gradient.end);
+          draw_linear_gradient(0, layer, gradient);
+          break;
+        }
+        case DisplayList::OpKind::RadialGradient: {
+          litehtml::background_layer layer;
+          in.layer(layer);
+          litehtml::background_layer::radial_gradient gradient;
+          in.gradient(gradient);
+          in.point(gradient.position);
+          in.point(gradient.radius);
+          draw_radial_gradient(0, layer, gradient);
+          break;
+        }
+        case DisplayList::OpKind::ConicGradient: {
+          litehtml::background_layer layer;
+          in.layer(layer);
+          litehtml::background_layer::conic_gradient gradient;
+          in.gradient(gradient);
+          in.point(gradient.position);
+          gradient.angle = in.f32();
+          gradient.radius = in.f32();
+          draw_conic_gradient(0, layer, gradient);
+          break;
+        }
+        case DisplayList::OpKind::Borders: {
+          litehtml::borders borders;
+          in.border(borders.top);
+          in.border(borders.right);
+          in.border(borders.bottom);
+          in.border(borders.left);
+          in.radii(borders.radius);
+          litehtml::position draw_pos;
+          in.position(draw_pos);
+          const bool root = in.u32() != 0;
+          draw_borders(0, borders, draw_pos, root);
+          break;
+        }
+        case DisplayList::OpKind::CustomElement: {
+          const std::string tag = in.str();
+          litehtml::position pos;
+          in.position(pos);
+          std::map<std::string, std::string> attributes;
+          const unsigned int attribute_count = in.u32();
+          for (unsigned int a = 0; a < attribute_count && in.Ok; ++a) {
+            std::string name = in.str();
+            attributes[name] = in.str();
+          }
+          record_custom_element(tag, pos, attributes);
+          break;
+        }
+        default:
+          in.Ok = false;
+          break;
+      }
+    }
+
+    displayList.finish();
+    displayList.Clip = clip;
+    return in.Ok;
+  }
+
+  //
+  // Draw bands
+  //
+
+  static constexpr float kMinBandHeight = 64.0f;
+
+  std::vector<std::unique_ptr<ImDrawList>> bandLists;
+
+  /**
+   * Returns the glyphs of every font and size the display list draws text with, for printable ASCII and the other
+   * codepoints of its text. Taken once per recording, and again after the font atlas moved to a new texture, which
+   * remaps the glyphs. Bakes missing glyphs, so it runs on the ImGui thread before the bands start.
+   */
+  const GlyphSnapshot& band_glyphs() {
+    GlyphSnapshot& snapshot = displayList.Glyphs;
+    const ImFontAtlas* atlas = ImGui::GetIO().Fonts;
+    while (snapshot.Texture != atlas->TexData) {
+      snapshot = GlyphSnapshot();
+      snapshot.Texture = atlas->TexData;
+      take_glyphs(snapshot);  // taken again if baking grew the atlas into a new texture
+    }
+    return snapshot;
+  }
+
+  void take_glyphs(GlyphSnapshot& snapshot) const {
+    for (const DisplayList::TextRun& run : displayList.Texts) {
+      const ResolvedFont* rf = from_handle(run.Font);
+      if (!rf || !rf->Font) {
+        continue;
+      }
+
+      ImFontBaked* baked = rf->Font->GetFontBaked(rf->Size);
+      auto [it, inserted] = snapshot.Fonts.try_emplace({rf->Font, rf->Size});
+      BakedGlyphs& glyphs = it->second;
+      if (inserted) {
+        glyphs.Scale = baked->Size > 0.0f ? rf->Size / baked->Size : 1.0f;
+        glyphs.LineHeight = baked->Size * glyphs.Scale;
+        glyphs.Fallback = *baked->FindGlyph(rf->Font->FallbackChar);
+        for (unsigned int c = 32; c < 127; ++c) {
+          glyphs.Ascii[c - 32] = *baked->FindGlyph((ImWchar)c);
+        }
+      }
+
+      const char* text = displayList.Chars.data() + run.Offset;
+      const char* end = text + run.Length;
+      for (const char* p = text; p < end;) {
+        unsigned int c = 0;
+        p += ImTextCharFromUtf8(&c, p, end);
+        if (c >= 127 && c <= IM_UNICODE_CODEPOINT_MAX && !glyphs.Other.count(c)) {
+          glyphs.Other[c] = *baked->FindGlyph((ImWchar)c);
+        }
+      }
+    }
+  }
+
+  /**
+   * Appends the draw commands of src to dst, keeping their clip rects and textures.
+   */
+  static void append_draw_list(ImDrawList* dst, const ImDrawList& src) {
+    for (const ImDrawCmd& cmd : src.CmdBuffer) {
+      if (cmd.ElemCount == 0 || cmd.UserCallback) {
+        continue;
+      }
+
+      const ImDrawIdx* idx = src.IdxBuffer.Data + cmd.IdxOffset;
+      unsigned int first = UINT_MAX, last = 0;
+      for (unsigned int i = 0; i < cmd.ElemCount; ++i) {
+        first = std::min(first, (unsigned int)idx[i]);
+        last = std::max(last, (unsigned int)idx[i]);
+      }
+      const int vtx_count = (int)(last - first + 1);
+
+      dst->PushClipRect(ImVec2(cmd.ClipRect.x, cmd.ClipRect.y), ImVec2(cmd.ClipRect.z, cmd.ClipRect.w));
+      dst->PushTexture(cmd.TexRef);
+      dst->PrimReserve((int)cmd.ElemCount, vtx_count);
+
+      memcpy(dst->_VtxWritePtr, src.VtxBuffer.Data + cmd.VtxOffset + first, vtx_count * sizeof(ImDrawVert));
+      const unsigned int base = dst->_VtxCurrentIdx;
+      for (unsigned int i = 0; i < cmd.ElemCount; ++i) {
+        dst->_IdxWritePtr[i] = (ImDrawIdx)(base + idx[i] - first);
+      }
+      dst->_VtxWritePtr += vtx_count;
+      dst->_IdxWritePtr += cmd.ElemCount;
+      dst->_VtxCurrentIdx += vtx_count;
+
+      dst->PopTexture();
+      dst->PopClipRect();
+    }
+  }
+
+  /**
+   * Emits the visible part of the display list in up to band_count horizontal bands. Each band emits the ops reaching
+   * into its rows into its own draw list on a worker, and the bands are appended to the canvas' draw list in order.
+   * Ops crossing a band edge are emitted by both bands, each clipped to its band. Returns false without drawing when
+   * the visible part is too short to split or custom elements have to draw on the ImGui thread. Must be called right
+   * after begin_draw.
+   */
+  bool draw_bands(int band_count) {
+    if (!displayList.Customs.empty()) {
+      return false;
+    }
+
+    DrawTarget& main = mainTarget;
+    const litehtml::position& clip = displayList.Clip;
+    const float top = std::max(main.BaseClip.y, main.Origin.y + (float)clip.y);
+    const float bottom = std::min(main.BaseClip.w, main.Origin.y + (float)(clip.y + clip.height));
+    band_count = std::min(band_count, (int)((bottom - top) / kMinBandHeight));
+    if (band_count < 2) {
+      return false;
+    }
+
+    const GlyphSnapshot& glyphs = band_glyphs();
+
+    while ((int)bandLists.size() < band_count) {
+      bandLists.push_back(std::make_unique<ImDrawList>(main.DrawList->_Data));
+    }
+
+    std::vector<DrawTarget> targets(band_count);
+    for (int i = 0; i < band_count; ++i) {
+      const float band_top = i == 0 ? top : floorf(top + (bottom - top) * i / band_count);
+      const float band_bottom = i + 1 == band_count ? bottom : floorf(top + (bottom - top) * (i + 1) / band_count);
+
+      ImDrawList* list = bandLists[i].get();
+      list->_ResetForNewFrame();
+      list->Flags = main.DrawList->Flags;
+      list->_FringeScale = main.DrawList->_FringeScale;
+      list->PushTexture(main.DrawList->_CmdHeader.TexRef);
+      list->PushClipRect(ImVec2(main.BaseClip.x, band_top), ImVec2(main.BaseClip.z, band_bottom));
+
+      targets[i].Band = true;
+      targets[i].Glyphs = &glyphs;
+    }
+
+    runParallel(config, band_count, [&](int i) {
+      begin_draw(targets[i], bandLists[i].get(), main.Origin);
+      emit_display_list();
+      end_draw();
+    });
+    drawTarget = &main;
+
+    for (int i = 0; i < band_count; ++i) {
+      append_draw_list(main.DrawList, *bandLists[i]);
+      main.EmittedOps += targets[i].EmittedOps;
+      for (const auto& points : targets[i].PendingRamps) {
+        get_gradient_ramp(points);
+      }
+    }
+    return true;
+  }
+
+  //
+  // Clipping functions
+  //
+
+  virtual void set_clip(const litehtml::position& pos, const litehtml::border_radiuses& bdr_radius) override {}
+  virtual void del_clip() override {}
+
+  //
+  // Layout functions
+  //
+
+  virtual void get_viewport(litehtml::position& client) const override {
+    client.x = 0;
+    client.y = 0;
+    client.width = width > 0 ? width : available_size().x;
+    client.height = available_size().y;
+  }
+
+  virtual litehtml::element::ptr create_element(const char* tag_name, const litehtml::string_map& attributes,
+                                                const std::shared_ptr<litehtml::document>& doc) override {
+    const bool custom = offThread ? offThread->CustomElements.count(tag_name) > 0
+                                  : customElements().find(tag_name) != customElements().end();
+    if (custom) {
+      return std::make_shared<CustomElement>(doc, tag_name, attributes);
+    }
+
+    // Elements are created before their images are requested, so remember which ones may load lazily
+    if (strcmp(tag_name, "img") == 0) {
+      auto loading = attributes.find("loading");
+      auto src = attributes.find("src");
+      if (loading != attributes.end() && src != attributes.end() && loading->second == "lazy") {
+        lazyImages.insert(src->second);
+      }
+    }
+
+    return nullptr;
+  }
+
+  virtual void get_media_features(litehtml::media_features& media) const override {
+    media.color = 8;
+    media.resolution = 96;
+    const ImVec2 available = available_size();
+    media.width = width > 0 ? width : available.x;
+    media.height = available.y;
+    media.device_width = width > 0 ? width : available.x;
+    media.device_height = available.y;
+    media.type = litehtml::media_type_screen;
+  }
+
+  virtual void get_language(litehtml::string& language, litehtml::string& culture) const override {
+    language = "en";
+    culture = "US";
+  }
+};
+
+void CustomElement::draw_background(litehtml::uint_ptr hdc, litehtml::pixel_t x, litehtml::pixel_t y,
+                                    const litehtml::position* clip, const std::shared_ptr<litehtml::render_item>& ri) {
+  // Let the base class draw background color/image and borders first.
+  litehtml::html_tag::draw_background(hdc, x, y, clip, ri);
+
+  // ri->pos() is the element's own content box relative to its parent.
+  // x/y carry the accumulated offset from all ancestors.
+  // Together they give the absolute document position and correct size.
+  litehtml::position pos = ri->pos();
+  pos.x += x;
+  pos.y += y;
+
+  static_cast<BrowserContainer*>(get_document()->container())->record_custom_element(this->tag, pos, this->attributes);
+}
+
+namespace {
+
+struct CanvasState {
+  std::shared_ptr<BrowserContainer> container;
+  std::shared_ptr<litehtml::document> doc;
+  std::string html;
+  long long last_active_time;
+  CanvasStats stats;
+  bool needs_layout = true;
+  int layout_width = 0;
+  unsigned long long background_layout = 0;  // generation of the background layout in flight, 0 when none
+  std::string background_html;               // html it lays out
+};
+
+static std::unordered_map<std::string, CanvasState>& canvasStates();
+
+// Generations of background layouts, unique across canvases so a result never lands in a recreated state
+static unsigned long long& backgroundLayoutGenerations();
+
+// Source file of a CanvasFile canvas, and the stamps of the stylesheets it imports
+struct WatchedFile {
+  std::string Path;
+  FileStamp Stamp;
+  std::string Html;
+  double LastCheck = 0.0;
+  std::unordered_map<std::string, FileStamp> Styles;
+};
+
+static std::unordered_map<std::string, WatchedFile>& canvasFiles();
+
+/**
+ * Stats the source of a CanvasFile canvas and its stylesheets. Reloads the source and invalidates stylesheets whose
+ * stamp changed. Returns whether the source changed.
+ */
+static bool pollCanvasFile(const char* id, const char* path, WatchedFile& file) {
+  bool changed = false;
+
+  FileStamp stamp;
+  statFile(path, &stamp);
+  if (file.Path != path || !(file.Stamp == stamp)) {
+    IMHTML_PRINTF("[ImHTML] Reloading %s\n", path);
+    file.Path = path;
+    file.Stamp = stamp;
+    file.Html.assign(DefaultFileView(path).Data);
+    changed = true;
+  }
+
+  if (auto state = canvasStates().find(id); state != canvasStates().end() && state->second.container) {
+    for (const auto& [key, hash] : state->second.container->get_imported_styles()) {
+      auto sheet = styleSheets().find(key);
+      if (sheet == styleSheets().end() || !statFile(sheet->second.Url.c_str(), &stamp)) {
+        continue;
+      }
+
+      auto [it, inserted] = file.Styles.try_emplace(sheet->second.Url, stamp);
+      if (!inserted && !(it->second == stamp)) {
+        it->second = stamp;
+        sheet->second.Stale = true;
+      }
+    }
+  }
+
+  return changed;
+}
+
+/**
+ * Releases the texture an image drew before its upgrade, unless another image shows the same content. One drawn this
+ * or the previous frame is released by the next eviction pass that finds it unused for longer.
+ */
+static void retireImageTexture(const Config& cfg, ImU64 content) {
+  auto it = imageTextures().find(content);
+  if (it == imageTextures().end() || !cfg.DestroyTexture) {
+    return;
+  }
+  for (const auto& [key, image] : images()) {
+    if (image.Status == ImageStatus::Ready && image.Content == content) {
+      return;
+    }
+  }
+
+  if (it->second.LastUsedFrame < ImGui::GetFrameCount() - 1) {
+    releaseImageTexture(cfg, it);
+  } else {
+    it->second.Retired = true;
+  }
+}
+
+/**
+ * Uploads a decoded image and marks the canvases waiting for it for layout if its size was not known yet.
+ */
+static void completeImage(DecodedImage& result) {
+  const Config& cfg = getCurrentConfig();
+
+  auto it = images().find(result.Key);
+  if (it == images().end()) {
+    return;
+  }
 
-      const ImU32 col = to_im_col32(sample_gradient_color(gradient.color_points, t));
-      draw_convex_shaded_polygon(draw_list, clipped, [&](const ImVec2&) -> ImU32 { return col; });
+  ImageEntry& image = it->second;
+  const ImageData& data = result.Image;
+  const bool resized = image.Width != result.SourceWidth || image.Height != result.SourceHeight;
+  const bool upgrade = image.Redecoding;
+  image.Redecoding = false;
+
+  ImTextureID texture = 0;
+  ImU64 content = 0;
+  if (result.Ok && !data.Pixels.empty()) {
+    // A texture of another image that only shares the hash is stepped over, the key stays odd and so never 0
+    content = result.Content;
+    auto existing = imageTextures().find(content);
+    while (existing != imageTextures().end() &&
+           (existing->second.Width != data.Width || existing->second.Height != data.Height ||
+            existing->second.PixelBytes != data.Pixels.size())) {
+      content += 2;
+      existing = imageTextures().find(content);
+    }
+    if (existing != imageTextures().end()) {
+      texture = existing->second.Texture;
+      existing->second.Retired = false;
+    } else if (const ImageTexture* uploaded = uploadImage(cfg, content, data)) {
+      texture = uploaded->Texture;
     }
+  }
 
-    // Fill the center with t=0 color.
-    {
-      const std::vector<ImVec2> center_poly =
-          build_ellipse_polygon(center, rx, ry, 1.0f / (float)ring_count, ellipse_segments);
+  if (!texture && upgrade) {
+    // Keep drawing the lower resolution
+    return;
+  }
 
-      std::vector<ImVec2> clipped = clip_polygon_convex(center_poly, fill_poly);
-      if (clipped.size() >= 3) {
-        const ImU32 col = to_im_col32(sample_gradient_color(gradient.color_points, 0.0f));
-        draw_convex_shaded_polygon(draw_list, clipped, [&](const ImVec2&) -> ImU32 { return col; });
+  const ImU64 previous = image.Content;
+  image.Status = texture ? ImageStatus::Ready : ImageStatus::Failed;
+  image.Content = content;
+  image.Width = result.SourceWidth;
+  image.Height = result.SourceHeight;
+  image.TextureWidth = data.Width;
+  image.TextureHeight = data.Height;
+  if (upgrade && previous != content) {
+    retireImageTexture(cfg, previous);
+  }
+
+  if (!texture) {
+    IMHTML_PRINTF("[ImHTML] Failed to load image: %s\n", result.Key.c_str());
+  }
+
+  if (resized || !texture) {
+    for (const std::string& id : image.WaitingCanvases) {
+      if (auto state = canvasStates().find(id); state != canvasStates().end()) {
+        state->second.needs_layout = true;
       }
     }
   }
+  image.WaitingCanvases.clear();
+}
 
-  void draw_conic_gradient_impl(const LayerGeometry& lgm, const litehtml::background_layer::conic_gradient& gradient) {
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
-
-    const ImVec2 screen_pos = ImGui::GetCursorScreenPos();
-    const ImVec2 center = screen_pos + ImVec2(gradient.position.x, gradient.position.y);
+}  // namespace
 
-    const float radius = gradient.radius;
-    if (radius <= 0.0001f || gradient.color_points.empty()) {
-      return;
+/**
+ * Everything an ImHTML instance keeps between frames. Jobs hold a reference, so a destroyed context is only freed once
+ * the last job it started finished.
+ */
+struct Context : std::enable_shared_from_this<Context> {
+  Config config = Config{
+      .BaseFontSize = 16,
+      .LoadCSS = DefaultFileLoader,
+  };
+  std::vector<Config> configStack;
+  std::unordered_map<std::string, CustomElementDrawFunction> customElements;
+
+  std::unordered_map<std::string, CanvasState> canvasStates;
+  std::unordered_map<std::string, WatchedFile> canvasFiles;
+  unsigned long long backgroundLayoutGenerations = 0;
+  std::atomic<Completion*> completions{nullptr};
+
+  std::unordered_map<std::string, ImageEntry> images;
+  std::unordered_map<ImU64, ImageTexture> imageTextures;
+  size_t imageTextureBytes = 0;
+  int evictionFrame = -1;
+  std::vector<AtlasPage> atlasPages;
+  std::unordered_map<ImU64, GradientRamp> gradientTextures;
+  std::unordered_map<ImU64, CachedShape> shapeCache;
+  unsigned long long shapeCacheUses = 0;
+  std::unordered_map<std::string, StyleSheet> styleSheets;
+  std::mutex bandMutex;
+
+  std::shared_ptr<Context> self;  // released by DestroyContext
+
+  ~Context() {
+    // Completions nobody drained any more. Their captures release what they own in the right order themselves, see
+    // BackgroundLayoutResult.
+    Completion* completion = completions.exchange(nullptr);
+    while (completion) {
+      Completion* next = completion->Next;
+      delete completion;
+      completion = next;
     }
 
-    const std::vector<ImVec2> fill_poly = build_layer_fill_polygon(lgm, 12);
-
-    const int wedge_count = 128;
-    const int arc_segments_per_wedge = 1;
+    for (auto& [id, state] : canvasStates) {
+      state.doc.reset();
+      state.container.reset();
+    }
+  }
+};
 
-    for (int i = 0; i < wedge_count; ++i) {
-      const float t0 = (float)i / (float)wedge_count;
-      const float t1 = (float)(i + 1) / (float)wedge_count;
+namespace {
 
-      const float a0 = gradient.angle + t0 * 360.0f;
-      const float a1 = gradient.angle + t1 * 360.0f;
+// Used by threads that never set a context. Looked up on every use instead of being stored in currentContext, so
+// destroying it leaves no other thread pointing at it.
+std::mutex defaultContextMutex;
+std::atomic<Context*> defaultContext{nullptr};
 
-      const std::vector<ImVec2> wedge = build_conic_wedge_polygon(center, radius, a0, a1, arc_segments_per_wedge);
+static Context* newContext() {
+  auto context = std::make_shared<Context>();
+  context->self = context;
+  return context.get();
+}
 
-      std::vector<ImVec2> clipped = clip_polygon_convex(wedge, fill_poly);
-      if (clipped.size() < 3) {
-        continue;
-      }
+/**
+ * Makes a context current on this thread for the lifetime of the scope.
+ */
+struct ContextScope {
+  Context* Previous;
 
-      const ImU32 col = to_im_col32(sample_gradient_color(gradient.color_points, t0));
+  explicit ContextScope(Context* context) : Previous(currentContext) { currentContext = context; }
+  ~ContextScope() { currentContext = Previous; }
+};
 
-      draw_convex_shaded_polygon(draw_list, clipped, [&](const ImVec2&) -> ImU32 { return col; });
-    }
+static Context& ctx() {
+  if (currentContext) {
+    return *currentContext;
   }
 
-  template <typename Gradient, typename DrawFn>
-  void draw_gradient_common(litehtml::uint_ptr hdc, const litehtml::background_layer& layer, const Gradient& gradient,
-                            DrawFn&& draw_fn) {
-    const litehtml::position& bg_box = layer.border_box;
-    const litehtml::position& clip_box = layer.clip_box;
+  usingDefaultContext = true;
+  if (Context* context = defaultContext.load(std::memory_order_acquire)) {
+    return *context;
+  }
+  std::lock_guard<std::mutex> lock(defaultContextMutex);
+  if (!defaultContext.load(std::memory_order_relaxed)) {
+    defaultContext.store(newContext(), std::memory_order_release);
+  }
+  return *defaultContext.load(std::memory_order_relaxed);
+}
 
-    if (bg_box.width <= 0 || bg_box.height <= 0 || clip_box.width <= 0 || clip_box.height <= 0) {
-      return;
-    }
+static std::function<void()> bindContext(std::function<void()> job) {
+  return [context = ctx().shared_from_this(), job = std::move(job)] {
+    ContextScope scope(context.get());
+    job();
+  };
+}
 
-    if (gradient.color_points.empty()) {
-      return;
-    }
+const Config& getCurrentConfig() {
+  const Context& context = ctx();
+  return context.configStack.empty() ? context.config : context.configStack.back();
+}
 
-    LayerGeometry lgm = this->get_layer_geometry(layer);
-    ImDrawList* draw_list = ImGui::GetWindowDrawList();
+static std::unordered_map<std::string, CustomElementDrawFunction>& customElements() { return ctx().customElements; }
+static std::unordered_map<ImU64, GradientRamp>& gradientTextures() { return ctx().gradientTextures; }
+static std::unordered_map<ImU64, CachedShape>& shapeCache() { return ctx().shapeCache; }
+static unsigned long long& shapeCacheUses() { return ctx().shapeCacheUses; }
+static std::atomic<Completion*>& completions() { return ctx().completions; }
+static std::unordered_map<std::string, ImageEntry>& images() { return ctx().images; }
+static std::unordered_map<ImU64, ImageTexture>& imageTextures() { return ctx().imageTextures; }
+static size_t& imageTextureBytes() { return ctx().imageTextureBytes; }
+static int& evictionFrame() { return ctx().evictionFrame; }
+static std::vector<AtlasPage>& atlasPages() { return ctx().atlasPages; }
+static std::unordered_map<std::string, StyleSheet>& styleSheets() { return ctx().styleSheets; }
+static std::mutex& bandMutex() { return ctx().bandMutex; }
+static std::unordered_map<std::string, CanvasState>& canvasStates() { return ctx().canvasStates; }
+static unsigned long long& backgroundLayoutGenerations() { return ctx().backgroundLayoutGenerations; }
+static std::unordered_map<std::string, WatchedFile>& canvasFiles() { return ctx().canvasFiles; }
 
-    draw_list->PushClipRect(lgm.clip_min, lgm.clip_max, true);
-    draw_fn(lgm, gradient);
-    draw_list->PopClipRect();
+/**
+ * Destroys the textures of the current context through Config::DestroyTexture.
+ */
+static void destroyContextTextures() {
+  const Config& cfg = getCurrentConfig();
+  if (!cfg.DestroyTexture) {
+    return;
+  }
 
-    push_bottom_right(ImVec2((float)(bg_box.x + bg_box.width), (float)(bg_box.y + bg_box.height)));
+  for (const auto& [content, texture] : imageTextures()) {
+    if (texture.Page < 0) {
+      cfg.DestroyTexture(texture.Texture);
+    }
+  }
+  for (const AtlasPage& page : atlasPages()) {
+    if (page.Texture) {
+      cfg.DestroyTexture(page.Texture);
+    }
+  }
+  for (const auto& [hash, ramp] : gradientTextures()) {
+    cfg.DestroyTexture(ramp.Texture);
   }
+}
 
-  virtual void draw_linear_gradient(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
-                                    const litehtml::background_layer::linear_gradient& gradient) override {
-    const ImVec2 screen_pos = ImGui::GetCursorScreenPos();
-    const ImVec2 start = screen_pos + ImVec2(gradient.start.x, gradient.start.y);
-    const ImVec2 end = screen_pos + ImVec2(gradient.end.x, gradient.end.y);
-    const ImVec2 axis = end - start;
-    const float axis_len_sq = axis.x * axis.x + axis.y * axis.y;
+}  // namespace
 
-    if (axis_len_sq <= 0.0001f) {
-      if (!gradient.color_points.empty()) {
-        draw_solid_fill(hdc, layer, gradient.color_points.back().color);
-      }
-      return;
-    }
+Context* CreateContext() {
+  Context* context = newContext();
+  if (!currentContext && !usingDefaultContext) {
+    currentContext = context;
+  }
+  return context;
+}
 
-    draw_gradient_common(
-        hdc, layer, gradient, [&](const LayerGeometry& lgm, const auto& g) { draw_linear_gradient_impl(lgm, g); });
+void DestroyContext(Context* context) {
+  if (!context) {
+    context = GetCurrentContext();
+  }
+  if (!context) {
+    return;
   }
 
-  virtual void draw_radial_gradient(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
-                                    const litehtml::background_layer::radial_gradient& gradient) override {
-    draw_gradient_common(
-        hdc, layer, gradient, [&](const LayerGeometry& lgm, const auto& g) { draw_radial_gradient_impl(lgm, g); });
+  {
+    ContextScope scope(context);
+    destroyContextTextures();
+    for (auto& [id, state] : canvasStates()) {
+      // The document has to go before its container
+      state.doc.reset();
+      state.container.reset();
+    }
+    canvasStates().clear();
   }
 
-  virtual void draw_conic_gradient(litehtml::uint_ptr hdc, const litehtml::background_layer& layer,
-                                   const litehtml::background_layer::conic_gradient& gradient) override {
-    draw_gradient_common(
-        hdc, layer, gradient, [&](const LayerGeometry& lgm, const auto& g) { draw_conic_gradient_impl(lgm, g); });
+  if (currentContext == context) {
+    currentContext = nullptr;
+  }
+  {
+    std::lock_guard<std::mutex> lock(defaultContextMutex);
+    if (defaultContext.load(std::memory_order_relaxed) == context) {
+      defaultContext.store(nullptr, std::memory_order_release);
+      usingDefaultContext = false;
+    }
   }
+  context->self.reset();
+}
 
-  virtual void on_mouse_event(const litehtml::element::ptr& el, litehtml::mouse_event event) override {
-    // TODO
+Context* GetCurrentContext() {
+  if (currentContext) {
+    return currentContext;
   }
+  return usingDefaultContext ? defaultContext.load(std::memory_order_acquire) : nullptr;
+}
 
-  virtual void draw_borders(litehtml::uint_ptr hdc, const litehtml::borders& borders,
-                            const litehtml::position& draw_pos, bool root) override {
-    ImVec2 base_pos = ImGui::GetCursorScreenPos();
-    ImVec2 top_left = base_pos + ImVec2(draw_pos.x, draw_pos.y);
-    ImVec2 top_right = base_pos + ImVec2(draw_pos.x + draw_pos.width, draw_pos.y);
-    ImVec2 bottom_right = base_pos + ImVec2(draw_pos.x + draw_pos.width, draw_pos.y + draw_pos.height);
-    ImVec2 bottom_left = base_pos + ImVec2(draw_pos.x, draw_pos.y + draw_pos.height);
+void SetCurrentContext(Context* context) {
+  currentContext = context;
+  usingDefaultContext = false;
+}
 
-    auto* draw_list = ImGui::GetWindowDrawList();
+Config* GetConfig() { return &ctx().config; }
+void SetConfig(const Config& newConfig) { ctx().config = newConfig; }
+void PushConfig(const Config& config) { ctx().configStack.push_back(config); }
+void PopConfig() {
+  assert(!ctx().configStack.empty());
+  ctx().configStack.pop_back();
+}
 
-    // Check if all sides and colors are equal
-    if (borders.top.width == borders.right.width && borders.top.width == borders.bottom.width &&
-        borders.top.width == borders.left.width && borders.top.color == borders.right.color &&
-        borders.top.color == borders.bottom.color && borders.top.color == borders.left.color) {
-      float w = borders.top.width;
-      if (w > 0) {
-        // ImGui path strokes are centered. We must offset the path inward by half the width
-        // to conform to the CSS Box Model (borders grow inwards from the bounding box).
-        float half_w = w * 0.5f;
-        ImVec2 p_min = top_left + ImVec2(half_w, half_w);
-        ImVec2 p_max = bottom_right - ImVec2(half_w, half_w);
+bool GetCanvasStats(const char* id, CanvasStats* stats) {
+  auto it = canvasStates().find(id);
+  if (it == canvasStates().end()) {
+    return false;
+  }
 
-        // We also must reduce the border radius by half the width so the outer edge matches CSS.
-        float tl = std::max(0.0f, (float)borders.radius.top_left_x - half_w);
-        float tr = std::max(0.0f, (float)borders.radius.top_right_x - half_w);
-        float br = std::max(0.0f, (float)borders.radius.bottom_right_x - half_w);
-        float bl = std::max(0.0f, (float)borders.radius.bottom_left_x - half_w);
+  if (stats) {
+    *stats = it->second.stats;
+  }
+  return true;
+}
 
-        ImU32 color =
-            IM_COL32(borders.top.color.red, borders.top.color.green, borders.top.color.blue, borders.top.color.alpha);
+bool CaptureDisplayList(const char* id, const char* path) {
+  auto it = canvasStates().find(id);
+  if (it == canvasStates().end() || !it->second.container->has_display_list()) {
+    return false;
+  }
 
-        if (tl == tr && tr == br && br == bl) {
-          draw_list->AddRect(p_min, p_max, color, tl, 0, w);
-        } else {
-          draw_list->PathClear();
-          if (tl > 0.0f)
-            draw_list->PathArcTo(ImVec2(p_min.x + tl, p_min.y + tl), tl, IM_PI, IM_PI * 1.5f);
-          else
-            draw_list->PathLineTo(ImVec2(p_min.x, p_min.y));
-
-          if (tr > 0.0f)
-            draw_list->PathArcTo(ImVec2(p_max.x - tr, p_min.y + tr), tr, IM_PI * 1.5f, IM_PI * 2.0f);
-          else
-            draw_list->PathLineTo(ImVec2(p_max.x, p_min.y));
-
-          if (br > 0.0f)
-            draw_list->PathArcTo(ImVec2(p_max.x - br, p_max.y - br), br, 0.0f, IM_PI * 0.5f);
-          else
-            draw_list->PathLineTo(ImVec2(p_max.x, p_max.y));
-
-          if (bl > 0.0f)
-            draw_list->PathArcTo(ImVec2(p_min.x + bl, p_max.y - bl), bl, IM_PI * 0.5f, IM_PI);
-          else
-            draw_list->PathLineTo(ImVec2(p_min.x, p_max.y));
-
-          draw_list->PathStroke(color, ImDrawFlags_Closed, w);
-        }
-      }
-    } else {
-      // The Non-Uniform Path (Mitered Borders via Quads)
-      auto color32 = [](const litehtml::web_color& c) { return IM_COL32(c.red, c.green, c.blue, c.alpha); };
+  CaptureWriter out;
+  it->second.container->capture_display_list(out);
 
-      // Top border
-      if (borders.top.width > 0) {
-        draw_list->AddQuadFilled(top_left,
-                                 ImVec2(bottom_right.x, top_left.y),
-                                 ImVec2(bottom_right.x - borders.right.width, top_left.y + borders.top.width),
-                                 ImVec2(top_left.x + borders.left.width, top_left.y + borders.top.width),
-                                 color32(borders.top.color));
-      }
+  ImFileHandle file = ImFileOpen(path, "wb");
+  if (!file) {
+    IMHTML_PRINTF("[ImHTML] Failed to write %s\n", path);
+    return false;
+  }
+  const bool written = ImFileWrite(out.Bytes.data(), 1, out.Bytes.size(), file) == out.Bytes.size();
+  ImFileClose(file);
+  return written;
+}
 
-      // Bottom border
-      if (borders.bottom.width > 0) {
-        draw_list->AddQuadFilled(ImVec2(top_left.x + borders.left.width, bottom_right.y - borders.bottom.width),
-                                 ImVec2(bottom_right.x - borders.right.width, bottom_right.y - borders.bottom.width),
-                                 bottom_right,
-                                 ImVec2(top_left.x, bottom_right.y),
-                                 color32(borders.bottom.color));
-      }
+bool ReplayDisplayList(const char* path, ImDrawList* draw_list, int iterations, ReplayStats* stats) {
+  size_t size = 0;
+  void* data = ImFileLoadToMemory(path, "rb", &size);
+  if (!data) {
+    IMHTML_PRINTF("[ImHTML] Failed to read %s\n", path);
+    return false;
+  }
 
-      // Left border
-      if (borders.left.width > 0) {
-        draw_list->AddQuadFilled(top_left,
-                                 ImVec2(top_left.x + borders.left.width, top_left.y + borders.top.width),
-                                 ImVec2(top_left.x + borders.left.width, bottom_right.y - borders.bottom.width),
-                                 ImVec2(top_left.x, bottom_right.y),
-                                 color32(borders.left.color));
-      }
+  // A container without a document, only the display list is loaded into it
+  BrowserContainer container(0.0f);
+  container.set_config(getCurrentConfig());
+
+  CaptureReader in{.Data = static_cast<const unsigned char*>(data), .Size = size};
+  ImVec4 visible;
+  const bool loaded = container.load_display_list(in, &visible);
+  IM_FREE(data);
+  if (!loaded) {
+    IMHTML_PRINTF("[ImHTML] Not a display list capture: %s\n", path);
+    return false;
+  }
 
-      // Right border
-      if (borders.right.width > 0) {
-        draw_list->AddQuadFilled(ImVec2(bottom_right.x - borders.right.width, top_left.y + borders.top.width),
-                                 ImVec2(bottom_right.x, top_left.y),
-                                 bottom_right,
-                                 ImVec2(bottom_right.x - borders.right.width, bottom_right.y - borders.bottom.width),
-                                 color32(borders.right.color));
-      }
-    }
+  ReplayStats result;
+  result.Iterations = std::max(iterations, 0);
+  result.Ops = container.get_display_list().size();
+  result.MinTime = result.Iterations > 0 ? FLT_MAX : 0.0f;
+
+  float total = 0.0f;
+  for (int i = 0; i < result.Iterations; ++i) {
+    draw_list->_ResetForNewFrame();
+    draw_list->PushTexture(ImGui::GetIO().Fonts->TexRef);
+    draw_list->PushClipRect(ImVec2(visible.x, visible.y), ImVec2(visible.z, visible.w));
+
+    const auto start = std::chrono::high_resolution_clock::now();
+    BrowserContainer::begin_draw(container.mainTarget, draw_list, ImVec2(0, 0));
+    container.emit_display_list();
+    BrowserContainer::end_draw();
+    const float time = std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - start).count();
+
+    result.MinTime = std::min(result.MinTime, time);
+    result.MaxTime = std::max(result.MaxTime, time);
+    total += time;
+  }
 
-    push_bottom_right(ImVec2(draw_pos.x + draw_pos.width, draw_pos.y + draw_pos.height));
+  result.MeanTime = result.Iterations > 0 ? total / (float)result.Iterations : 0.0f;
+  result.EmittedOps = container.emitted_ops();
+  result.Vertices = draw_list->VtxBuffer.Size;
+  result.Indices = draw_list->IdxBuffer.Size;
+  if (stats) {
+    *stats = result;
   }
-  //
-  // Document related functions
-  //
+  return true;
+}
 
-  virtual void set_caption(const char* caption) override { title = caption; }
-  virtual void set_base_url(const char* base_url) override {}
-  virtual void link(const std::shared_ptr<litehtml::document>& doc, const litehtml::element::ptr& el) override {}
-  virtual void on_anchor_click(const char* url, const litehtml::element::ptr& el) override {
-    history.push_back(currentUrl);
-    loadUrl = url;
+void GetAtlasStats(AtlasStats* stats) {
+  if (!stats) {
+    return;
   }
-  virtual void set_cursor(const char* cursor) override {
-    if (std::string(cursor) == "pointer" && ImGui::IsWindowHovered()) {
-      ImGui::SetMouseCursor(ImGuiMouseCursor_Hand);
+
+  *stats = AtlasStats{};
+  long long used = 0, total = 0;
+  for (const AtlasPage& page : atlasPages()) {
+    if (!page.Texture) {
+      continue;
     }
+    stats->Pages++;
+    stats->Images += page.Slots;
+    used += page.UsedArea;
+    total += (long long)page.Size * page.Size;
   }
-  virtual void transform_text(std::string& text, litehtml::text_transform tt) override {}
-  virtual void import_css(std::string& text, const std::string& url, std::string& baseurl) override {
-    if (!config.LoadCSS) {
-      return;
+  stats->Occupancy = total > 0 ? (float)((double)used / (double)total) : 0.0f;
+}
+
+void InvalidateCSS(const char* url) {
+  for (auto& [key, sheet] : styleSheets()) {
+    if (url == nullptr || sheet.Url == url) {
+      sheet.Stale = true;
     }
-    text = config.LoadCSS(url.c_str(), baseurl.c_str());
   }
+}
 
-  //
-  // Clipping functions
-  //
+void RegisterCustomElement(const char* tagName, CustomElementDrawFunction draw) { customElements()[tagName] = draw; }
 
-  virtual void set_clip(const litehtml::position& pos, const litehtml::border_radiuses& bdr_radius) override {}
-  virtual void del_clip() override {}
+void UnregisterCustomElement(const char* tagName) { customElements().erase(tagName); }
 
-  //
-  // Layout functions
-  //
+static std::shared_ptr<litehtml::document> createDocument(const char* html, BrowserContainer* container,
+                                                          const Config& cfg) {
+  if (cfg.PrefetchResources) {
+    prefetchResources(cfg, html);
+  }
 
-  virtual void get_viewport(litehtml::position& client) const override {
-    client.x = 0;
-    client.y = 0;
-    client.width = width > 0 ? width : ImGui::GetContentRegionAvail().x;
-    client.height = ImGui::GetContentRegionAvail().y;
+  return litehtml::document::createFromString(html, container, masterCSS(cfg), cfg.UserCSS);
+}
+
+/**
+ * A document laid out on a worker with its container. Releases the document first, also when its completion is
+ * dropped undrained, the document has to go before its container.
+ */
+struct BackgroundLayoutResult {
+  std::shared_ptr<BrowserContainer> Container;
+  std::shared_ptr<litehtml::document> Doc;
+
+  ~BackgroundLayoutResult() { Doc.reset(); }
+};
+
+/**
+ * Swaps a document laid out on a worker in, unless the canvas is gone or started another background layout since.
+ */
+static void finishBackgroundLayout(const std::string& id, unsigned long long generation,
+                                   BackgroundLayoutResult& result, std::string& html, int width) {
+  auto it = canvasStates().find(id);
+  if (it == canvasStates().end() || it->second.background_layout != generation) {
+    return;
   }
 
-  virtual litehtml::element::ptr create_element(const char* tag_name, const litehtml::string_map& attributes,
-                                                const std::shared_ptr<litehtml::document>& doc) override {
-    if (customElements.find(tag_name) != customElements.end()) {
-      return std::make_shared<CustomElement>(doc, tag_name, attributes);
+  CanvasState& state = it->second;
+  const bool relayout = result.Container->end_off_thread();
+
+  state.doc.reset();
+  state.container = std::move(result.Container);
+  state.doc = std::move(result.Doc);
+  state.html = std::move(html);
+  state.layout_width = width;
+  state.needs_layout = relayout;
+  state.background_layout = 0;
+  state.background_html.clear();
+}
+
+/**
+ * Captures everything a container needs from ImGui and the ImGui-thread caches to lay out html on a worker. imported
+ * are the stylesheets the canvas's current document imported, by the keys import_css looked them up with.
+ */
+static std::unique_ptr<OffThreadLayout> captureOffThreadLayout(const Config& cfg, const char* html,
+                                                               const ImVec2& viewport,
+                                                               const std::unordered_map<std::string, ImU64>& imported) {
+  auto layout = std::make_unique<OffThreadLayout>();
+  layout->Fonts = captureFonts(cfg, html);
+  layout->Viewport = viewport;
+
+  if (useAsyncImages(cfg)) {
+    for (const auto& [key, image] : images()) {
+      if (image.Width > 0 && image.Height > 0) {
+        layout->ImageSizes.emplace(key, ImageMeta{image.Width, image.Height});
+      }
     }
+  }
 
-    return nullptr;
+  for (const auto& [tag, draw] : customElements()) {
+    layout->CustomElements.insert(tag);
   }
 
-  virtual void get_media_features(litehtml::media_features& media) const override {
-    media.color = 8;
-    media.resolution = 96;
-    media.width = width > 0 ? width : ImGui::GetContentRegionAvail().x;
-    media.height = ImGui::GetContentRegionAvail().y;
-    media.device_width = width > 0 ? width : ImGui::GetContentRegionAvail().x;
-    media.device_height = ImGui::GetContentRegionAvail().y;
-    media.type = litehtml::media_type_screen;
+  // Keys as import_css builds them: <link> stylesheets come without a base URL, @imports with their sheet's. The
+  // previous document's imports cover nested @imports the html does not show.
+  std::vector<std::string> keys, sources;
+  scanResources(html, keys, sources);
+  for (std::string& url : keys) {
+    url = resourceKey(url.c_str(), "");
+  }
+  for (const auto& [key, hash] : imported) {
+    keys.push_back(key);
   }
 
-  virtual void get_language(litehtml::string& language, litehtml::string& culture) const override {
-    language = "en";
-    culture = "US";
+  // Loads still in flight are left out: a prefetch is a queued pool job, and the layout job waiting for it could hold
+  // the worker that would run it. The worker loads those itself.
+  for (const std::string& key : keys) {
+    auto it = styleSheets().find(key);
+    if (it == styleSheets().end()) {
+      continue;
+    }
+    const StyleSheet& sheet = it->second;
+    if (!sheet.Stale && (sheet.Loaded || sheet.Load.valid()) && isStyleSheetReady(sheet)) {
+      layout->Styles.emplace(key, sheet);
+    }
   }
-};
 
-Config* GetConfig() { return &config; }
-void SetConfig(const Config& newConfig) { config = newConfig; }
-void PushConfig(const Config& config) { configStack.push_back(config); }
-void PopConfig() {
-  assert(!configStack.empty());
-  configStack.pop_back();
+  return layout;
 }
 
-void RegisterCustomElement(const char* tagName, CustomElementDrawFunction draw) { customElements[tagName] = draw; }
-
-void UnregisterCustomElement(const char* tagName) { customElements.erase(tagName); }
+/**
+ * Parses and lays out html for a canvas on a worker with a fresh container. The canvas keeps drawing its current
+ * document until the new one is swapped in by a completion.
+ */
+static void startBackgroundLayout(const char* id, CanvasState& state, const char* html, float width,
+                                  const ImVec2& viewport, const Config& cfg) {
+  if (cfg.PrefetchResources) {
+    prefetchResources(cfg, html);
+  }
 
-bool Canvas(const char* id, const char* html, float width, std::string* clickedURL) {
-  struct state {
-    std::shared_ptr<BrowserContainer> container;
-    std::shared_ptr<litehtml::document> doc;
-    std::string html;
-    long long last_active_time;
-  };
+  auto container = std::make_shared<BrowserContainer>(width, id);
+  container->set_config(cfg);
+  container->begin_off_thread(captureOffThreadLayout(cfg, html, viewport, state.container->get_imported_styles()));
+
+  const unsigned long long generation = ++backgroundLayoutGenerations();
+  state.background_layout = generation;
+  state.background_html = html;
+
+  runJob(cfg,
+         JobPriority::Normal,
+         [id = std::string(id),
+          generation,
+          container,
+          html = std::string(html),
+          master = std::string(masterCSS(cfg)),
+          user = cfg.UserCSS,
+          render_width = (int)viewport.x]() mutable {
+           auto doc = litehtml::document::createFromString(html.c_str(), container.get(), master, user);
+           doc->render(render_width);
+
+           // The worker keeps no reference, so both are released on the ImGui thread
+           postCompletion([id = std::move(id),
+                           generation,
+                           result = BackgroundLayoutResult{std::move(container), std::move(doc)},
+                           html = std::move(html),
+                           render_width]() mutable {
+             finishBackgroundLayout(id, generation, result, html, render_width);
+           });
+         });
+}
 
-  static std::unordered_map<std::string, state> states = {};
-
-  if (states.find(id) == states.end()) {
-    auto container = std::make_shared<BrowserContainer>(width);
-    container->set_config(getCurrentConfig());
-    container->reset();
-    states[id] = state{
-        .container = container,
-        .doc = litehtml::document::createFromString(html, container.get()),
-        .html = html,
-        .last_active_time = std::chrono::high_resolution_clock::now().time_since_epoch().count(),
-    };
+static CanvasState& getCanvasState(const char* id, float width) {
+  auto [it, inserted] = canvasStates().try_emplace(id);
+  if (inserted) {
+    it->second.container = std::make_shared<BrowserContainer>(width, id);
   }
+  it->second.last_active_time = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+  return it->second;
+}
 
-  auto& state = states[id];
+/**
+ * Lays out, draws and handles input for a canvas. html is only compared against the current document when
+ * html_may_change is set.
+ */
+static bool drawCanvas(const char* id, const char* html, bool html_may_change, float width,
+                       std::string* clickedURL) {
+  auto& states = canvasStates();
+
+  const Config currentConfig = getCurrentConfig();
+  drainCompletions();
+  if (useAsyncImages(currentConfig)) {
+    evictImageTextures(currentConfig);
+  }
 
-  if (state.html != html) {
-    state.doc = litehtml::document::createFromString(html, state.container.get());
-    state.html = html;
+  auto& state = getCanvasState(id, width);
+
+  state.container->set_config(currentConfig);
+
+  const int render_width = width > 0 ? (int)width : (int)ImGui::GetContentRegionAvail().x;
+  if (!state.doc || (html_may_change && state.html != html) || state.container->imported_styles_changed()) {
+    if (!currentConfig.BackgroundLayout) {
+      state.container->reset_document();
+      state.doc = createDocument(html, state.container.get(), currentConfig);
+      state.html = html;
+      state.needs_layout = true;
+      state.background_layout = 0;
+    } else if (!state.background_layout || (html_may_change && state.background_html != html)) {
+      startBackgroundLayout(
+          id, state, html, width, ImVec2((float)render_width, ImGui::GetContentRegionAvail().y), currentConfig);
+    }
   }
 
-  state.last_active_time = std::chrono::high_resolution_clock::now().time_since_epoch().count();
+  if (!state.doc) {
+    // The first document of the canvas is still being laid out on a worker
+    return false;
+  }
 
-  state.container->set_config(getCurrentConfig());
-  state.container->reset();
+  if (!currentConfig.PaintBeforeStyles && state.container->styles_pending()) {
+    // Nothing to show until the stylesheets arrived
+    return false;
+  }
 
-  int render_width = width > 0 ? (int)width : (int)ImGui::GetContentRegionAvail().x;
-  state.doc->render(render_width);
+  // Layout only runs when something changed: new content, a new width, an image that arrived or an interaction.
+  if (state.needs_layout || state.layout_width != render_width) {
+    state.doc->render(render_width);
+    state.layout_width = render_width;
+    state.needs_layout = false;
+    state.container->invalidate_display_list();
+  }
 
   litehtml::position clip(
       0, 0, render_width, std::max((int)state.doc->height(), (int)ImGui::GetContentRegionAvail().y));
-  state.doc->draw(0, 0, 0, &clip);
+
+  // The draw traversal runs once per layout, every frame only emits the recorded ops
+  if (!state.container->display_list_current(state.doc.get(), clip)) {
+    state.container->record_display_list(*state.doc, clip);
+  }
+
+  ImDrawList* draw_list = ImGui::GetWindowDrawList();
+  const int first_idx = draw_list->IdxBuffer.Size;
+  const int first_vtx = draw_list->VtxBuffer.Size;
+  const auto emit_start = std::chrono::high_resolution_clock::now();
+
+  state.container->begin_draw(draw_list);
+  if (currentConfig.DrawBands < 2 || !state.container->draw_bands(currentConfig.DrawBands)) {
+    state.container->emit_display_list();
+  }
+  state.container->end_draw();
+
+  state.stats.EmitTime =
+      std::chrono::duration<float>(std::chrono::high_resolution_clock::now() - emit_start).count();
+  state.stats.RecordTime = state.container->get_display_list().RecordTime;
+  state.stats.DisplayListOps = state.container->get_display_list().size();
+  state.stats.EmittedOps = state.container->emitted_ops();
+  state.stats.Vertices = draw_list->VtxBuffer.Size - first_vtx;
+  state.stats.Indices = draw_list->IdxBuffer.Size - first_idx;
+  state.stats.DrawCommands = 0;
+  for (const ImDrawCmd& cmd : draw_list->CmdBuffer) {
+    if (cmd.ElemCount > 0 && (int)(cmd.IdxOffset + cmd.ElemCount) > first_idx) {
+      state.stats.DrawCommands++;
+    }
+  }
 
   auto x = ImGui::GetMousePos().x - ImGui::GetCursorScreenPos().x;
   auto y = ImGui::GetMousePos().y - ImGui::GetCursorScreenPos().y;
 
   litehtml::position::vector pos;
   if (ImGui::IsMouseDown(ImGuiMouseButton_Left)) {
-    state.doc->on_lbutton_down(x, y, x, y, pos);
+    state.needs_layout |= state.doc->on_lbutton_down(x, y, x, y, pos);
   }
   if (ImGui::IsMouseReleased(ImGuiMouseButton_Left)) {
-    state.doc->on_lbutton_up(x, y, x, y, pos);
+    state.needs_layout |= state.doc->on_lbutton_up(x, y, x, y, pos);
   }
-  state.doc->on_mouse_over(x, y, x, y, pos);
+  state.needs_layout |= state.doc->on_mouse_over(x, y, x, y, pos);
 
   const ImRect bb(ImGui::GetCursorScreenPos(), ImGui::GetCursorScreenPos() + state.container->get_bottom_right());
   ImGui::ItemSize(bb.GetSize());
@@ -1152,6 +5451,7 @@ bool Canvas(const char* id, const char* html, float width, std::string* clickedU
       it->second.doc.reset();
       it->second.container.reset();
 
+      canvasFiles().erase(it->first);
       it = states.erase(it);
     } else {
       ++it;
@@ -1160,4 +5460,113 @@ bool Canvas(const char* id, const char* html, float width, std::string* clickedU
 
   return false;
 }
+
+void LayoutCanvases(const CanvasLayout* canvases, int count) {
+  const Config cfg = getCurrentConfig();
+  drainCompletions();
+
+  struct LayoutJob {
+    CanvasState* State;
+    std::shared_ptr<BrowserContainer> Container;
+    std::shared_ptr<litehtml::document> Doc;  // empty until parsed when the html changed
+    std::string Html;
+    int Width;
+  };
+
+  std::vector<LayoutJob> jobs;
+  std::vector<std::pair<std::string, std::string>> sheets;  // requested by the documents to parse
+  std::set<const CanvasState*> queued;
+  for (int i = 0; i < count; ++i) {
+    const CanvasLayout& canvas = canvases[i];
+    CanvasState& state = getCanvasState(canvas.Id, canvas.Width);
+    state.container->set_config(cfg);
+
+    const int width = canvas.Width > 0 ? (int)canvas.Width : (int)ImGui::GetContentRegionAvail().x;
+    const bool parse = !state.doc || state.html != canvas.Html || state.container->imported_styles_changed();
+    if ((!parse && !state.needs_layout && state.layout_width == width) || !queued.insert(&state).second) {
+      continue;
+    }
+
+    LayoutJob job{.State = &state, .Html = canvas.Html, .Width = width};
+    if (parse) {
+      job.Container = std::make_shared<BrowserContainer>(canvas.Width, canvas.Id);
+      job.Container->set_config(cfg);
+
+      std::vector<std::string> styles, images;
+      scanResources(canvas.Html, styles, images);
+      for (std::string& url : styles) {
+        sheets.emplace_back(std::move(url), std::string());
+      }
+      for (const auto& [key, hash] : state.container->get_imported_styles()) {
+        if (auto it = styleSheets().find(key); it != styleSheets().end()) {
+          sheets.emplace_back(it->second.Url, it->second.BaseUrl);
+        }
+      }
+    } else {
+      // Only laid out again, by its own container
+      job.Container = state.container;
+      job.Doc = state.doc;
+    }
+    jobs.push_back(std::move(job));
+  }
+
+  // Stylesheets shared by several documents are loaded once up front, the layout jobs then only copy them. A layout
+  // job must not wait for a prefetch, which is a queued pool job that may need the worker the layout job holds.
+  loadStyleSheetsParallel(cfg, sheets);
+
+  const float viewport_height = ImGui::GetContentRegionAvail().y;
+  for (LayoutJob& job : jobs) {
+    if (!job.Doc && cfg.PrefetchResources) {
+      // Only images are left to prefetch
+      prefetchResources(cfg, job.Html.c_str());
+    }
+    const ImVec2 viewport((float)job.Width, viewport_height);
+    job.Container->begin_off_thread(
+        captureOffThreadLayout(cfg, job.Html.c_str(), viewport, job.State->container->get_imported_styles()));
+  }
+
+  // The ImGui thread is blocked until all jobs are done, so they can share the stylesheets without copying them
+  const std::string master = masterCSS(cfg);
+  auto layout = [&master, &cfg](LayoutJob& job) {
+    if (!job.Doc) {
+      job.Doc = litehtml::document::createFromString(job.Html, job.Container.get(), master, cfg.UserCSS);
+    }
+    job.Doc->render(job.Width);
+  };
+
+  runParallel(cfg, (int)jobs.size(), [&](int i) { layout(jobs[i]); });
+
+  for (LayoutJob& job : jobs) {
+    CanvasState& state = *job.State;
+    const bool relayout = job.Container->end_off_thread();
+
+    if (job.Container != state.container) {
+      state.doc.reset();
+      state.container = std::move(job.Container);
+      state.doc = std::move(job.Doc);
+      state.html = std::move(job.Html);
+      state.background_layout = 0;
+    }
+    state.layout_width = job.Width;
+    state.needs_layout = relayout;
+  }
+}
+
+bool Canvas(const char* id, const char* html, float width, std::string* clickedURL) {
+  return drawCanvas(id, html, true, width, clickedURL);
+}
+
+bool CanvasFile(const char* id, const char* path, float width, std::string* clickedURL) {
+  WatchedFile& file = canvasFiles()[id];
+
+  // Between polls the cached document is drawn as is, without touching the file or comparing its content
+  bool changed = false;
+  const double now = ImGui::GetTime();
+  if (file.Path != path || now - file.LastCheck >= getCurrentConfig().FileWatchInterval) {
+    file.LastCheck = now;
+    changed = pollCanvasFile(id, path, file);
+  }
+
+  return drawCanvas(id, file.Html.c_str(), changed, width, clickedURL);
+}
 };  // namespace ImHTML
@@ -1,8 +1,12 @@
 #pragma once
 
 #include <functional>
+#include <future>
 #include <map>
+#include <memory>
 #include <string>
+#include <string_view>
+#include <vector>
 
 #include "imgui.h"
 #include "imgui_internal.h"
@@ -27,6 +31,25 @@ struct ImageMeta {
   int Height;
 };
 
+/**
+ * Priority of background work, higher priorities run first
+ */
+enum class JobPriority : unsigned char {
+  Visible,   // needed for what is on screen right now
+  Normal,    // needed by a document being parsed or laid out
+  Prefetch,  // speculative
+};
+
+/**
+ * Decoded image pixels, tightly packed RGBA8
+ */
+struct ImageData {
+  int Width = 0;
+  int Height = 0;
+  std::vector<unsigned char> Pixels;
+  std::vector<ImageData> Mips;  // successively halved levels, filled when Config::GenerateImageMips is set
+};
+
 /**
  * A font family, containing different styles of the same font.
  */
@@ -43,6 +66,14 @@ struct FontFamily {
 struct Config {
   float BaseFontSize = 16.0f;
 
+  // Snap axis-aligned, unrounded fills, borders and images to whole pixels and draw them without the anti-aliasing
+  // fringe. Rounded shapes and fractional border widths stay anti-aliased.
+  bool PixelSnapBoxes = false;
+
+  // Group primitives by texture (font atlas, each image, gradient ramps) into ImDrawListSplitter channels whenever
+  // that does not change the drawing order of overlapping primitives. Reduces draw calls on image-heavy pages.
+  bool BatchByTexture = false;
+
   // fallback when not found in FontFamilies, or no specific family provided
   FontFamily DefaultFont;
 
@@ -53,6 +84,131 @@ struct Config {
   std::function<ImageMeta(const char *src, const char *baseurl)> GetImageMeta;
   std::function<ImTextureID(const char *src, const char *baseurl)> GetImageTexture;
   std::function<std::string(const char *url, const char *baseurl)> LoadCSS;
+
+  // Optional: loads stylesheets without blocking the ImGui thread, used instead of LoadCSS when set. A document is
+  // drawn unstyled until all its stylesheets arrived when PaintBeforeStyles is set, otherwise not at all, and is then
+  // parsed again with all of them at once.
+  std::function<std::shared_future<std::string>(const char *url, const char *baseurl)> LoadCSSAsync;
+  bool PaintBeforeStyles = false;
+
+  // Scan new documents for stylesheets and images and start loading all of them in parallel on worker threads before
+  // parsing. LoadCSS (and DecodeImage) must then be thread-safe, DefaultFileLoader is.
+  bool PrefetchResources = false;
+
+  // Seconds between checks of CanvasFile sources and their stylesheets for changes, 0 checks every frame
+  float FileWatchInterval = 0.5f;
+
+  // Stylesheet every document starts from, litehtml's built-in master stylesheet when empty
+  std::string MasterCSS;
+
+  // Stylesheet applied to every document after the master stylesheet, e.g. a shared theme
+  std::string UserCSS;
+
+  // Optional: runs ImHTML's background work (image decoding, stylesheet loading, ...) on your own thread pool instead
+  // of the built-in one. Jobs may run on any thread in any order, higher priorities should run first.
+  std::function<void(JobPriority priority, std::function<void()> job)> Executor;
+
+  // Parse and lay out new and changed documents on a worker thread. The canvas keeps drawing its previous document
+  // (a new canvas nothing) until the result is swapped in at the start of a later frame. Text is measured from a
+  // snapshot of the fonts' advances taken on the ImGui thread. LoadCSS, LoadCSSAsync, ProbeImageSize and GetImageMeta
+  // are then also called from workers and must be thread-safe.
+  bool BackgroundLayout = false;
+
+  // Split the visible part of tall documents into up to DrawBands horizontal bands whose geometry is generated in
+  // parallel on workers, then appended to the window draw list in order. Text is drawn from a snapshot of its glyphs,
+  // taken once per layout. Ignored while custom elements are registered. Images may then be requested from workers, so
+  // a custom Executor has to accept jobs from any thread, and GetImageTexture must be thread-safe when used.
+  int DrawBands = 1;
+
+  // Asynchronous image loading, used instead of LoadImage/GetImageMeta/GetImageTexture when both are set.
+  // DecodeImage runs on a worker thread and must be thread-safe, CreateTexture uploads the pixels on the ImGui thread.
+  // Canvases waiting for an image are laid out again once it is ready.
+  std::function<bool(const char *src, const char *baseurl, ImageData *out)> DecodeImage;
+  std::function<ImTextureID(const ImageData &image)> CreateTexture;
+
+  // Set when textures from CreateTexture/GetImageTexture use repeat (wrap) addressing. Repeating backgrounds are then
+  // drawn as one quad with UVs past 1 instead of one quad per tile.
+  bool ImageTexturesRepeat = false;
+
+  // Layout size of images that are still loading, for images without width/height attributes
+  ImageMeta ImagePlaceholderSize = {0, 0};
+
+  // Optional: reads the size of an image from its header without decoding it (e.g. stbi_info).
+  // Lets layout happen right away and defers decoding until the image is drawn. Must be thread-safe.
+  std::function<bool(const char *src, const char *baseurl, int *width, int *height)> ProbeImageSize;
+
+  // Optional: destroys a texture returned by CreateTexture. Enables evicting the least recently drawn
+  // images once their textures, including whole atlas pages, exceed ImageCacheBudget bytes.
+  std::function<void(ImTextureID texture)> DestroyTexture;
+  size_t ImageCacheBudget = 256 * 1024 * 1024;
+
+  // Images with loading="lazy", or all images when LazyLoadImages is set, are only decoded once their box comes
+  // within LazyLoadMargin pixels of the visible area. Until then they are laid out with their declared or probed size.
+  bool LazyLoadImages = false;
+  float LazyLoadMargin = 256.0f;
+
+  // Decode images at no more than the largest size they are drawn at, and again at a higher resolution when
+  // they are later drawn larger. GenerateImageMips additionally passes a mip chain to CreateTexture.
+  bool DownscaleImages = false;
+  bool GenerateImageMips = false;
+
+  // Optional: images of at most AtlasMaxImageSize pixels per side are packed into shared AtlasPageSize textures,
+  // so icon-heavy documents bind fewer textures and need fewer draw calls. UpdateTexture writes pixels into a region
+  // of a texture created by CreateTexture.
+  std::function<void(ImTextureID texture, int x, int y, const ImageData &image)> UpdateTexture;
+  int AtlasMaxImageSize = 0;
+  int AtlasPageSize = 1024;
+
+  // Optional: create a 1D ramp texture (width x 1 RGBA8 pixels) for gradients. When set, linear and radial gradients
+  // are drawn as a few textured primitives sampling the ramp instead of dense colour-interpolated meshes. The texture
+  // should use linear filtering and clamp-to-edge addressing. With DestroyTexture set, the least recently drawn ramps
+  // are destroyed once there are more than 256.
+  std::function<ImTextureID(const unsigned char *rgba, int width)> CreateGradientTexture;
+};
+
+/**
+ * Draw statistics of a canvas, measured the last time it was drawn
+ */
+struct CanvasStats {
+  int DrawCommands = 0;  // ImDrawCmds that received geometry from the canvas
+  int Vertices = 0;
+  int Indices = 0;
+  int DisplayListOps = 0;   // draw ops recorded from the last layout
+  int EmittedOps = 0;       // ops emitted, the others were culled as out of view
+  float RecordTime = 0.0f;  // seconds the last recording of the display list took
+  float EmitTime = 0.0f;    // seconds emitting the display list took
+};
+
+/**
+ * Occupancy of the small image atlas
+ */
+struct AtlasStats {
+  int Pages = 0;
+  int Images = 0;
+  float Occupancy = 0.0f;  // fraction of page area used by live images
+};
+
+/**
+ * Timings of a display list replay, see ReplayDisplayList
+ */
+struct ReplayStats {
+  int Iterations = 0;
+  int Ops = 0;         // ops in the display list
+  int EmittedOps = 0;  // ops emitted per iteration, the others were culled as out of view
+  int Vertices = 0;    // per iteration
+  int Indices = 0;
+  float MinTime = 0.0f;  // seconds per iteration
+  float MeanTime = 0.0f;
+  float MaxTime = 0.0f;
+};
+
+/**
+ * A canvas to lay out ahead of drawing it, see LayoutCanvases
+ */
+struct CanvasLayout {
+  const char *Id = nullptr;
+  const char *Html = nullptr;
+  float Width = 0.0f;  // as passed to Canvas, 0.0f for the available width at the time of the call
 };
 
 /**
@@ -63,15 +219,91 @@ struct Config {
  */
 typedef std::function<void(ImRect bounds, std::map<std::string, std::string> attributes)> CustomElementDrawFunction;
 
+/**
+ * A read-only view of a file in the default loader's cache
+ */
+struct FileView {
+  std::string_view Data;
+  std::shared_ptr<const void> Owner;  // keeps Data mapped while alive, empty if the file could not be read
+
+  explicit operator bool() const { return Owner != nullptr; }
+};
+
 /**
  * Default file loader for loading CSS files
  *
+ * Files are read, or memory-mapped from 1 MiB on, and the 64 most recently used are cached by path. A repeated load
+ * only stats the file and reads it again when its modification time or size changed.
+ *
  * @param url Expects a relative local path to the CSS file
  * @param baseurl The base URL of the CSS file (not used)
  * @return The content of the CSS file
  */
 std::string DefaultFileLoader(const char *url, const char *baseurl);
 
+/**
+ * Like DefaultFileLoader, but returns a view into the cached mapping instead of a copy
+ *
+ * Views of memory-mapped files see later writes to the file, and truncating the file while such a view is alive
+ * makes reading past the new end crash (SIGBUS). Large files that are edited in place should be copied out of the
+ * view right away, as DefaultFileLoader does.
+ *
+ * @param url Expects a relative local path to the file
+ * @return The content of the file, valid as long as the view is alive
+ */
+FileView DefaultFileView(const char *url);
+
+/**
+ * Invalidate cached stylesheets
+ *
+ * Stylesheets from Config::LoadCSS are loaded once and shared by all canvases. After invalidation they are loaded
+ * again on next use, and canvases whose stylesheets changed content are parsed again.
+ *
+ * @param url The url as passed to Config::LoadCSS, or nullptr to invalidate all stylesheets
+ */
+void InvalidateCSS(const char *url = nullptr);
+
+/**
+ * An ImHTML instance: its configuration stack, custom elements, canvases and caches
+ *
+ * Like ImGuiContext, a default context is created on first use. Create more to run independent instances, for example
+ * a headless renderer on a worker thread next to the UI. The current context is per thread, background jobs run with
+ * the context that started them.
+ */
+struct Context;
+
+/**
+ * Create a context, made current if the calling thread has none
+ *
+ * @return The new context
+ */
+Context *CreateContext();
+
+/**
+ * Destroy a context, its canvases and, through Config::DestroyTexture, its textures
+ *
+ * No other thread may be using the context during the call. Threads running on the default context get a new default
+ * context on their next call. Threads that made the context current with SetCurrentContext keep pointing at it and
+ * must set another one before their next call.
+ *
+ * @param ctx The context, or nullptr for the current one
+ */
+void DestroyContext(Context *ctx = nullptr);
+
+/**
+ * Get the context of the calling thread
+ *
+ * @return The context, or nullptr if none was set or used yet
+ */
+Context *GetCurrentContext();
+
+/**
+ * Set the context of the calling thread
+ *
+ * @param ctx The context, or nullptr for the default context
+ */
+void SetCurrentContext(Context *ctx);
+
 /**
  * Get the current configuration
  *
@@ -113,6 +345,63 @@ void RegisterCustomElement(const char *tagName, CustomElementDrawFunction draw);
  */
 void UnregisterCustomElement(const char *tagName);
 
+/**
+ * Get the draw statistics of a canvas
+ *
+ * @param id The ID of the canvas
+ * @param stats Receives the statistics of the last frame the canvas was drawn
+ * @return False if no canvas with this ID is alive
+ */
+bool GetCanvasStats(const char *id, CanvasStats *stats);
+
+/**
+ * Write the display list of a canvas to a file
+ *
+ * The file holds every draw call of the document as the canvas last recorded them, with their full arguments, the
+ * family, style and size of the fonts behind the font handles, and the visible area of the last frame. It can be
+ * attached to a bug report and replayed with ReplayDisplayList without the page or its resources.
+ *
+ * @param id The ID of the canvas
+ * @param path The file to write
+ * @return False if the canvas has not been drawn since its last layout or the file could not be written
+ */
+bool CaptureDisplayList(const char *id, const char *path);
+
+/**
+ * Emit a display list written by CaptureDisplayList, repeatedly and with timing
+ *
+ * Only the emission code runs: no parsing, layout or litehtml draw traversal. Fonts are resolved through the current
+ * config by family and style, images and custom elements the same way a canvas would. Must be called within an ImGui
+ * frame.
+ *
+ * @param path The capture to replay
+ * @param draw_list Reset before each iteration and left with the geometry of the last one
+ * @param iterations How often to emit the display list
+ * @param stats Receives the timings, may be nullptr
+ * @return False if the file could not be read or is not a capture
+ */
+bool ReplayDisplayList(const char *path, ImDrawList *draw_list, int iterations, ReplayStats *stats);
+
+/**
+ * Get the occupancy of the small image atlas
+ *
+ * @param stats Receives the number of pages, packed images and the used fraction of the page area
+ */
+void GetAtlasStats(AtlasStats *stats);
+
+/**
+ * Lay out canvases in parallel before drawing them
+ *
+ * Parses changed documents and lays out the canvases that need it concurrently on worker threads (Config::Executor or
+ * the built-in pool), and returns once all are done. Call it with the canvases of a frame before drawing them with
+ * Canvas, which then only draws. Text is measured like with Config::BackgroundLayout, the same callbacks must be
+ * thread-safe. A custom Executor must run the jobs while this call waits for them.
+ *
+ * @param canvases The canvases, each ID at most once
+ * @param count The number of canvases
+ */
+void LayoutCanvases(const CanvasLayout *canvases, int count);
+
 /**
  * Render the HTML
  *
@@ -123,4 +412,18 @@ void UnregisterCustomElement(const char *tagName);
  * @return True if any link was clicked, false otherwise
  */
 bool Canvas(const char *id, const char *html, float width = 0.0f, std::string *clickedURL = nullptr);
+
+/**
+ * Render a HTML file, reloading it when it changes
+ *
+ * The file and the stylesheets it imports are checked every Config::FileWatchInterval seconds and the document is
+ * only parsed again when their modification time or size changed.
+ *
+ * @param id The ID of the canvas
+ * @param path The path of the HTML file
+ * @param width The width of the canvas (0.0f for using available space)
+ * @param clickedURL The URL that was clicked (if any)
+ * @return True if any link was clicked, false otherwise
+ */
+bool CanvasFile(const char *id, const char *path, float width = 0.0f, std::string *clickedURL = nullptr);
 };  // namespace ImHTML
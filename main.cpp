@@ -1,8 +1,11 @@
 #include <stdio.h>
 
 #include <fstream>
+#include <functional>
+#include <map>
 #include <sstream>
 #include <string>
+#include <vector>
 
 // ImHTML
 #include "imhtml.hpp"
@@ -32,28 +35,18 @@
 #include "../libs/emscripten/emscripten_mainloop_stub.h"
 #endif
 
-GLuint LoadTextureFromFile(const char *filename, int *width, int *height) {
-  int channels;
-  unsigned char *data = stbi_load(filename, width, height, &channels, 4);
-  if (!data) {
-    fprintf(stderr, "Failed to load image: %s\n", filename);
-    return 0;
-  }
-
+GLuint CreateTextureFromPixels(const unsigned char *rgba, int width, int height) {
   GLuint tex;
   glGenTextures(1, &tex);
   glBindTexture(GL_TEXTURE_2D, tex);
 
-  // Upload to GPU
-  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, *width, *height, 0, GL_RGBA, GL_UNSIGNED_BYTE, data);
+  glTexImage2D(GL_TEXTURE_2D, 0, GL_RGBA, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, rgba);
 
-  // Texture parameters
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
   glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
 
-  stbi_image_free(data);
   return tex;
 }
 
@@ -81,6 +74,18 @@ static std::string ReplaceAll(std::string str, const std::string &from, const st
   return str;
 }
 
+// Adds the example fonts to the atlas and registers them as font families
+static void SetupFonts(ImFontAtlas *fonts, ImHTML::Config *config) {
+  fonts->AddFontDefault();
+  ImFont *sans_font = fonts->AddFontFromFileTTF("fonts/NotoSans-Regular.ttf", 18.0f);
+  ImFont *mono_font = fonts->AddFontFromFileTTF("fonts/JetBrainsMono-Regular.ttf", 18.0f);
+
+  ImHTML::FontFamily mono = {.Regular = mono_font, .Bold = mono_font, .Italic = mono_font, .BoldItalic = mono_font};
+  config->FontFamilies["monospace"] = mono;
+  ImHTML::FontFamily sans = {.Regular = sans_font, .Bold = sans_font, .Italic = sans_font, .BoldItalic = sans_font};
+  config->FontFamilies["sans-serif"] = sans;
+}
+
 // Main code
 int main(int, char **) {
   glfwSetErrorCallback(GlfwErrorCallback);
@@ -139,47 +144,54 @@ int main(int, char **) {
 
   ImHTML::Config *config = ImHTML::GetConfig();
 
-  std::unordered_map<std::string, std::tuple<GLuint, ImHTML::ImageMeta>> image_cache;
-
-  config->GetImageMeta = [&](const char *url, const char *baseurl) {
-    if (image_cache.find(url) != image_cache.end()) {
-      return std::get<1>(image_cache[url]);
+  // Images are decoded on worker threads and uploaded on the main thread once ready
+  config->DecodeImage = [](const char *src, const char *baseurl, ImHTML::ImageData *out) {
+    int width, height, channels;
+    unsigned char *data = stbi_load(src, &width, &height, &channels, 4);
+    if (data == nullptr) {
+      return false;
     }
 
-    int width, height;
-    GLuint id = LoadTextureFromFile(url, &width, &height);
-    image_cache[url] = std::make_tuple(id, ImHTML::ImageMeta{.Width = width, .Height = height});
-    printf("[GetImageMeta] %s width: %d height: %d id: %d\n", url, width, height, id);
-    return std::get<1>(image_cache[url]);
+    out->Width = width;
+    out->Height = height;
+    out->Pixels.assign(data, data + (size_t)width * height * 4);
+    stbi_image_free(data);
+    return true;
   };
-  config->LoadImage = [&](const char *url, const char *baseurl) {
-    if (image_cache.find(url) != image_cache.end()) {
-      return std::get<0>(image_cache[url]);
+  config->CreateTexture = [](const ImHTML::ImageData &image) {
+    GLuint tex = CreateTextureFromPixels(image.Pixels.data(), image.Width, image.Height);
+    if (!image.Mips.empty()) {
+      for (size_t level = 0; level < image.Mips.size(); ++level) {
+        const ImHTML::ImageData &mip = image.Mips[level];
+        glTexImage2D(GL_TEXTURE_2D, (GLint)level + 1, GL_RGBA, mip.Width, mip.Height, 0, GL_RGBA, GL_UNSIGNED_BYTE,
+                     mip.Pixels.data());
+      }
+      glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
     }
-    int width, height;
-    GLuint id = LoadTextureFromFile(url, &width, &height);
-    image_cache[url] = std::make_tuple(id, ImHTML::ImageMeta{.Width = width, .Height = height});
-    printf("[LoadImage] %s width: %d height: %d id: %d\n", url, width, height, id);
-    return id;
+    return (ImTextureID)tex;
   };
-  config->GetImageTexture = [&](const char *url, const char *baseurl) {
-    if (image_cache.find(url) != image_cache.end()) {
-      GLuint id = std::get<0>(image_cache[url]);
-      return (ImTextureID)id;
-    }
-    return (ImTextureID)0;
+  config->ProbeImageSize = [](const char *src, const char *baseurl, int *width, int *height) {
+    int channels;
+    return stbi_info(src, width, height, &channels) != 0;
   };
+  config->DestroyTexture = [](ImTextureID texture) {
+    GLuint tex = (GLuint)(intptr_t)texture;
+    glDeleteTextures(1, &tex);
+  };
+  config->DownscaleImages = true;
+  config->GenerateImageMips = true;
+  config->UpdateTexture = [](ImTextureID texture, int x, int y, const ImHTML::ImageData &image) {
+    glBindTexture(GL_TEXTURE_2D, (GLuint)(intptr_t)texture);
+    glTexSubImage2D(GL_TEXTURE_2D, 0, x, y, image.Width, image.Height, GL_RGBA, GL_UNSIGNED_BYTE, image.Pixels.data());
+  };
+  config->AtlasMaxImageSize = 64;
 
-  // Setup fonts
-  ImFontAtlas *fonts = io.Fonts;
-  fonts->AddFontDefault();
-  ImFont *sans_font = fonts->AddFontFromFileTTF("fonts/NotoSans-Regular.ttf", 18.0f);
-  ImFont *mono_font = fonts->AddFontFromFileTTF("fonts/JetBrainsMono-Regular.ttf", 18.0f);
+  config->CreateGradientTexture = [](const unsigned char *rgba, int width) {
+    return (ImTextureID)CreateTextureFromPixels(rgba, width, 1);
+  };
 
-  ImHTML::FontFamily mono = {.Regular = mono_font, .Bold = mono_font, .Italic = mono_font, .BoldItalic = mono_font};
-  config->FontFamilies["monospace"] = mono;
-  ImHTML::FontFamily sans = {.Regular = sans_font, .Bold = sans_font, .Italic = sans_font, .BoldItalic = sans_font};
-  config->FontFamilies["sans-serif"] = sans;
+  // Setup fonts
+  SetupFonts(io.Fonts, config);
 
   // Setup scaling
   ImGuiStyle &style = ImGui::GetStyle();
@@ -198,7 +210,7 @@ int main(int, char **) {
   // Load example HTML files
   struct Example {
     const char *label;
-    std::function<void(std::string)> render;
+    std::function<std::string(std::string)> render;  // returns the ID of the canvas it drew
   };
   int clicks = 0;
   std::string hello_world_tmpl = LoadFile("examples/hello_world.html");
@@ -206,18 +218,26 @@ int main(int, char **) {
       {"Hello, World!",
        [&clicks, &hello_world_tmpl](std::string id) {
          std::string html = ReplaceAll(hello_world_tmpl, "{clicks}", std::to_string(clicks));
+         std::string canvas_id = id + "_" + std::to_string(clicks);
          std::string clicked_url;
-         if (ImHTML::Canvas((id + "_" + std::to_string(clicks)).c_str(), html.c_str(), 0.0f, &clicked_url)) clicks++;
+         if (ImHTML::Canvas(canvas_id.c_str(), html.c_str(), 0.0f, &clicked_url)) clicks++;
+         return canvas_id;
        }},
+      // Edits to these files show up live
       {"HTML Canvas",
-       [html = LoadFile("examples/html_canvas.html")](std::string id) { ImHTML::Canvas(id.c_str(), html.c_str()); }},
+       [](std::string id) {
+         ImHTML::CanvasFile(id.c_str(), "examples/html_canvas.html");
+         return id;
+       }},
       {"Borders, Fonts & Gradients",
-       [html = LoadFile("examples/borders_and_stuff.html")](std::string id) {
-         ImHTML::Canvas(id.c_str(), html.c_str());
+       [](std::string id) {
+         ImHTML::CanvasFile(id.c_str(), "examples/borders_and_stuff.html");
+         return id;
        }},
       {"Custom Components",
-       [html = LoadFile("examples/custom_components.html")](std::string id) {
-         ImHTML::Canvas(id.c_str(), html.c_str());
+       [](std::string id) {
+         ImHTML::CanvasFile(id.c_str(), "examples/custom_components.html");
+         return id;
        }},
   };
   int selected = 0;
@@ -288,7 +308,13 @@ int main(int, char **) {
       // Right panel: HTML canvas
       ImGui::BeginChild("##canvas", ImVec2(0, 0), ImGuiChildFlags_None);
 
-      examples[selected].render(examples[selected].label);
+      const std::string canvas_id = examples[selected].render(examples[selected].label);
+
+      // F12 captures the canvas for replaying its draw calls with imhtml_checks --replay
+      if (ImGui::IsKeyPressed(ImGuiKey_F12)) {
+        const bool captured = ImHTML::CaptureDisplayList(canvas_id.c_str(), "capture.imdl");
+        printf(captured ? "Captured %s to capture.imdl\n" : "Failed to capture %s\n", canvas_id.c_str());
+      }
 
       ImGui::EndChild();
 